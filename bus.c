@@ -0,0 +1,150 @@
+#include "bus.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+
+#define BUS_LISTENER_MAX (4)
+#define BUS_RETRY_USEC (1000000U)
+
+// Shared connection to the system bus, kept open so signals can be received
+static sd_bus *s_bus = NULL;
+static sd_event *s_event = NULL;
+// Replaces the system bus when set, e.g. to run against a stand-in manager on a private bus
+static char *s_address = NULL;
+static bus_reconnect_cb s_listeners[BUS_LISTENER_MAX];
+static size_t s_listener_cnt = 0;
+
+static int bus_retry(sd_event_source *p_source, uint64_t usec, void *p_userdata)
+{
+    (void)p_source;
+    (void)usec;
+    (void)p_userdata;
+
+    if (!bus_system() && s_event)
+        (void)sd_event_add_time_relative(s_event, NULL, CLOCK_MONOTONIC, BUS_RETRY_USEC, 0, bus_retry, NULL);
+    return 0;
+}
+
+// Reconnects from the event loop, so signal matches are back without waiting for the next method call
+static int bus_disconnected(sd_bus_message *m, void *p_userdata, sd_bus_error *p_ret_error)
+{
+    (void)m;
+    (void)p_userdata;
+    (void)p_ret_error;
+
+    LOG_WRN("%s", "Lost the connection to the system bus, reconnecting");
+    if (s_event)
+        (void)sd_event_add_time_relative(s_event, NULL, CLOCK_MONOTONIC, BUS_RETRY_USEC, 0, bus_retry, NULL);
+    return 0;
+}
+
+static void bus_subscribe(sd_bus *p_bus)
+{
+    sd_bus_error error = SD_BUS_ERROR_NULL;
+    // systemd only emits unit and job signals while at least one client is subscribed
+    if (sd_bus_call_method(p_bus, "org.freedesktop.systemd1", "/org/freedesktop/systemd1",
+                           "org.freedesktop.systemd1.Manager", "Subscribe", &error, NULL, "") < 0)
+    {
+        LOG_WRN("Failed to subscribe to systemd signals: %s", error.message);
+    }
+    sd_bus_error_free(&error);
+}
+
+sd_bus *bus_system(void)
+{
+    static bool s_connected = false;
+    int rc = 0;
+
+    if (s_bus && (sd_bus_is_open(s_bus) > 0))
+        return s_bus;
+    s_bus = sd_bus_flush_close_unref(s_bus);
+
+    if (s_address)
+    {
+        rc = sd_bus_new(&s_bus);
+        if (rc >= 0)
+            rc = sd_bus_set_address(s_bus, s_address);
+        if (rc >= 0)
+            rc = sd_bus_set_bus_client(s_bus, 1);
+        if (rc >= 0)
+            rc = sd_bus_start(s_bus);
+    }
+    else
+    {
+        rc = sd_bus_open_system(&s_bus);
+    }
+    if (rc < 0)
+    {
+        LOG_ERR("Failed to connect to system bus: %s", strerror(-rc));
+        s_bus = sd_bus_unref(s_bus);
+        return NULL;
+    }
+    // A connection replacing a broken one is dispatched by the same event loop
+    if (s_event)
+    {
+        rc = sd_bus_attach_event(s_bus, s_event, SD_EVENT_PRIORITY_NORMAL);
+        if (rc < 0)
+            LOG_ERR("Failed to attach system bus to event loop: %s", strerror(-rc));
+    }
+    rc = sd_bus_match_signal(s_bus, NULL, NULL, "/org/freedesktop/DBus/Local", "org.freedesktop.DBus.Local",
+                             "Disconnected", bus_disconnected, NULL);
+    if (rc < 0)
+        LOG_WRN("Failed to watch for bus disconnects: %s", strerror(-rc));
+    bus_subscribe(s_bus);
+    if (s_connected)
+    {
+        LOG_INF("%s", "Reconnected to the system bus");
+        for (size_t i = 0; i < s_listener_cnt; ++i)
+            s_listeners[i](s_bus);
+    }
+    s_connected = true;
+    return s_bus;
+}
+
+int bus_on_reconnect(bus_reconnect_cb p_listener)
+{
+    if (s_listener_cnt >= BUS_LISTENER_MAX)
+        return -ENOSPC;
+    s_listeners[s_listener_cnt++] = p_listener;
+    return 0;
+}
+
+int bus_set_address(const char *const p_address)
+{
+    char *p_copy = NULL;
+    if (p_address && (p_address[0] != '\0'))
+    {
+        p_copy = strdup(p_address);
+        if (!p_copy)
+            return -ENOMEM;
+        LOG_INF("Using bus at '%s' in place of the system bus", p_copy);
+    }
+    free(s_address);
+    s_address = p_copy;
+    return 0;
+}
+
+int bus_attach(sd_event *p_event)
+{
+    s_event = p_event;
+    if (s_bus && (sd_bus_is_open(s_bus) > 0))
+        return sd_bus_attach_event(s_bus, s_event, SD_EVENT_PRIORITY_NORMAL);
+    // Connect right away, so signals are received before the first method call
+    return bus_system() ? 0 : -ENOTCONN;
+}
+
+sd_event *bus_event(void)
+{
+    return s_event;
+}
+
+void bus_deinit(void)
+{
+    s_bus = sd_bus_flush_close_unref(s_bus);
+    free(s_address);
+    s_address = NULL;
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <systemd/sd-bus.h>
+#include <systemd/sd-event.h>
+
+// Called once a new connection replaced a broken one, matches and calls of the old one are gone by then
+typedef void (*bus_reconnect_cb)(sd_bus * /*p_bus*/);
+
+sd_bus *bus_system(void);
+// Listeners are called in the order they registered
+int bus_on_reconnect(bus_reconnect_cb p_listener);
+// Must be called before the first connection, an empty address selects the system bus
+int bus_set_address(const char *const p_address);
+int bus_attach(sd_event *p_event);
+// Event loop the bus is attached to, NULL before bus_attach()
+sd_event *bus_event(void);
+void bus_deinit(void);
@@ -0,0 +1,384 @@
+// Command line companion of cartridged. `cartctl lint` checks a whole cartridge DB with the daemon's own parser,
+// spread over all CPUs, and reports every problem the daemon would only hit at insertion time.
+
+#include <errno.h>
+#include <glob.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cartdb.h"
+#include "log.h"
+#include "unit.h"
+
+#define CARTCTL_DEFAULT_DB "/etc/cartridged/cartdb"
+#define CARTCTL_MAX_THREADS (64)
+
+typedef enum
+{
+    LINT_WARNING = 0,
+    LINT_ERROR = 1
+} lint_severity_t;
+
+typedef struct
+{
+    lint_severity_t severity;
+    char *p_msg;
+} lint_issue_t;
+
+typedef struct
+{
+    const char *p_path;
+    unit_t *p_unit;
+    lint_issue_t *p_issues;
+    size_t issue_cnt;
+} lint_file_t;
+
+typedef struct
+{
+    lint_file_t *p_files;
+    size_t file_cnt;
+    atomic_size_t next;
+} lint_job_t;
+
+// Messages of the parser and the DB index end up with the file being checked by this thread
+static __thread lint_file_t *s_current = NULL;
+
+static uint64_t time_now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000U + ts.tv_nsec / 1000U;
+}
+
+static void lint_vreport(const lint_severity_t severity, const char *fmt, va_list argp)
+{
+    char str[512] = {0};
+    lint_issue_t *p_issues = NULL;
+
+    if (!s_current)
+        return;
+    vsnprintf(str, sizeof(str), fmt, argp);
+    p_issues = realloc(s_current->p_issues, (s_current->issue_cnt + 1) * sizeof(*p_issues));
+    if (!p_issues)
+        return;
+    s_current->p_issues = p_issues;
+    p_issues[s_current->issue_cnt] = (lint_issue_t){.severity = severity, .p_msg = strdup(str)};
+    if (p_issues[s_current->issue_cnt].p_msg)
+        s_current->issue_cnt++;
+}
+
+static void lint_report(const lint_severity_t severity, const char *fmt, ...)
+{
+    va_list argp;
+    va_start(argp, fmt);
+    lint_vreport(severity, fmt, argp);
+    va_end(argp);
+}
+
+// The shared modules log through these, so their diagnostics become findings instead of output
+void log_fatal(const char *fmt, ...)
+{
+    va_list argp;
+    va_start(argp, fmt);
+    vfprintf(stderr, fmt, argp);
+    va_end(argp);
+    fputc('\n', stderr);
+    exit(2);
+}
+
+void log_error(const char *fmt, ...)
+{
+    va_list argp;
+    va_start(argp, fmt);
+    lint_vreport(LINT_ERROR, fmt, argp);
+    va_end(argp);
+}
+
+void log_warning(const char *fmt, ...)
+{
+    va_list argp;
+    va_start(argp, fmt);
+    lint_vreport(LINT_WARNING, fmt, argp);
+    va_end(argp);
+}
+
+void log_info(const char *fmt, ...)
+{
+    (void)fmt;
+}
+
+static const char *lint_parse_reason(const unit_parse_result_t rc)
+{
+    switch (rc)
+    {
+    case UNIT_PARSE_FILE_ERR:
+        return "it cannot be read";
+    case UNIT_PARSE_SYN_ERR:
+        return "of a syntax error or a missing key";
+    case UNIT_PARSE_BAD_SERV_SCOPE:
+        return "a service has an unknown Scope= (System or User)";
+    case UNIT_PARSE_BAD_ACTIVATION:
+        return "of an unknown Activation= (sequential or target)";
+    case UNIT_PARSE_BAD_MATCH:
+        return "of an invalid Match= (id, lo-hi or value/mask)";
+    default:
+        return "it ran out of memory";
+    }
+}
+
+static void lint_unit(lint_file_t *p_file)
+{
+    const unit_t *p_unit = p_file->p_unit;
+    char dir[512] = {0};
+    char path[1024] = {0};
+
+    if ((p_unit->services.size == 0) && (p_unit->overlays.size == 0) && (p_unit->modules.size == 0))
+        lint_report(LINT_WARNING, "Cartridge '%s' has no services, overlays or modules", p_unit->p_unit_name);
+    // A unit that is already started is not started again, the later service never does anything
+    for (int i = 0; i < p_unit->services.size; ++i)
+    {
+        const unit_service_t *p_serv = &p_unit->services.elem[i];
+        for (int j = 0; j < i; ++j)
+        {
+            const unit_service_t *p_prev = &p_unit->services.elem[j];
+            if ((p_prev->sdscope == p_serv->sdscope) && (strcmp(p_prev->p_sdunit, p_serv->p_sdunit) == 0))
+            {
+                lint_report(LINT_WARNING, "Service '%s' is unreachable, service '%s' already starts '%s'",
+                            p_serv->p_name, p_prev->p_name, p_serv->p_sdunit);
+                break;
+            }
+        }
+    }
+    for (int i = 0; i < p_unit->overlays.size; ++i)
+    {
+        if (access(p_unit->overlays.elem[i].p_source, R_OK) != 0)
+            lint_report(LINT_ERROR, "Source '%s' of overlay '%s' cannot be read", p_unit->overlays.elem[i].p_source,
+                        p_unit->overlays.elem[i].p_name);
+    }
+    if (p_unit->p_icon)
+    {
+        (void)snprintf(dir, sizeof(dir), "%s", p_file->p_path);
+        if (p_unit->p_icon[0] == '/')
+            (void)snprintf(path, sizeof(path), "%s", p_unit->p_icon);
+        else
+            (void)snprintf(path, sizeof(path), "%s/%s", dirname(dir), p_unit->p_icon);
+        if (access(path, R_OK) != 0)
+            lint_report(LINT_WARNING, "Icon '%s' cannot be read", path);
+    }
+}
+
+static void *lint_worker(void *p_arg)
+{
+    lint_job_t *p_job = p_arg;
+    size_t idx = 0;
+
+    while ((idx = atomic_fetch_add(&p_job->next, 1)) < p_job->file_cnt)
+    {
+        lint_file_t *p_file = &p_job->p_files[idx];
+        unit_parse_result_t rc = UNIT_PARSE_OKAY;
+
+        s_current = p_file;
+        rc = unit_parse(&p_file->p_unit, p_file->p_path);
+        if (rc != UNIT_PARSE_OKAY)
+        {
+            p_file->p_unit = NULL;
+            lint_report(LINT_ERROR, "Does not parse because %s, the daemon skips it", lint_parse_reason(rc));
+        }
+        else
+        {
+            lint_unit(p_file);
+        }
+        s_current = NULL;
+    }
+    return NULL;
+}
+
+static void json_string(const char *p_str)
+{
+    putchar('"');
+    for (; *p_str; ++p_str)
+    {
+        const unsigned char c = *p_str;
+        if ((c == '"') || (c == '\\'))
+            printf("\\%c", c);
+        else if (c < 0x20)
+            printf("\\u%04x", c);
+        else
+            putchar(c);
+    }
+    putchar('"');
+}
+
+static void lint_print(const lint_file_t *p_files, const size_t file_cnt, const bool json)
+{
+    bool first = true;
+
+    for (size_t i = 0; i < file_cnt; ++i)
+    {
+        for (size_t j = 0; j < p_files[i].issue_cnt; ++j)
+        {
+            const lint_issue_t *p_issue = &p_files[i].p_issues[j];
+            const char *p_severity = (p_issue->severity == LINT_ERROR) ? "error" : "warning";
+            if (!json)
+            {
+                printf("%s: %s: %s\n", p_files[i].p_path, p_severity, p_issue->p_msg);
+                continue;
+            }
+            printf("%s\n    {\"file\": ", first ? "" : ",");
+            json_string(p_files[i].p_path);
+            printf(", \"severity\": \"%s\", \"message\": ", p_severity);
+            json_string(p_issue->p_msg);
+            putchar('}');
+            first = false;
+        }
+    }
+}
+
+static int lint(const char *const p_dir, const bool json, unsigned threads)
+{
+    char pattern[512] = {0};
+    pthread_t workers[CARTCTL_MAX_THREADS];
+    const uint64_t start = time_now_us();
+    lint_job_t job = {.p_files = NULL, .file_cnt = 0};
+    lint_file_t db_file = {.p_path = p_dir, .p_unit = NULL, .p_issues = NULL, .issue_cnt = 0};
+    cartdb_t db = {0};
+    size_t errors = 0;
+    size_t warnings = 0;
+    glob_t result;
+    int rc = 0;
+
+    (void)snprintf(pattern, sizeof(pattern), "%s/*.cart", p_dir);
+    rc = glob(pattern, 0, NULL, &result);
+    if ((rc != 0) && (rc != GLOB_NOMATCH))
+    {
+        fprintf(stderr, "Could not read '%s'\n", p_dir);
+        return 2;
+    }
+    job.file_cnt = (rc == 0) ? result.gl_pathc : 0;
+    job.p_files = calloc(job.file_cnt + 1, sizeof(*job.p_files));
+    if (!job.p_files)
+    {
+        globfree(&result);
+        return 2;
+    }
+    for (size_t i = 0; i < job.file_cnt; ++i)
+        job.p_files[i].p_path = result.gl_pathv[i];
+    atomic_init(&job.next, 0);
+
+    if (threads > job.file_cnt)
+        threads = job.file_cnt;
+    for (unsigned i = 1; i < threads; ++i)
+    {
+        if (pthread_create(&workers[i], NULL, lint_worker, &job) != 0)
+            threads = i;
+    }
+    (void)lint_worker(&job);
+    for (unsigned i = 1; i < threads; ++i)
+        pthread_join(workers[i], NULL);
+
+    // IDs are checked exactly the way the daemon indexes them, conflicts are findings of the whole DB
+    for (size_t i = 0; i < job.file_cnt; ++i)
+    {
+        s_current = &job.p_files[i];
+        if (job.p_files[i].p_unit && (cartdb_add_unit(&db, job.p_files[i].p_unit, job.p_files[i].p_path) != 0))
+            LOG_FTL("%s", "Out of memory");
+    }
+    s_current = &db_file;
+    cartdb_index(&db);
+    s_current = NULL;
+    cartdb_free(&db);
+
+    job.p_files[job.file_cnt] = db_file;
+    for (size_t i = 0; i <= job.file_cnt; ++i)
+    {
+        for (size_t j = 0; j < job.p_files[i].issue_cnt; ++j)
+        {
+            if (job.p_files[i].p_issues[j].severity == LINT_ERROR)
+                errors++;
+            else
+                warnings++;
+        }
+    }
+
+    if (json)
+    {
+        printf("{\"db\": ");
+        json_string(p_dir);
+        printf(", \"files\": %zu, \"errors\": %zu, \"warnings\": %zu, \"elapsed_us\": %llu, \"issues\": [",
+               job.file_cnt, errors, warnings, (unsigned long long)(time_now_us() - start));
+        lint_print(job.p_files, job.file_cnt + 1, true);
+        printf("%s]}\n", (errors + warnings > 0) ? "\n" : "");
+    }
+    else
+    {
+        lint_print(job.p_files, job.file_cnt + 1, false);
+        printf("%zu files, %zu errors, %zu warnings in %llu us\n", job.file_cnt, errors, warnings,
+               (unsigned long long)(time_now_us() - start));
+    }
+
+    for (size_t i = 0; i <= job.file_cnt; ++i)
+    {
+        unit_destroy(job.p_files[i].p_unit);
+        for (size_t j = 0; j < job.p_files[i].issue_cnt; ++j)
+            free(job.p_files[i].p_issues[j].p_msg);
+        free(job.p_files[i].p_issues);
+    }
+    free(job.p_files);
+    if (rc == 0)
+        globfree(&result);
+    return (errors > 0) ? 1 : 0;
+}
+
+static void usage(const char *const p_prog)
+{
+    fprintf(stderr,
+            "Usage: %s lint [-j] [-t threads] [cartdb]\n"
+            "  lint  check every .cart file of the DB (default %s) and the IDs they match\n"
+            "  -j    print the findings as JSON\n"
+            "  -t    number of threads, defaults to the number of CPUs\n"
+            "Exits with 1 if there are errors, warnings alone do not fail\n",
+            p_prog, CARTCTL_DEFAULT_DB);
+}
+
+int main(int argc, char *argv[])
+{
+    const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned threads = (cpus > 0) ? (unsigned)cpus : 1;
+    bool json = false;
+    int opt = 0;
+
+    if ((argc < 2) || (strcmp(argv[1], "lint") != 0))
+    {
+        usage(argv[0]);
+        return 2;
+    }
+    optind = 2;
+    while ((opt = getopt(argc, argv, "jt:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 'j':
+            json = true;
+            break;
+        case 't':
+            threads = (unsigned)atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return (opt == 'h') ? EXIT_SUCCESS : 2;
+        }
+    }
+    if (threads < 1)
+        threads = 1;
+    if (threads > CARTCTL_MAX_THREADS)
+        threads = CARTCTL_MAX_THREADS;
+    return lint((optind < argc) ? argv[optind] : CARTCTL_DEFAULT_DB, json, threads);
+}
@@ -0,0 +1,232 @@
+#include "cartdb.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <glob.h>
+#include <libgen.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+
+static int cartdb_add(cartdb_t *p_db, const uint8_t len, const uint64_t lo, const uint64_t hi,
+                      const char *const p_path)
+{
+    if (p_db->size >= p_db->capacity)
+    {
+        const size_t capacity = (p_db->capacity > 0) ? (p_db->capacity * 2) : 64;
+        cartdb_entry_t *p_entries = realloc(p_db->p_entries, capacity * sizeof(*p_entries));
+        if (!p_entries)
+            return -ENOMEM;
+        p_db->p_entries = p_entries;
+        p_db->capacity = capacity;
+    }
+    p_db->p_entries[p_db->size] =
+        (cartdb_entry_t){.lo = lo, .hi = hi, .len = len, .p_path = strdup(p_path), .parent = -1, .ambiguous = false};
+    if (!p_db->p_entries[p_db->size].p_path)
+        return -ENOMEM;
+    p_db->size++;
+    return 0;
+}
+
+// Legacy naming scheme: the file name starts with the ID in hexadecimal, followed by '-'. Like Match= keys without
+// a length it matches IDs of any length by their value.
+static bool cartdb_name_id(const char *const p_path, uint64_t *p_id)
+{
+    char buf[256] = {0};
+    const char *p_name = NULL;
+    char *p_end = NULL;
+
+    (void)snprintf(buf, sizeof(buf), "%s", p_path);
+    p_name = basename(buf);
+    if (!isxdigit((unsigned char)p_name[0]))
+        return false;
+    // Up to 16 digits, so IDs of any length read from the cartridge can be named
+    errno = 0;
+    *p_id = strtoull(p_name, &p_end, 16);
+    return (errno == 0) && (*p_end == '-');
+}
+
+static int cartdb_entry_cmp(const void *p_a, const void *p_b)
+{
+    const cartdb_entry_t *p_ea = p_a;
+    const cartdb_entry_t *p_eb = p_b;
+    if (p_ea->len != p_eb->len)
+        return (p_ea->len < p_eb->len) ? -1 : 1;
+    if (p_ea->lo != p_eb->lo)
+        return (p_ea->lo < p_eb->lo) ? -1 : 1;
+    // Wider ranges first, so an enclosing range always precedes the ranges nested in it
+    if (p_ea->hi != p_eb->hi)
+        return (p_ea->hi > p_eb->hi) ? -1 : 1;
+    return strcmp(p_ea->p_path, p_eb->p_path);
+}
+
+// Links every entry to its enclosing entry. Ranges must either nest or be disjoint; partially overlapping
+// entries are dropped and identical ranges collapse into one ambiguous entry, both reported right away.
+static void cartdb_link(cartdb_t *p_db)
+{
+    int *p_stack = malloc(sizeof(int) * (p_db->size + 1));
+    size_t depth = 0;
+    size_t out = 0;
+
+    if (!p_stack)
+        return;
+    for (size_t i = 0; i < p_db->size; ++i)
+    {
+        cartdb_entry_t cur = p_db->p_entries[i];
+        // IDs of another length are a separate tree
+        while ((depth > 0) && ((p_db->p_entries[p_stack[depth - 1]].hi < cur.lo) ||
+                               (p_db->p_entries[p_stack[depth - 1]].len != cur.len)))
+            depth--;
+        if (depth > 0)
+        {
+            cartdb_entry_t *p_top = &p_db->p_entries[p_stack[depth - 1]];
+            if ((p_top->lo == cur.lo) && (p_top->hi == cur.hi))
+            {
+                LOG_ERR("'%s' and '%s' match the same IDs %llX-%llX (%u bytes)", p_top->p_path, cur.p_path,
+                        (unsigned long long)cur.lo, (unsigned long long)cur.hi, cur.len);
+                p_top->ambiguous = true;
+                free(cur.p_path);
+                continue;
+            }
+            if (cur.hi > p_top->hi)
+            {
+                LOG_ERR("'%s' partially overlaps '%s', ignoring it", cur.p_path, p_top->p_path);
+                free(cur.p_path);
+                continue;
+            }
+            cur.parent = p_stack[depth - 1];
+        }
+        p_db->p_entries[out] = cur;
+        p_stack[depth++] = out++;
+    }
+    p_db->size = out;
+    free(p_stack);
+}
+
+int cartdb_add_unit(cartdb_t *p_db, const unit_t *p_unit, const char *const p_path)
+{
+    uint64_t id = 0;
+    int rc = 0;
+
+    for (int m = 0; (m < p_unit->matches.size) && (rc == 0); ++m)
+    {
+        const unit_match_t *p_match = &p_unit->matches.elem[m];
+        rc = cartdb_add(p_db, p_match->len, p_match->lo, p_match->hi, p_path);
+    }
+    if ((p_unit->matches.size == 0) && (rc == 0))
+    {
+        if (cartdb_name_id(p_path, &id))
+            rc = cartdb_add(p_db, 0, id, id, p_path);
+        else
+            LOG_WRN("'%s' has neither Match= keys nor an ID prefix, it never matches", p_path);
+    }
+    return rc;
+}
+
+void cartdb_index(cartdb_t *p_db)
+{
+    qsort(p_db->p_entries, p_db->size, sizeof(*p_db->p_entries), cartdb_entry_cmp);
+    cartdb_link(p_db);
+}
+
+int cartdb_build(cartdb_t *p_db, const char *const p_path)
+{
+    char pattern[512] = {0};
+    glob_t result;
+    unit_t *p_unit = NULL;
+    int rc = 0;
+
+    p_db->p_entries = NULL;
+    p_db->size = 0;
+    p_db->capacity = 0;
+    (void)snprintf(pattern, sizeof(pattern), "%s/*.cart", p_path);
+    rc = glob(pattern, 0, NULL, &result);
+    if (rc == GLOB_NOMATCH)
+        return 0;
+    if (rc != 0)
+        return -EIO;
+
+    for (size_t i = 0; (i < result.gl_pathc) && (rc == 0); ++i)
+    {
+        const char *p_file = result.gl_pathv[i];
+        if (unit_parse(&p_unit, p_file) != UNIT_PARSE_OKAY)
+        {
+            LOG_WRN("Skipping '%s', it does not parse", p_file);
+            continue;
+        }
+        rc = cartdb_add_unit(p_db, p_unit, p_file);
+        unit_destroy(p_unit);
+    }
+    globfree(&result);
+    if (rc != 0)
+    {
+        cartdb_free(p_db);
+        return rc;
+    }
+
+    cartdb_index(p_db);
+    return 0;
+}
+
+void cartdb_free(cartdb_t *p_db)
+{
+    for (size_t i = 0; i < p_db->size; ++i)
+        free(p_db->p_entries[i].p_path);
+    free(p_db->p_entries);
+    p_db->p_entries = NULL;
+    p_db->size = 0;
+    p_db->capacity = 0;
+}
+
+// Most specific entry of the given length containing value, -1 if there is none
+static int cartdb_lookup(const cartdb_t *p_db, const uint8_t len, const uint64_t value)
+{
+    size_t lo = 0;
+    size_t hi = p_db->size;
+    int idx = -1;
+
+    // Find the last entry of the same length starting at or below value. With ties on lo the narrowest comes last.
+    while (lo < hi)
+    {
+        const size_t mid = lo + (hi - lo) / 2;
+        const cartdb_entry_t *p_entry = &p_db->p_entries[mid];
+        if ((p_entry->len < len) || ((p_entry->len == len) && (p_entry->lo <= value)))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    idx = (int)lo - 1;
+    // Ranges nest, so the first enclosing range on the way up is the most specific one. An entry of a shorter
+    // length only has parents of that length, the walk ends without a match.
+    while ((idx >= 0) && ((p_db->p_entries[idx].len != len) || (p_db->p_entries[idx].hi < value)))
+        idx = p_db->p_entries[idx].parent;
+    return idx;
+}
+
+// Entries giving the length are more specific than those matching IDs of any length
+static int cartdb_lookup_id(const cartdb_t *p_db, const detection_cartid_t id)
+{
+    const int idx = cartdb_lookup(p_db, id.len, id.value);
+    return (idx >= 0) ? idx : cartdb_lookup(p_db, 0, id.value);
+}
+
+unit_find_result_t cartdb_find(const cartdb_t *p_db, const detection_cartid_t id, const char **pp_path)
+{
+    static const uint8_t s_end_bytes[] = {0x00, 0xff};
+    int idx = cartdb_lookup_id(p_db, id);
+
+    // An ID ending in 00 or ff followed by the end marker reads one byte short, e.g. 0100 as 01
+    for (size_t i = 0; (idx < 0) && (id.len > 0) && (id.len < 8) && (i < sizeof(s_end_bytes)); ++i)
+    {
+        const detection_cartid_t longer = {.value = (id.value << 8) | s_end_bytes[i], .len = id.len + 1};
+        idx = cartdb_lookup_id(p_db, longer);
+    }
+    if (idx < 0)
+        return UNIT_FIND_NOTFOUND;
+    if (p_db->p_entries[idx].ambiguous)
+        return UNIT_FIND_AMBIGOUS;
+    *pp_path = p_db->p_entries[idx].p_path;
+    return UNIT_FIND_SUCCESS;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "detection.h"
+#include "unit.h"
+
+typedef struct
+{
+    uint64_t lo;
+    uint64_t hi;
+    uint8_t len; // IDs of a different length never match, 0 matches any length
+    char *p_path;
+    int parent; // index of the narrowest entry containing this one, -1 if none
+    bool ambiguous;
+} cartdb_entry_t;
+
+// Interval index over all unit files of a cartridge DB, sorted by ID length, lo ascending and hi descending
+typedef struct
+{
+    cartdb_entry_t *p_entries;
+    size_t size;
+    size_t capacity;
+} cartdb_t;
+
+int cartdb_build(cartdb_t *p_db, const char *const p_path);
+// Building blocks of cartdb_build(): add the IDs of every parsed unit, then index them once
+int cartdb_add_unit(cartdb_t *p_db, const unit_t *p_unit, const char *const p_path);
+void cartdb_index(cartdb_t *p_db);
+void cartdb_free(cartdb_t *p_db);
+unit_find_result_t cartdb_find(const cartdb_t *p_db, const detection_cartid_t id, const char **pp_path);
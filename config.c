@@ -1,48 +1,186 @@
 #include "config.h"
 
 #include <errno.h>
-#include <mini.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include "ini.h"
 #include "log.h"
 
+typedef enum
+{
+    CONFIG_KEY_UNKNOWN = 0,
+    CONFIG_KEY_DB_PATH,
+    CONFIG_KEY_NOTIFICATIONS,
+    CONFIG_KEY_NOTIFY_FAILURES,
+    CONFIG_KEY_REALTIME,
+    CONFIG_KEY_REALTIME_PRIO,
+    CONFIG_KEY_REALTIME_CPU,
+    CONFIG_KEY_ACTIVATION,
+    CONFIG_KEY_STOP_TIMEOUT,
+    CONFIG_KEY_BUS_ADDRESS,
+    CONFIG_KEY_NOTIFY_WINDOW,
+    CONFIG_KEY_NOTIFY_INTERVAL,
+    CONFIG_KEY_PREWARM,
+    CONFIG_KEY_GPIO_CAPTURE,
+    CONFIG_KEY_OVERLAY_ROOT,
+    CONFIG_KEY_MODULE_ROOT
+} config_key_t;
+
+// Keys are dispatched on their length first, so at most one comparison is done per key
+static config_key_t config_key_lookup(const ini_span_t key)
+{
+    config_key_t ret = CONFIG_KEY_UNKNOWN;
+    switch (key.len)
+    {
+    case sizeof("db_path") - 1: // same length as "prewarm"
+        if (ini_span_eq(key, "db_path"))
+            ret = CONFIG_KEY_DB_PATH;
+        else if (ini_span_eq(key, "prewarm"))
+            ret = CONFIG_KEY_PREWARM;
+        break;
+    case sizeof("realtime") - 1:
+        ret = ini_span_eq(key, "realtime") ? CONFIG_KEY_REALTIME : CONFIG_KEY_UNKNOWN;
+        break;
+    case sizeof("bus_address") - 1: // same length as "module_root"
+        if (ini_span_eq(key, "bus_address"))
+            ret = CONFIG_KEY_BUS_ADDRESS;
+        else if (ini_span_eq(key, "module_root"))
+            ret = CONFIG_KEY_MODULE_ROOT;
+        break;
+    case sizeof("activation") - 1:
+        ret = ini_span_eq(key, "activation") ? CONFIG_KEY_ACTIVATION : CONFIG_KEY_UNKNOWN;
+        break;
+    case sizeof("realtime_cpu") - 1: // same length as "gpio_capture" and "overlay_root"
+        if (ini_span_eq(key, "realtime_cpu"))
+            ret = CONFIG_KEY_REALTIME_CPU;
+        else if (ini_span_eq(key, "gpio_capture"))
+            ret = CONFIG_KEY_GPIO_CAPTURE;
+        else if (ini_span_eq(key, "overlay_root"))
+            ret = CONFIG_KEY_OVERLAY_ROOT;
+        break;
+    case sizeof("notifications") - 1:
+        ret = ini_span_eq(key, "notifications") ? CONFIG_KEY_NOTIFICATIONS : CONFIG_KEY_UNKNOWN;
+        break;
+    case sizeof("notify_failures") - 1: // same length as "stop_timeout_ms"
+        if (ini_span_eq(key, "notify_failures"))
+            ret = CONFIG_KEY_NOTIFY_FAILURES;
+        else if (ini_span_eq(key, "stop_timeout_ms"))
+            ret = CONFIG_KEY_STOP_TIMEOUT;
+        break;
+    case sizeof("notify_window_ms") - 1:
+        ret = ini_span_eq(key, "notify_window_ms") ? CONFIG_KEY_NOTIFY_WINDOW : CONFIG_KEY_UNKNOWN;
+        break;
+    case sizeof("realtime_priority") - 1:
+        ret = ini_span_eq(key, "realtime_priority") ? CONFIG_KEY_REALTIME_PRIO : CONFIG_KEY_UNKNOWN;
+        break;
+    case sizeof("notify_interval_ms") - 1:
+        ret = ini_span_eq(key, "notify_interval_ms") ? CONFIG_KEY_NOTIFY_INTERVAL : CONFIG_KEY_UNKNOWN;
+        break;
+    default:
+        break;
+    }
+    return ret;
+}
+
+static int config_span_int(const ini_span_t value)
+{
+    char buf[16] = {0};
+    ini_span_copy(value, buf, sizeof(buf));
+    return atoi(buf);
+}
+
+static void config_span_activation(const ini_span_t value, unit_activation_t *p_activation)
+{
+    char buf[16] = {0};
+    ini_span_copy(value, buf, sizeof(buf));
+    if (unit_activation_from_str(buf, p_activation) != 0)
+        LOG_WRN("Unknown activation mode '%s', ignoring", buf);
+}
+
 int config_load(const char *const p_filename, config_t *p_config)
 {
     int ret = 0;
-    mini_t *p_mini = mini_init(p_filename);
-    if (!p_mini)
+    ini_t ini;
+    ini_token_t token = INI_TOKEN_END;
+
+    ret = ini_open(&ini, p_filename);
+    if (ret != 0)
+    {
+        LOG_ERR("Error reading configuration at '%s' (error '%s')", p_filename, strerror(-ret));
         return EINVAL;
-    while (mini_next(p_mini))
+    }
+    while ((token = ini_next(&ini)) != INI_TOKEN_END)
     {
-        if (!p_mini->key)
+        if (token == INI_TOKEN_ERROR)
         {
-            // ignore sections
+            LOG_ERR("Syntax error in configuration at '%s' line %u", p_filename, ini.line);
+            ret = 1;
+            break;
         }
-        else if (!p_mini->value)
+        else if (token == INI_TOKEN_SECTION)
         {
-            // ignore unkeyed values
+            // ignore sections
+            continue;
         }
-        else
+
+        switch (config_key_lookup(ini.key))
         {
-            if (strncmp(p_mini->key, "db_path", strlen("db_path") - 1) == 0)
-            {
-                strcpy(p_config->cartdb_path, p_mini->value);
-            }
-            else if (strncmp(p_mini->key, "notifications", strlen("notifications") - 1) == 0)
-            {
-                if (strncmp(p_mini->value, "yes", strlen("yes") - 1) == 0)
-                    p_config->notification_enabled = true;
-                else
-                    p_config->notification_enabled = false;
-            }
+        case CONFIG_KEY_DB_PATH:
+            if (ini_span_copy(ini.value, p_config->cartdb_path, sizeof(p_config->cartdb_path)) != ini.value.len)
+                LOG_WRN("db_path in '%s' is too long and was truncated", p_filename);
+            break;
+        case CONFIG_KEY_NOTIFICATIONS:
+            p_config->notification_enabled = ini_span_eq(ini.value, "yes");
+            break;
+        case CONFIG_KEY_NOTIFY_FAILURES:
+            p_config->failure_notification_enabled = ini_span_eq(ini.value, "yes");
+            break;
+        case CONFIG_KEY_PREWARM:
+            p_config->prewarm_enabled = ini_span_eq(ini.value, "yes");
+            break;
+        case CONFIG_KEY_REALTIME:
+            p_config->realtime_enabled = ini_span_eq(ini.value, "yes");
+            break;
+        case CONFIG_KEY_REALTIME_PRIO:
+            p_config->realtime_priority = config_span_int(ini.value);
+            break;
+        case CONFIG_KEY_REALTIME_CPU:
+            p_config->realtime_cpu = config_span_int(ini.value);
+            break;
+        case CONFIG_KEY_GPIO_CAPTURE:
+            if (ini_span_copy(ini.value, p_config->gpio_capture, sizeof(p_config->gpio_capture)) != ini.value.len)
+                LOG_WRN("gpio_capture in '%s' is too long and was truncated", p_filename);
+            break;
+        case CONFIG_KEY_OVERLAY_ROOT:
+            if (ini_span_copy(ini.value, p_config->overlay_root, sizeof(p_config->overlay_root)) != ini.value.len)
+                LOG_WRN("overlay_root in '%s' is too long and was truncated", p_filename);
+            break;
+        case CONFIG_KEY_MODULE_ROOT:
+            if (ini_span_copy(ini.value, p_config->module_root, sizeof(p_config->module_root)) != ini.value.len)
+                LOG_WRN("module_root in '%s' is too long and was truncated", p_filename);
+            break;
+        case CONFIG_KEY_ACTIVATION:
+            config_span_activation(ini.value, &p_config->activation);
+            break;
+        case CONFIG_KEY_STOP_TIMEOUT:
+            p_config->stop_timeout_ms = config_span_int(ini.value);
+            break;
+        case CONFIG_KEY_NOTIFY_WINDOW:
+            p_config->notify_window_ms = config_span_int(ini.value);
+            break;
+        case CONFIG_KEY_NOTIFY_INTERVAL:
+            p_config->notify_interval_ms = config_span_int(ini.value);
+            break;
+        case CONFIG_KEY_BUS_ADDRESS:
+            if (ini_span_copy(ini.value, p_config->bus_address, sizeof(p_config->bus_address)) != ini.value.len)
+                LOG_WRN("bus_address in '%s' is too long and was truncated", p_filename);
+            break;
+        default:
+            LOG_WRN("Ignoring unknown key '%.*s' in '%s'", (int)ini.key.len, ini.key.p, p_filename);
+            break;
         }
     }
-    if (!p_mini->eof)
-    {
-
-        LOG_ERR("Error reading configuration at '%s' (error '%s')", p_filename, strerror(errno));
-        ret = 1;
-    }
-    mini_free(p_mini);
+    ini_close(&ini);
     return ret;
 }
@@ -2,10 +2,25 @@
 
 #include <stdbool.h>
 
+#include "unit.h"
+
 typedef struct
 {
     char cartdb_path[255];
     bool notification_enabled;
+    bool failure_notification_enabled;
+    bool realtime_enabled;
+    bool prewarm_enabled;
+    int realtime_priority;
+    int realtime_cpu;
+    unit_activation_t activation;
+    unsigned stop_timeout_ms;
+    char bus_address[255];
+    unsigned notify_window_ms;
+    unsigned notify_interval_ms;
+    char gpio_capture[255];
+    char overlay_root[255];
+    char module_root[255];
 } config_t;
 
 int config_load(const char *const p_filename, config_t *p_config);
@@ -3,15 +3,20 @@
 #include <errno.h>
 #include <gpiod.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include <string.h>
 #include <time.h>
 
+#include "detection_capture.h"
 #include "log.h"
 #include "pinconfig.h"
 
 #define ROUTE_EN_ACTIVE (0)
 #define ROUTE_EN_INACTIVE (1)
-#define CARTID_MAX_BYTES (4)
+#define CARTID_MAX_BYTES (8)
+// A drained shift register reads 0x00, a floating data line 0xFF; two of them in a row end the ID
+#define CARTID_END_BYTES (2)
+#define PULSE_HALF_PERIOD_US (100)
 
 typedef enum
 {
@@ -27,6 +32,7 @@ typedef struct
     struct gpiod_chip *p_chip;
     struct gpiod_line *p_line;
     bool inuse;
+    bool events;
 } detection_pin_t;
 
 typedef enum
@@ -38,62 +44,130 @@ typedef enum
 } detection_pinidx_t;
 
 static detection_config_t s_config = {
-    .pin_route_en = PIN_NONE, .pin_clock = PIN_NONE, .pin_data = PIN_NONE, .p_event_listener = NULL};
+    .pin_route_en = PIN_NONE,
+    .pin_clock = PIN_NONE,
+    .pin_data = PIN_NONE,
+    .p_event_listener = NULL,
+    .p_capture_path = NULL,
+    .p_io = NULL};
 
 static bool s_initialized = false;
-static detection_pin_t s_pins[PINIDX_MAX] = {{.chipno = -1, .p_chip = NULL, .p_line = NULL, .inuse = false},
-                                             {.chipno = -1, .p_chip = NULL, .p_line = NULL, .inuse = false},
-                                             {.chipno = -1, .p_chip = NULL, .p_line = NULL, .inuse = false}};
+static detection_pin_t s_pins[PINIDX_MAX] = {
+    {.chipno = -1, .p_chip = NULL, .p_line = NULL, .inuse = false, .events = false},
+    {.chipno = -1, .p_chip = NULL, .p_line = NULL, .inuse = false, .events = false},
+    {.chipno = -1, .p_chip = NULL, .p_line = NULL, .inuse = false, .events = false}};
 static detection_state_t s_state = DETECTION_STATE_WAIT;
 static detection_readstate_t s_readstate = DETECTION_READSTATE_IDLE;
 static unsigned s_pulse_time_start = 0;
 static unsigned s_bit_count = 0;
 static unsigned s_byte_count = 0;
-static unsigned s_cart_id = 0;
+static detection_cartid_t s_cart_id = {.value = 0, .len = 0};
+static bool s_end_pending = false;
+static unsigned s_end_byte = 0;
 static unsigned s_read_byte = 0;
+static unsigned s_read_time_start = 0;
+static unsigned s_jitter_max = 0;
+static detection_capture_t s_capture = {.p_file = NULL, .last_us = 0, .started = false};
 
 static int hal_init_pin(const detection_pinidx_t idx, detection_pincfg_t *p_pincfg);
 static const char *pinidx_to_str(detection_pinidx_t idx);
 static void pin_release(const detection_pinidx_t idx);
 static void pin_config_input(const detection_pinidx_t idx);
 static void pin_config_output(const detection_pinidx_t idx, const int default_val);
+static void pin_config_events(const detection_pinidx_t idx);
+static void pin_events_drain(const detection_pinidx_t idx);
+static int pin_read(const detection_pinidx_t idx);
 static int pin_get(const detection_pinidx_t idx);
 static void pin_set(const detection_pinidx_t idx, const int val);
 
 static void config_pins_listening_state(void);
 static void config_pins_listening_state(void);
 static void set_pins_enable_read(bool enable);
+static unsigned time_now_us(void);
+static unsigned time_read_us(void);
+static void jitter_track(const unsigned elapsed);
 static bool pulse_read(bool *p_bit);
 static void handle_wait_for_cart(void);
 static void handle_read_cartid(void);
 static void handle_inserted(void);
+static void cartid_append(const unsigned byte);
+static bool cartid_accept(const unsigned byte);
+static void state_reset(void);
 
-void detection_init(const detection_config_t *const p_cfg)
+int detection_init(const detection_config_t *const p_cfg)
 {
     int rc = 0;
     // copy over configuration
     memcpy(&s_config, p_cfg, sizeof(s_config));
+    state_reset();
 
-    // initilaize HAL
-    rc |= hal_init_pin(PINIDX_ROUTE_EN, &s_config.pin_route_en);
-    rc |= hal_init_pin(PINIDX_CLOCK, &s_config.pin_clock);
-    rc |= hal_init_pin(PINIDX_DATA, &s_config.pin_data);
+    // initilaize HAL, a stand-in for the lines needs none
+    if (!s_config.p_io)
+    {
+        rc |= hal_init_pin(PINIDX_ROUTE_EN, &s_config.pin_route_en);
+        rc |= hal_init_pin(PINIDX_CLOCK, &s_config.pin_clock);
+        rc |= hal_init_pin(PINIDX_DATA, &s_config.pin_data);
+    }
+    if ((rc == 0) && s_config.p_capture_path)
+    {
+        const int err = detection_capture_create(&s_capture, s_config.p_capture_path);
+        if (err != 0)
+            LOG_WRN("Could not create GPIO capture '%s' (error '%s')", s_config.p_capture_path, strerror(-err));
+        else
+            LOG_INF("Capturing GPIO activity to '%s'", s_config.p_capture_path);
+        // The path may not outlive the caller's configuration
+        s_config.p_capture_path = NULL;
+    }
 
     if (rc == 0)
     {
         s_initialized = true;
         config_pins_listening_state();
     }
+    return rc;
 }
 
 void detection_deinit(void)
 {
-    // release all lines and gpiochips
+    // release all lines and gpiochips, pins on the same chip share its handle
     for (int i = 0; i < PINIDX_MAX; ++i)
     {
         pin_release(i);
-        gpiod_chip_close(s_pins[i].p_chip);
+        if (s_pins[i].p_chip)
+        {
+            for (int j = i + 1; j < PINIDX_MAX; ++j)
+            {
+                if (s_pins[j].p_chip == s_pins[i].p_chip)
+                    s_pins[j].p_chip = NULL;
+            }
+            gpiod_chip_close(s_pins[i].p_chip);
+        }
+        s_pins[i].p_chip = NULL;
+        s_pins[i].p_line = NULL;
     }
+    detection_capture_close(&s_capture);
+    s_initialized = false;
+}
+
+int detection_fd(void)
+{
+    // Only valid while waiting for an insertion or removal, reading the ID reconfigures the line
+    if (!s_initialized || !s_pins[PINIDX_ROUTE_EN].events)
+        return -1;
+    return gpiod_line_event_get_fd(s_pins[PINIDX_ROUTE_EN].p_line);
+}
+
+const char *detection_cartid_str(const detection_cartid_t id, char *p_buf, const size_t size)
+{
+    const int digits = (id.len > 2) ? (id.len * 2) : 4;
+    (void)snprintf(p_buf, size, "%0*llX", digits, (unsigned long long)id.value);
+    return p_buf;
+}
+
+bool detection_present(void)
+{
+    // Not part of a capture, the daemon asks this once outside of the state machine
+    return s_initialized && (pin_read(PINIDX_ROUTE_EN) == ROUTE_EN_ACTIVE);
 }
 
 detection_state_t detection_handle()
@@ -189,12 +263,15 @@ static void pin_release(const detection_pinidx_t idx)
     if (s_pins[idx].inuse)
         gpiod_line_release(s_pins[idx].p_line);
     s_pins[idx].inuse = false;
+    s_pins[idx].events = false;
 }
 
 static void pin_config_input(const detection_pinidx_t idx)
 {
     // If the line is already busy, this function releases it
     pin_release(idx);
+    if (s_config.p_io)
+        return;
     const int rc = gpiod_line_request_input(s_pins[idx].p_line, pinidx_to_str(idx));
     if (rc != 0)
     {
@@ -210,6 +287,8 @@ static void pin_config_output(const detection_pinidx_t idx, const int default_va
 {
     // If the line is already busy, this function releases it
     pin_release(idx);
+    if (s_config.p_io)
+        return;
     const int rc = gpiod_line_request_output(s_pins[idx].p_line, pinidx_to_str(idx), default_val);
     if (rc != 0)
     {
@@ -221,18 +300,61 @@ static void pin_config_output(const detection_pinidx_t idx, const int default_va
     }
 }
 
+static void pin_config_events(const detection_pinidx_t idx)
+{
+    // If the line is already busy, this function releases it
+    pin_release(idx);
+    if (s_config.p_io)
+        return;
+    if (gpiod_line_request_both_edges_events(s_pins[idx].p_line, pinidx_to_str(idx)) == 0)
+    {
+        s_pins[idx].inuse = true;
+        s_pins[idx].events = true;
+    }
+    else
+    {
+        LOG_WRN("Could not request edge events idx=%d, falling back to polling", idx);
+        pin_config_input(idx);
+    }
+}
+
+static void pin_events_drain(const detection_pinidx_t idx)
+{
+    const struct timespec no_wait = {0};
+    struct gpiod_line_event event;
+
+    // The edges only wake the reader up, the line level is what counts
+    while (s_pins[idx].events && (gpiod_line_event_wait(s_pins[idx].p_line, &no_wait) == 1))
+    {
+        if (gpiod_line_event_read(s_pins[idx].p_line, &event) != 0)
+            break;
+    }
+}
+
+static int pin_read(const detection_pinidx_t idx)
+{
+    return s_config.p_io ? s_config.p_io->pin_get(idx) : gpiod_line_get_value(s_pins[idx].p_line);
+}
 static int pin_get(const detection_pinidx_t idx)
 {
-    return gpiod_line_get_value(s_pins[idx].p_line);
+    const int val = pin_read(idx);
+    if (s_capture.p_file)
+        detection_capture_write(&s_capture, time_read_us(), DETECTION_CAPTURE_GET, idx, (unsigned)val);
+    return val;
 }
 static void pin_set(const detection_pinidx_t idx, const int val)
 {
-    gpiod_line_set_value(s_pins[idx].p_line, val);
+    if (s_capture.p_file)
+        detection_capture_write(&s_capture, time_read_us(), DETECTION_CAPTURE_SET, idx, (unsigned)val);
+    if (s_config.p_io)
+        s_config.p_io->pin_set(idx, val);
+    else
+        gpiod_line_set_value(s_pins[idx].p_line, val);
 }
 
 static void config_pins_listening_state(void)
 {
-    pin_config_input(PINIDX_ROUTE_EN);
+    pin_config_events(PINIDX_ROUTE_EN);
     pin_config_input(PINIDX_CLOCK);
     pin_config_input(PINIDX_DATA);
 }
@@ -251,19 +373,48 @@ static void config_pins_read_state(void)
 
 static void handle_wait_for_cart(void)
 {
+    pin_events_drain(PINIDX_ROUTE_EN);
     int pin_state = pin_get(PINIDX_ROUTE_EN);
     if (pin_state == ROUTE_EN_ACTIVE)
     {
         config_pins_read_state();
         set_pins_enable_read(true);
+        s_read_time_start = time_now_us();
+        s_jitter_max = 0U;
         s_state = DETECTION_STATE_READ_ID;
     }
 }
 
+// The clock as the state machine sees it, every read is part of a capture
+static unsigned time_now_us(void)
+{
+    const unsigned now = time_read_us();
+    if (s_capture.p_file)
+        detection_capture_write(&s_capture, now, DETECTION_CAPTURE_TIME, 0, 0);
+    return now;
+}
+
+static unsigned time_read_us(void)
+{
+    struct timespec ts;
+    if (s_config.p_io)
+        return s_config.p_io->time_now_us();
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000U + ts.tv_nsec / 1000U;
+}
+
+static void jitter_track(const unsigned elapsed)
+{
+    // Any time spent beyond the nominal half period is scheduling jitter
+    const unsigned jitter = elapsed - PULSE_HALF_PERIOD_US;
+    if (jitter > s_jitter_max)
+        s_jitter_max = jitter;
+}
+
 static bool pulse_read(bool *p_bit)
 {
     bool bit_set = false;
-    const unsigned instant_now = clock() * 1000000 / CLOCKS_PER_SEC;
+    const unsigned instant_now = time_now_us();
     switch (s_readstate)
     {
     case DETECTION_READSTATE_IDLE:
@@ -275,8 +426,9 @@ static bool pulse_read(bool *p_bit)
         s_readstate = DETECTION_READSTATE_WAITHIGH;
         break;
     case DETECTION_READSTATE_WAITHIGH:
-        if ((instant_now - s_pulse_time_start) > 100)
+        if ((instant_now - s_pulse_time_start) > PULSE_HALF_PERIOD_US)
         {
+            jitter_track(instant_now - s_pulse_time_start);
             *p_bit = pin_get(PINIDX_DATA);
             bit_set = true;
             pin_set(PINIDX_CLOCK, 0);
@@ -285,8 +437,9 @@ static bool pulse_read(bool *p_bit)
         }
         break;
     case DETECTION_READSTATE_WAITLOW:
-        if ((instant_now - s_pulse_time_start) > 100)
+        if ((instant_now - s_pulse_time_start) > PULSE_HALF_PERIOD_US)
         {
+            jitter_track(instant_now - s_pulse_time_start);
             pin_set(PINIDX_CLOCK, 1);
             s_readstate = DETECTION_READSTATE_IDLE;
         }
@@ -309,21 +462,12 @@ static void handle_read_cartid(void)
     {
         s_bit_count = 0U;
         s_byte_count++;
-        // byte == 0: all bits are drained from 74HC165
-        // byte == ff: GPIO_X2 is floating...
-        if ((s_read_byte == 0) || (s_read_byte == 0xff))
-        {
+        if (!cartid_accept(s_read_byte))
             s_state = DETECTION_STATE_INSERTED;
-        }
-        else
-        {
-            // neither drained nor floating, accept byte
-            s_cart_id <<= 8;
-            s_cart_id = s_cart_id | s_read_byte;
-        }
         s_read_byte = 0;
     }
-    if (s_byte_count >= CARTID_MAX_BYTES)
+    // A byte held back as a possible end marker still counts towards the read limit
+    if ((s_cart_id.len >= CARTID_MAX_BYTES) || (s_byte_count >= CARTID_MAX_BYTES + CARTID_END_BYTES))
     {
         s_state = DETECTION_STATE_INSERTED;
     }
@@ -331,23 +475,65 @@ static void handle_read_cartid(void)
     if (s_state == DETECTION_STATE_INSERTED)
     {
         s_byte_count = 0U;
+        s_end_pending = false;
         set_pins_enable_read(false);
         config_pins_listening_state();
+        LOG_INF("Cartridge ID read took %u us, worst-case bit jitter %u us", time_now_us() - s_read_time_start,
+                s_jitter_max);
+        // A complete read is on disk even if the daemon dies later
+        detection_capture_flush(&s_capture);
         // cart insert event
         if (s_config.p_event_listener)
             s_config.p_event_listener(DETECTION_EVENT_INSERTED, s_cart_id);
     }
 }
 
+static void cartid_append(const unsigned byte)
+{
+    if (s_cart_id.len >= CARTID_MAX_BYTES)
+        return;
+    s_cart_id.value = (s_cart_id.value << 8) | byte;
+    s_cart_id.len++;
+}
+
+// Returns false once the end of the ID was read. A single 0x00 or 0xFF is held back: it is part of the ID
+// unless the next byte repeats it.
+static bool cartid_accept(const unsigned byte)
+{
+    if (s_end_pending && (byte == s_end_byte))
+        return false;
+    if (s_end_pending)
+        cartid_append(s_end_byte);
+    s_end_pending = (byte == 0x00) || (byte == 0xff);
+    if (s_end_pending)
+        s_end_byte = byte;
+    else
+        cartid_append(byte);
+    return true;
+}
+
 static void handle_inserted(void)
 {
+    pin_events_drain(PINIDX_ROUTE_EN);
     int pin_state = pin_get(PINIDX_ROUTE_EN);
     if (pin_state == ROUTE_EN_INACTIVE)
     {
         // cart eject event
         if (s_config.p_event_listener)
             s_config.p_event_listener(DETECTION_EVENT_REMOVED, s_cart_id);
-        s_cart_id = 0U;
+        s_cart_id = (detection_cartid_t){.value = 0, .len = 0};
         s_state = DETECTION_STATE_WAIT;
+        detection_capture_flush(&s_capture);
     }
 }
+
+static void state_reset(void)
+{
+    s_state = DETECTION_STATE_WAIT;
+    s_readstate = DETECTION_READSTATE_IDLE;
+    s_bit_count = 0U;
+    s_byte_count = 0U;
+    s_read_byte = 0U;
+    s_end_pending = false;
+    s_cart_id = (detection_cartid_t){.value = 0, .len = 0};
+}
@@ -1,5 +1,9 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
 typedef enum
 {
     DETECTION_EVENT_INSERTED = 10,
@@ -13,7 +17,14 @@ typedef enum
     DETECTION_STATE_INSERTED = 30
 } detection_state_t;
 
-typedef void (*detection_event_cb)(const detection_event_t /*event*/, const unsigned /* cart id */);
+// Cartridge ID as shifted out by the cartridge, most significant byte first
+typedef struct
+{
+    uint64_t value;
+    uint8_t len; // number of bytes read, 0 if the cartridge sent none
+} detection_cartid_t;
+
+typedef void (*detection_event_cb)(const detection_event_t /*event*/, const detection_cartid_t /* cart id */);
 
 typedef struct
 {
@@ -21,14 +32,30 @@ typedef struct
     int line;
 } detection_pincfg_t;
 
+// Stands in for the GPIO lines and the clock, pins are numbered route_en, clock, data
+typedef struct
+{
+    int (*pin_get)(const unsigned pin);
+    void (*pin_set)(const unsigned pin, const int val);
+    unsigned (*time_now_us)(void);
+} detection_io_t;
+
 typedef struct
 {
     detection_pincfg_t pin_route_en;
     detection_pincfg_t pin_clock;
     detection_pincfg_t pin_data;
     detection_event_cb p_event_listener;
+    const char *p_capture_path; // records every pin access and clock read when set
+    const detection_io_t *p_io; // NULL to use the GPIO lines
 } detection_config_t;
 
-void detection_init(const detection_config_t *const p_cfg);
+int detection_init(const detection_config_t *const p_cfg);
 void detection_deinit(void);
+// Readable on every edge of the insertion line, -1 while the ID is being read or edges are unavailable
+int detection_fd(void);
+// Level of the insertion line, only meaningful before the detection thread runs
+bool detection_present(void);
 detection_state_t detection_handle();
+// Formats the ID in hexadecimal with two digits per byte read, but at least four as cartridge numbers always were
+const char *detection_cartid_str(const detection_cartid_t id, char *p_buf, const size_t size);
@@ -0,0 +1,167 @@
+#include "detection_capture.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "log.h"
+#include "rt.h"
+
+#define CAPTURE_MAGIC "CARTCAP1"
+// How often the writer thread wakes up to write out queued records
+#define CAPTURE_WRITE_PERIOD_NS (50 * 1000 * 1000)
+
+// Writes out what the read path queued, it only ever runs outside of the read path
+static void capture_drain(detection_capture_t *p_cap)
+{
+    size_t tail = atomic_load_explicit(&p_cap->tail, memory_order_relaxed);
+    const size_t head = atomic_load_explicit(&p_cap->head, memory_order_acquire);
+
+    while (tail != head)
+    {
+        (void)fwrite(&p_cap->p_ring[tail % DETECTION_CAPTURE_RING], sizeof(detection_capture_rec_t), 1,
+                     p_cap->p_file);
+        tail++;
+    }
+    atomic_store_explicit(&p_cap->tail, tail, memory_order_release);
+}
+
+static void *capture_writer(void *p_arg)
+{
+    detection_capture_t *p_cap = p_arg;
+    const struct timespec period = {.tv_sec = 0, .tv_nsec = CAPTURE_WRITE_PERIOD_NS};
+    unsigned long reported = 0;
+    bool stop = false;
+
+    while (!stop)
+    {
+        // Checked before draining, so the records queued before the stop are still written
+        stop = atomic_load(&p_cap->stop);
+        capture_drain(p_cap);
+        if (atomic_exchange(&p_cap->flush, false) || stop)
+            fflush(p_cap->p_file);
+        const unsigned long dropped = atomic_load(&p_cap->dropped);
+        if (dropped != reported)
+            LOG_WRN("GPIO capture lost %lu records, the writer fell behind", dropped - reported);
+        reported = dropped;
+        if (!stop)
+            nanosleep(&period, NULL);
+    }
+    return NULL;
+}
+
+int detection_capture_create(detection_capture_t *p_cap, const char *const p_path)
+{
+    detection_capture_hdr_t hdr = {.magic = CAPTURE_MAGIC, .started = (uint64_t)time(NULL)};
+    int rc = 0;
+
+    *p_cap = (detection_capture_t){.p_file = fopen(p_path, "ab"), .last_us = 0, .started = false};
+    if (!p_cap->p_file)
+        return -errno;
+    if (fwrite(&hdr, sizeof(hdr), 1, p_cap->p_file) != 1)
+    {
+        detection_capture_close(p_cap);
+        return -EIO;
+    }
+    // Allocated and touched here, so queueing a record never faults
+    p_cap->p_ring = calloc(DETECTION_CAPTURE_RING, sizeof(*p_cap->p_ring));
+    if (!p_cap->p_ring)
+    {
+        detection_capture_close(p_cap);
+        return -ENOMEM;
+    }
+    memset(p_cap->p_ring, 0, DETECTION_CAPTURE_RING * sizeof(*p_cap->p_ring));
+    rc = rt_thread_create(&p_cap->writer, capture_writer, p_cap);
+    if (rc != 0)
+    {
+        free(p_cap->p_ring);
+        p_cap->p_ring = NULL;
+        detection_capture_close(p_cap);
+        return -rc;
+    }
+    return 0;
+}
+
+int detection_capture_open(detection_capture_t *p_cap, const char *const p_path)
+{
+    detection_capture_hdr_t hdr;
+
+    *p_cap = (detection_capture_t){.p_file = fopen(p_path, "rb"), .last_us = 0, .started = false};
+    if (!p_cap->p_file)
+        return -errno;
+    if ((fread(&hdr, sizeof(hdr), 1, p_cap->p_file) != 1) ||
+        (memcmp(hdr.magic, CAPTURE_MAGIC, sizeof(hdr.magic)) != 0))
+    {
+        detection_capture_close(p_cap);
+        return -EINVAL;
+    }
+    p_cap->run_started = hdr.started;
+    return 0;
+}
+
+void detection_capture_write(detection_capture_t *p_cap, const uint32_t now_us, const detection_capture_kind_t kind,
+                             const unsigned pin, const unsigned value)
+{
+    size_t head = 0;
+
+    if (!p_cap->p_ring)
+        return;
+    head = atomic_load_explicit(&p_cap->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&p_cap->tail, memory_order_acquire) >= DETECTION_CAPTURE_RING)
+    {
+        atomic_fetch_add_explicit(&p_cap->dropped, 1, memory_order_relaxed);
+        return;
+    }
+    // The first record carries the clock itself, replays start at the same time the capture did
+    p_cap->p_ring[head % DETECTION_CAPTURE_RING] = (detection_capture_rec_t){
+        .delta_us = p_cap->started ? (now_us - p_cap->last_us) : now_us, .kind = kind, .pin = pin, .value = value};
+    p_cap->last_us = now_us;
+    p_cap->started = true;
+    atomic_store_explicit(&p_cap->head, head + 1, memory_order_release);
+}
+
+bool detection_capture_read(detection_capture_t *p_cap, detection_capture_rec_t *p_rec, uint32_t *p_time_us)
+{
+    if (!p_cap->p_file || p_cap->run_next || (fread(p_rec, sizeof(*p_rec), 1, p_cap->p_file) != 1))
+        return false;
+    // Records never start with the magic, their kind is a small number where it has a letter
+    if (memcmp(p_rec, CAPTURE_MAGIC, sizeof(*p_rec)) == 0)
+    {
+        p_cap->run_next = (fread(&p_cap->run_started, sizeof(p_cap->run_started), 1, p_cap->p_file) == 1);
+        return false;
+    }
+    p_cap->last_us += p_rec->delta_us;
+    *p_time_us = p_cap->last_us;
+    return true;
+}
+
+bool detection_capture_next(detection_capture_t *p_cap)
+{
+    if (!p_cap->run_next)
+        return false;
+    p_cap->run_next = false;
+    p_cap->last_us = 0;
+    p_cap->started = false;
+    return true;
+}
+
+void detection_capture_flush(detection_capture_t *p_cap)
+{
+    if (p_cap->p_ring)
+        atomic_store(&p_cap->flush, true);
+}
+
+void detection_capture_close(detection_capture_t *p_cap)
+{
+    if (p_cap->p_ring)
+    {
+        atomic_store(&p_cap->stop, true);
+        pthread_join(p_cap->writer, NULL);
+        free(p_cap->p_ring);
+        p_cap->p_ring = NULL;
+    }
+    if (p_cap->p_file)
+        fclose(p_cap->p_file);
+    p_cap->p_file = NULL;
+}
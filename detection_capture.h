@@ -0,0 +1,64 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Records the read path can queue before the writer thread has to catch up, 64 kB
+#define DETECTION_CAPTURE_RING (8192)
+
+// Every interaction of the detection state machine with its pins and clock, in the order it happened. Replaying
+// the records reproduces a read exactly, including the timing the state machine saw.
+typedef enum
+{
+    DETECTION_CAPTURE_TIME = 1, // value: none, the delta is the time read
+    DETECTION_CAPTURE_GET = 2,  // value: level read from pin
+    DETECTION_CAPTURE_SET = 3   // value: level written to pin
+} detection_capture_kind_t;
+
+typedef struct __attribute__((packed))
+{
+    uint32_t delta_us; // time since the previous record
+    uint8_t kind;
+    uint8_t pin;
+    uint16_t value;
+} detection_capture_rec_t;
+
+// Each run of the daemon appends one of these before its records, so a restart keeps the capture of the run before
+typedef struct __attribute__((packed))
+{
+    char magic[8];
+    uint64_t started; // wall clock seconds
+} detection_capture_hdr_t;
+
+typedef struct
+{
+    FILE *p_file;
+    uint32_t last_us; // the detection clock wraps, so do the deltas
+    bool started;
+    uint64_t run_started; // header of the run being read
+    bool run_next;        // reading stopped at the header of another run
+    // Writing only: the read path queues records, a thread of its own writes them out
+    detection_capture_rec_t *p_ring;
+    atomic_size_t head; // next record the read path fills
+    atomic_size_t tail; // next record the writer writes out
+    atomic_bool flush;
+    atomic_bool stop;
+    atomic_ulong dropped;
+    pthread_t writer;
+} detection_capture_t;
+
+// Appends a new run to the capture at p_path
+int detection_capture_create(detection_capture_t *p_cap, const char *const p_path);
+int detection_capture_open(detection_capture_t *p_cap, const char *const p_path);
+void detection_capture_write(detection_capture_t *p_cap, const uint32_t now_us, const detection_capture_kind_t kind,
+                             const unsigned pin, const unsigned value);
+// Returns false at the end of the run, the clock as the state machine saw it is in *p_time_us
+bool detection_capture_read(detection_capture_t *p_cap, detection_capture_rec_t *p_rec, uint32_t *p_time_us);
+// Moves on to the next run of the capture, false if there is none
+bool detection_capture_next(detection_capture_t *p_cap);
+// Has the writer thread put everything queued so far on disk, without blocking the caller
+void detection_capture_flush(detection_capture_t *p_cap);
+void detection_capture_close(detection_capture_t *p_cap);
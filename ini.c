@@ -0,0 +1,125 @@
+#include "ini.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static bool is_blank(const char c)
+{
+    return (c == ' ') || (c == '\t') || (c == '\r');
+}
+
+static ini_span_t span_trim(const char *p_begin, const char *p_end)
+{
+    while ((p_begin < p_end) && is_blank(*p_begin))
+        p_begin++;
+    while ((p_end > p_begin) && is_blank(p_end[-1]))
+        p_end--;
+    return (ini_span_t){.p = p_begin, .len = p_end - p_begin};
+}
+
+int ini_open(ini_t *p_ini, const char *const p_path)
+{
+    struct stat st;
+    int fd = -1;
+
+    memset(p_ini, 0, sizeof(*p_ini));
+    fd = open(p_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -errno;
+    if (fstat(fd, &st) != 0)
+    {
+        const int err = errno;
+        close(fd);
+        return -err;
+    }
+    // mmap() refuses empty mappings, an empty file simply has no tokens
+    if (st.st_size > 0)
+    {
+        void *p_map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p_map == MAP_FAILED)
+        {
+            const int err = errno;
+            close(fd);
+            return -err;
+        }
+        p_ini->p_data = p_map;
+        p_ini->size = st.st_size;
+    }
+    // The mapping stays valid after closing the descriptor
+    close(fd);
+    return 0;
+}
+
+void ini_close(ini_t *p_ini)
+{
+    if (p_ini->p_data)
+        munmap((void *)p_ini->p_data, p_ini->size);
+    p_ini->p_data = NULL;
+    p_ini->size = 0;
+}
+
+ini_token_t ini_next(ini_t *p_ini)
+{
+    const char *const p_end = p_ini->p_data + p_ini->size;
+
+    while (p_ini->pos < p_ini->size)
+    {
+        const char *p_line = p_ini->p_data + p_ini->pos;
+        const char *p_eol = memchr(p_line, '\n', p_end - p_line);
+        if (!p_eol)
+            p_eol = p_end;
+        p_ini->pos = (p_eol - p_ini->p_data) + 1;
+        p_ini->line++;
+
+        const ini_span_t line = span_trim(p_line, p_eol);
+        if ((line.len == 0) || (line.p[0] == '#') || (line.p[0] == ';'))
+            continue;
+
+        if (line.p[0] == '[')
+        {
+            if (line.p[line.len - 1] != ']')
+                return INI_TOKEN_ERROR;
+            p_ini->section = span_trim(line.p + 1, line.p + line.len - 1);
+            p_ini->key = (ini_span_t){0};
+            p_ini->value = (ini_span_t){0};
+            return INI_TOKEN_SECTION;
+        }
+
+        const char *p_eq = memchr(line.p, '=', line.len);
+        if (!p_eq || (p_eq == line.p))
+            return INI_TOKEN_ERROR;
+        p_ini->key = span_trim(line.p, p_eq);
+        p_ini->value = span_trim(p_eq + 1, line.p + line.len);
+        return INI_TOKEN_KEY;
+    }
+    return INI_TOKEN_END;
+}
+
+bool ini_span_eq(const ini_span_t span, const char *const p_str)
+{
+    return (strlen(p_str) == span.len) && (memcmp(span.p, p_str, span.len) == 0);
+}
+
+bool ini_span_prefix(const ini_span_t span, const char *const p_prefix)
+{
+    const size_t len = strlen(p_prefix);
+    return (len <= span.len) && (memcmp(span.p, p_prefix, len) == 0);
+}
+
+char *ini_span_dup(const ini_span_t span)
+{
+    return strndup(span.p, span.len);
+}
+
+size_t ini_span_copy(const ini_span_t span, char *p_dest, const size_t size)
+{
+    const size_t len = (span.len < size) ? span.len : (size - 1);
+    memcpy(p_dest, span.p, len);
+    p_dest[len] = '\0';
+    return len;
+}
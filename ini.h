@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// A view into the mapped file, not NUL terminated
+typedef struct
+{
+    const char *p;
+    size_t len;
+} ini_span_t;
+
+typedef enum
+{
+    INI_TOKEN_SECTION = 0,
+    INI_TOKEN_KEY = 1,
+    INI_TOKEN_END = 2,
+    INI_TOKEN_ERROR = 3
+} ini_token_t;
+
+typedef struct
+{
+    const char *p_data;
+    size_t size;
+    size_t pos;
+    unsigned line;
+    ini_span_t section;
+    ini_span_t key;
+    ini_span_t value;
+} ini_t;
+
+int ini_open(ini_t *p_ini, const char *const p_path);
+void ini_close(ini_t *p_ini);
+ini_token_t ini_next(ini_t *p_ini);
+bool ini_span_eq(const ini_span_t span, const char *const p_str);
+bool ini_span_prefix(const ini_span_t span, const char *const p_prefix);
+char *ini_span_dup(const ini_span_t span);
+size_t ini_span_copy(const ini_span_t span, char *p_dest, const size_t size);
@@ -6,7 +6,7 @@ void log_fatal(const char *fmt, ...)
     char str[255] = {0};
     va_list argp;
     va_start(argp, fmt);
-    vsprintf(str, fmt, argp);
+    vsnprintf(str, sizeof(str), fmt, argp);
     va_end(argp);
 
     printf("[FATAL] %s\n", str);
@@ -18,7 +18,7 @@ void log_error(const char *fmt, ...)
     char str[255] = {0};
     va_list argp;
     va_start(argp, fmt);
-    vsprintf(str, fmt, argp);
+    vsnprintf(str, sizeof(str), fmt, argp);
     va_end(argp);
 
     printf("[ERROR] %s\n", str);
@@ -29,7 +29,7 @@ void log_warning(const char *fmt, ...)
     char str[255] = {0};
     va_list argp;
     va_start(argp, fmt);
-    vsprintf(str, fmt, argp);
+    vsnprintf(str, sizeof(str), fmt, argp);
     va_end(argp);
 
     printf("[WARNING] %s\n", str);
@@ -40,7 +40,7 @@ void log_info(const char *fmt, ...)
     char str[255] = {0};
     va_list argp;
     va_start(argp, fmt);
-    vsprintf(str, fmt, argp);
+    vsnprintf(str, sizeof(str), fmt, argp);
     va_end(argp);
 
     printf("[INFO] %s\n", str);
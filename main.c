@@ -1,99 +1,589 @@
+#include <errno.h>
+#include <glob.h>
+#include <libgen.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <systemd/sd-daemon.h>
+#include <systemd/sd-event.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "bus.h"
+#include "cartdb.h"
 #include "config.h"
 #include "detection.h"
 #include "log.h"
+#include "module.h"
 #include "notify.h"
+#include "notify_sched.h"
+#include "overlay.h"
 #include "pinconfig.h"
+#include "rt.h"
+#include "state.h"
 #include "unit.h"
+#include "unit_health.h"
+#include "watchdog.h"
 
+#ifndef CONFIG_FILE
 #define CONFIG_FILE "/etc/cartridged/config.ini"
+#endif
+// Overridden by tools/soak.c, which runs the daemon as an unprivileged user
+#ifndef STATE_FILE
+#define STATE_FILE "/run/cartridged/state"
+#endif
 #define DEFAULT_CARTDB_PATH "/etc/cartridged/cartdb/"
 #define DEFAULT_NOTIFY true
+#define DEFAULT_NOTIFY_FAILURES true
+#define DEFAULT_REALTIME false
+#define DEFAULT_REALTIME_PRIO 50
+#define DEFAULT_REALTIME_CPU -1
+#define DEFAULT_ACTIVATION UNIT_ACTIVATION_SEQUENTIAL
+#define DEFAULT_STOP_TIMEOUT_MS 5000U
+#define DEFAULT_NOTIFY_WINDOW_MS 500U
+#define DEFAULT_PREWARM true
+#define DEFAULT_NOTIFY_INTERVAL_MS 2000U
+// Upper bound for the detection thread to sleep on the insertion line, keeps its heartbeat going
+#define DETECTION_IDLE_TIMEOUT_MS 1000
+// Startup budgets, checked once the daemon is ready. Without notifications libnotify and GLib are not mapped.
+#define STARTUP_TARGET_US 500000U
+#define STARTUP_RSS_TARGET_KB 6144L
+#define STARTUP_RSS_NOTIFY_TARGET_KB 12288L
 
-static config_t config = {0};
+typedef struct
+{
+    detection_event_t event;
+    detection_cartid_t cart_id;
+} cart_event_msg_t;
+
+// Current configuration snapshot, only replaced as a whole on reload
+static config_t *p_config = NULL;
 static unit_t *p_unit_active = NULL;
+// Unit taken over from a previous run, waiting for the first ID read to confirm the cartridge is still the same
+static unit_t *p_unit_restored = NULL;
+static detection_cartid_t s_restored_id = {0};
+static char s_restored_path[512] = {0};
+// Carries detection events from the detection thread to the main thread
+static int s_event_pipe[2] = {-1, -1};
+// Single event loop of the main thread, all sources except the GPIO read path are dispatched from here
+static sd_event *s_event = NULL;
+static int s_inotify_fd = -1;
+static int s_config_wd = -1;
+static int s_cartdb_wd = -1;
+static cartdb_t s_cartdb = {0};
+static pthread_t s_detection_thread;
+static int s_detection_stop_fd = -1;
+static rt_config_t s_rtcfg = {0};
+static uint64_t s_startup_begin_us = 0;
+static uint64_t s_startup_stage_us = 0;
+static uint64_t s_cycle_start_us = 0;
+static unsigned long s_cycle_count = 0;
 
-static void cart_event(const detection_event_t event, const unsigned cart_id);
-static void cart_unit_load(const char *const p_unit_path);
+static void cart_event_post(const detection_event_t event, const detection_cartid_t cart_id);
+static void cart_event(const detection_event_t event, const detection_cartid_t cart_id);
+static void cart_unit_load(const char *const p_unit_path, const detection_cartid_t cart_id);
+static void cart_state_restore(void);
+static bool cart_state_adopt(const detection_cartid_t cart_id);
 static void notify_plugin(unit_t *p_unit);
-static void notify_notfound(unsigned int number);
+static void notify_unplug(unit_t *p_unit);
+static void cartdb_prepare(void);
+static void notify_service_failed(unit_t *p_unit, unit_service_t *p_serv);
+static void cart_service_health(unit_t *p_unit, unit_service_t *p_serv, const bool failed);
+static void status_update(void);
+static void notify_notfound(const char *const p_id);
+static void cart_unit_release(const bool stop);
 
-const detection_config_t s_detcfg = {
-    .pin_route_en = PIN_ROUTE_EN, .pin_clock = PIN_GPIO_Y0, .pin_data = PIN_GPIO_Y1, .p_event_listener = cart_event};
+static detection_config_t s_detcfg = {.pin_route_en = PIN_ROUTE_EN,
+                                       .pin_clock = PIN_GPIO_Y0,
+                                       .pin_data = PIN_GPIO_Y1,
+                                       .p_event_listener = cart_event_post,
+                                       .p_capture_path = NULL,
+                                       .p_io = NULL};
 
 static void destroy()
 {
     detection_deinit();
+    // Services of the active cartridge keep running, only the daemon's own state goes away
+    cart_unit_release(false);
+    unit_destroy(p_unit_restored);
+    p_unit_restored = NULL;
+    unit_deinit();
+    module_deinit();
+    cartdb_free(&s_cartdb);
+    free(p_config);
+    p_config = NULL;
+}
+
+static uint64_t time_now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000U + ts.tv_nsec / 1000U;
+}
+
+static long rss_kb(void)
+{
+    char line[128] = {0};
+    long rss = -1;
+    FILE *p_file = fopen("/proc/self/status", "r");
+    if (!p_file)
+        return rss;
+    while (fgets(line, sizeof(line), p_file))
+    {
+        if (sscanf(line, "VmRSS: %ld kB", &rss) == 1)
+            break;
+    }
+    fclose(p_file);
+    return rss;
+}
+
+static void startup_stage(const char *const p_stage)
+{
+    const uint64_t now = time_now_us();
+    LOG_INF("Startup: %s done in %llu us (total %llu us)", p_stage,
+            (unsigned long long)(now - s_startup_stage_us), (unsigned long long)(now - s_startup_begin_us));
+    s_startup_stage_us = now;
+}
+
+// Compares startup time and resident memory with their budgets, so a change that grows them shows in the log
+static void startup_check(void)
+{
+    const unsigned long long took = time_now_us() - s_startup_begin_us;
+    const long rss = rss_kb();
+    const long rss_target = p_config->notification_enabled ? STARTUP_RSS_NOTIFY_TARGET_KB : STARTUP_RSS_TARGET_KB;
+
+    if (took > STARTUP_TARGET_US)
+        LOG_WRN("Startup took %llu us, over its target of %u us", took, STARTUP_TARGET_US);
+    else
+        LOG_INF("Startup took %llu us, target %u us", took, STARTUP_TARGET_US);
+    // mlockall() makes every mapping resident, the budget only holds for pages actually used
+    if (p_config->realtime_enabled)
+        LOG_INF("Startup: resident memory %ld kB, not checked with locked memory", rss);
+    else if (rss > rss_target)
+        LOG_WRN("Startup: resident memory %ld kB, over its target of %ld kB", rss, rss_target);
+    else
+        LOG_INF("Startup: resident memory %ld kB, target %ld kB", rss, rss_target);
+}
+
+static void config_defaults(config_t *p_config)
+{
+    strncpy(p_config->cartdb_path, DEFAULT_CARTDB_PATH, sizeof(p_config->cartdb_path));
+    p_config->notification_enabled = DEFAULT_NOTIFY;
+    p_config->failure_notification_enabled = DEFAULT_NOTIFY_FAILURES;
+    p_config->realtime_enabled = DEFAULT_REALTIME;
+    p_config->realtime_priority = DEFAULT_REALTIME_PRIO;
+    p_config->realtime_cpu = DEFAULT_REALTIME_CPU;
+    p_config->activation = DEFAULT_ACTIVATION;
+    p_config->stop_timeout_ms = DEFAULT_STOP_TIMEOUT_MS;
+    p_config->bus_address[0] = '\0';
+    p_config->notify_window_ms = DEFAULT_NOTIFY_WINDOW_MS;
+    p_config->prewarm_enabled = DEFAULT_PREWARM;
+    p_config->notify_interval_ms = DEFAULT_NOTIFY_INTERVAL_MS;
+    p_config->gpio_capture[0] = '\0';
+    strncpy(p_config->overlay_root, OVERLAY_DEFAULT_ROOT, sizeof(p_config->overlay_root));
+    p_config->module_root[0] = '\0';
+}
+
+static void *detection_thread(void *p_arg)
+{
+    // Real-time parameters are fixed at startup, reloads never touch this thread
+    const rt_config_t *p_rtcfg = p_arg;
+    if (p_rtcfg)
+    {
+        if (rt_thread_setup(p_rtcfg) != 0)
+            LOG_WRN("%s", "Real-time setup failed, detection continues with normal scheduling");
+    }
+    struct pollfd fds[2] = {{.fd = s_detection_stop_fd, .events = POLLIN}, {.fd = -1, .events = POLLIN}};
+    while (1)
+    {
+        detection_state_t state = detection_handle();
+        watchdog_beat();
+        if (state == DETECTION_STATE_READ_ID)
+        {
+            usleep(100U);
+            continue;
+        }
+        // Sleep until the insertion line changes, the timeout also recovers from a missed edge
+        fds[1].fd = detection_fd();
+        if ((poll(fds, 2, (fds[1].fd >= 0) ? DETECTION_IDLE_TIMEOUT_MS : 1) > 0) && (fds[0].revents & POLLIN))
+            break;
+    }
+    return NULL;
+}
+
+// Removing a cartridge blocks the event loop for up to the stop budget, so the budget has to leave room for the
+// watchdog. Waits still ping in between, this keeps a single stop from outlasting the timeout on its own.
+static void config_check(config_t *p_cfg)
+{
+    const uint64_t limit_ms = watchdog_timeout_us() / 2000U;
+
+    if ((limit_ms > 0) && (p_cfg->stop_timeout_ms > limit_ms))
+    {
+        LOG_WRN("stop_timeout_ms=%u exceeds half the watchdog timeout, using %llu", p_cfg->stop_timeout_ms,
+                (unsigned long long)limit_ms);
+        p_cfg->stop_timeout_ms = (unsigned)limit_ms;
+    }
+}
+
+static int config_read(config_t *p_cfg)
+{
+    struct stat st;
+    int rc = 0;
+
+    config_defaults(p_cfg);
+    LOG_INF("Reading configuration from '%s'", CONFIG_FILE);
+    rc = config_load(CONFIG_FILE, p_cfg);
+    config_check(p_cfg);
+    if (rc != 0)
+    {
+        LOG_WRN("Failed to read configuration at '%s'", CONFIG_FILE);
+    }
+    else if ((stat(p_cfg->cartdb_path, &st) != 0) || !S_ISDIR(st.st_mode))
+    {
+        LOG_WRN("Cartridge DB at '%s' is not accessible", p_cfg->cartdb_path);
+        rc = ENOENT;
+    }
+    else
+    {
+        LOG_INF("Configuration:\ndb_path=%s\nnotifications=%s\nrealtime=%s\nactivation=%s", p_cfg->cartdb_path,
+                p_cfg->notification_enabled ? "yes" : "no", p_cfg->realtime_enabled ? "yes" : "no",
+                (p_cfg->activation == UNIT_ACTIVATION_TARGET) ? "target" : "sequential");
+    }
+    return rc;
+}
+
+static void cartdb_reload(void)
+{
+    const uint64_t start_us = time_now_us();
+    cartdb_t db = {0};
+    const int rc = cartdb_build(&db, p_config->cartdb_path);
+
+    if (rc != 0)
+    {
+        LOG_ERR("Could not index cartridge DB '%s' (error '%s'), keeping previous index", p_config->cartdb_path,
+                strerror(-rc));
+        return;
+    }
+    cartdb_free(&s_cartdb);
+    s_cartdb = db;
+    LOG_INF("Indexed %zu cartridge ID ranges in %llu us", s_cartdb.size,
+            (unsigned long long)(time_now_us() - start_us));
+}
+
+static void cartdb_watch_setup(void)
+{
+    if (s_inotify_fd < 0)
+        return;
+    // Both watches share a descriptor when the DB lives next to the configuration file
+    if ((s_cartdb_wd >= 0) && (s_cartdb_wd != s_config_wd))
+        (void)inotify_rm_watch(s_inotify_fd, s_cartdb_wd);
+    s_cartdb_wd = inotify_add_watch(s_inotify_fd, p_config->cartdb_path,
+                                    IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE);
+    if (s_cartdb_wd < 0)
+        LOG_WRN("Could not watch '%s' for changes (error '%s')", p_config->cartdb_path, strerror(errno));
+}
+
+static void config_reload(void)
+{
+    struct timespec t_start, t_end;
+    config_t *p_new = malloc(sizeof(*p_new));
+    config_t *p_old = p_config;
+
+    if (!p_new)
+    {
+        LOG_ERR("%s", "Out of memory, keeping current configuration");
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t_start);
+    sd_notify(0, "RELOADING=1");
+    if (config_read(p_new) != 0)
+    {
+        LOG_WRN("%s", "Reload failed, keeping current configuration");
+        free(p_new);
+        sd_notify(0, "READY=1");
+        return;
+    }
+    if ((p_new->realtime_enabled != p_old->realtime_enabled) ||
+        (p_new->realtime_priority != p_old->realtime_priority) || (p_new->realtime_cpu != p_old->realtime_cpu))
+    {
+        LOG_WRN("%s", "Real-time settings only take effect after a restart");
+    }
+    if (strcmp(p_new->bus_address, p_old->bus_address) != 0)
+        LOG_WRN("%s", "bus_address only takes effect after a restart");
+    if (strcmp(p_new->gpio_capture, p_old->gpio_capture) != 0)
+        LOG_WRN("%s", "gpio_capture only takes effect after a restart");
+    // Overlays of the active cartridge have to be removed from where they were applied
+    if (strcmp(p_new->overlay_root, p_old->overlay_root) != 0)
+        LOG_WRN("%s", "overlay_root only takes effect after a restart");
+    if (strcmp(p_new->module_root, p_old->module_root) != 0)
+        LOG_WRN("%s", "module_root only takes effect after a restart");
+    // Events are only dispatched on this thread, so swapping the pointer between two events is atomic for them.
+    // The active unit was parsed into its own allocation and keeps running untouched.
+    p_config = p_new;
+    free(p_old);
+    cartdb_watch_setup();
+    cartdb_reload();
+    notify_enable(p_config->notification_enabled);
+    notify_sched_configure(p_config->notify_window_ms, p_config->notify_interval_ms);
+    cartdb_prepare();
+    sd_notify(0, "READY=1");
+    clock_gettime(CLOCK_MONOTONIC, &t_end);
+    LOG_INF("Configuration reloaded in %ld us",
+            (t_end.tv_sec - t_start.tv_sec) * 1000000L + (t_end.tv_nsec - t_start.tv_nsec) / 1000L);
+}
+
+static void reload_watch_setup(void)
+{
+    char dir[sizeof(CONFIG_FILE)] = CONFIG_FILE;
+
+    // Watch the directory rather than the file, editors replace it by renaming
+    s_inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (s_inotify_fd >= 0)
+        s_config_wd = inotify_add_watch(s_inotify_fd, dirname(dir), IN_CLOSE_WRITE | IN_MOVED_TO);
+    if (s_config_wd < 0)
+        LOG_WRN("Could not watch '%s' for changes (error '%s')", CONFIG_FILE, strerror(errno));
+}
+
+static int handle_signal(sd_event_source *p_source, const struct signalfd_siginfo *p_info, void *p_userdata)
+{
+    (void)p_source;
+    (void)p_userdata;
+    if (p_info->ssi_signo == SIGHUP)
+    {
+        LOG_INF("%s", "SIGHUP received, reloading configuration");
+        config_reload();
+        return 0;
+    }
+    LOG_INF("Signal %u received, shutting down", p_info->ssi_signo);
+    return sd_event_exit(s_event, 0);
+}
+
+static int handle_event_pipe(sd_event_source *p_source, int fd, uint32_t revents, void *p_userdata);
+static int handle_inotify(sd_event_source *p_source, int fd, uint32_t revents, void *p_userdata);
+
+static void event_loop_setup(void)
+{
+    static const int signals[] = {SIGHUP, SIGTERM, SIGINT};
+    int rc = sd_event_default(&s_event);
+
+    if (rc < 0)
+        LOG_FTL("Could not create event loop (error '%s')", strerror(-rc));
+    for (size_t i = 0; (i < sizeof(signals) / sizeof(signals[0])) && (rc >= 0); ++i)
+        rc = sd_event_add_signal(s_event, NULL, signals[i], handle_signal, NULL);
+    if (rc >= 0)
+        rc = sd_event_add_io(s_event, NULL, s_event_pipe[0], EPOLLIN, handle_event_pipe, NULL);
+    if ((rc >= 0) && (s_inotify_fd >= 0))
+        rc = sd_event_add_io(s_event, NULL, s_inotify_fd, EPOLLIN, handle_inotify, NULL);
+    if (rc >= 0)
+        rc = notify_sched_init(s_event, p_config->notify_window_ms, p_config->notify_interval_ms);
+    if (rc < 0)
+        LOG_FTL("Could not set up event sources (error '%s')", strerror(-rc));
 }
 
 static void setup()
 {
     int rc = 0;
+    sigset_t mask;
+    s_startup_begin_us = s_startup_stage_us = time_now_us();
     atexit(destroy);
-    // Initialize detection module
-    detection_init(&s_detcfg);
+    // Signals are handled by the event loop, blocked before any thread is spawned so all of them inherit the mask
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGHUP);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
     // read in configuration
-    LOG_INF("Reading configuration from '%s'", CONFIG_FILE);
-    rc = config_load(CONFIG_FILE, &config);
+    p_config = malloc(sizeof(*p_config));
+    if (!p_config)
+        LOG_FTL("%s", "Out of memory");
+    rc = config_read(p_config);
     if (rc != 0)
     {
-        LOG_WRN("Failed to read configuration at '%s', using fallback values", CONFIG_FILE);
-        strncpy(config.cartdb_path, DEFAULT_CARTDB_PATH, sizeof(config.cartdb_path));
-        config.notification_enabled = DEFAULT_NOTIFY;
+        LOG_WRN("%s", "Using fallback configuration values");
+        config_defaults(p_config);
+        config_check(p_config);
     }
-    else
+    startup_stage("configuration");
+    notify_enable(p_config->notification_enabled);
+    startup_stage("notification setup");
+    reload_watch_setup();
+    cartdb_watch_setup();
+    cartdb_reload();
+    startup_stage("cartridge DB index");
+    overlay_set_root(p_config->overlay_root);
+    // The module index is loaded once, insertions only look modules up in it
+    (void)module_init(p_config->module_root);
+    startup_stage("module index");
+    // Lock memory before the detection thread exists so its stack is locked too
+    if (p_config->realtime_enabled)
+    {
+        if (rt_memory_lock() != 0)
+            LOG_WRN("%s", "Memory is not locked, the read path may take page faults");
+        s_rtcfg.priority = p_config->realtime_priority;
+        s_rtcfg.cpu = p_config->realtime_cpu;
+    }
+    // Initialize detection module
+    s_detcfg.p_capture_path = (p_config->gpio_capture[0] != '\0') ? p_config->gpio_capture : NULL;
+    if (detection_init(&s_detcfg) != 0)
+    {
+        sd_notify(0, "STATUS=Failed to acquire GPIO lines");
+        LOG_FTL("%s", "Failed to acquire GPIO lines");
+    }
+    startup_stage("GPIO setup");
+    if (pipe(s_event_pipe) != 0)
+        LOG_FTL("Could not create event pipe (error '%s')", strerror(errno));
+    s_detection_stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (s_detection_stop_fd < 0)
+        LOG_FTL("Could not create eventfd (error '%s')", strerror(errno));
+    event_loop_setup();
+    if (bus_set_address(p_config->bus_address) != 0)
+        LOG_FTL("%s", "Out of memory");
+    if (bus_attach(s_event) != 0)
+        LOG_WRN("%s", "System bus not available yet, connecting on first use");
+    cart_state_restore();
+    startup_stage("state restore");
+    // Needs the bus attached to the event loop, LoadUnit replies for the prewarm arrive through it
+    cartdb_prepare();
+    startup_stage("cartridge DB prepare");
+    rc = rt_thread_create(&s_detection_thread, detection_thread, p_config->realtime_enabled ? &s_rtcfg : NULL);
+    if (rc != 0)
+        LOG_FTL("Could not start detection thread (error '%s')", strerror(rc));
+    startup_stage("detection thread");
+    rc = watchdog_setup(s_event);
+    if (rc < 0)
+        LOG_FTL("Could not arm watchdog timer (error '%s')", strerror(-rc));
+    // Dependent units may only proceed once GPIO lines are held and the configuration is in place
+    sd_notify(0, "READY=1\nSTATUS=Waiting for cartridge");
+    startup_stage("readiness notification");
+    startup_check();
+}
+
+static int handle_event_pipe(sd_event_source *p_source, int fd, uint32_t revents, void *p_userdata)
+{
+    cart_event_msg_t msg;
+    (void)p_source;
+    (void)fd;
+    (void)revents;
+    (void)p_userdata;
+    const ssize_t len = read(s_event_pipe[0], &msg, sizeof(msg));
+    if (len == sizeof(msg))
+    {
+        cart_event(msg.event, msg.cart_id);
+    }
+    else if ((len < 0) && (errno != EINTR))
+    {
+        LOG_FTL("Could not read detection event (error '%s')", strerror(errno));
+    }
+    return 0;
+}
+
+static int handle_inotify(sd_event_source *p_source, int fd, uint32_t revents, void *p_userdata)
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    char name[sizeof(CONFIG_FILE)] = CONFIG_FILE;
+    const char *p_basename = basename(name);
+    bool changed = false;
+    bool db_changed = false;
+    ssize_t len = 0;
+    (void)p_source;
+    (void)fd;
+    (void)revents;
+    (void)p_userdata;
+
+    // Drain all pending events first, so a burst of writes results in a single reload
+    while ((len = read(s_inotify_fd, buf, sizeof(buf))) > 0)
+    {
+        for (char *p = buf; p < buf + len; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len)
+        {
+            const struct inotify_event *p_ev = (const struct inotify_event *)p;
+            if (p_ev->len == 0)
+                continue;
+            // Only the configuration directory's config.ini, a file of that name in the cartridge DB is not it
+            if ((p_ev->wd == s_config_wd) && (strcmp(p_ev->name, p_basename) == 0))
+            {
+                changed = true;
+            }
+            else if (p_ev->wd == s_cartdb_wd)
+            {
+                const size_t name_len = strlen(p_ev->name);
+                if ((name_len > 5) && (strcmp(p_ev->name + name_len - 5, ".cart") == 0))
+                    db_changed = true;
+            }
+        }
+    }
+    if (changed)
+    {
+        LOG_INF("'%s' changed, reloading configuration", CONFIG_FILE);
+        config_reload();
+    }
+    else if (db_changed)
     {
-        LOG_INF("Configuration:\ndb_path=%s\nnotifications=%s", config.cartdb_path,
-                config.notification_enabled ? "yes" : "no");
+        // A configuration reload rebuilds the index anyway
+        LOG_INF("Cartridge DB '%s' changed, rebuilding index", p_config->cartdb_path);
+        cartdb_reload();
+        cartdb_prepare();
     }
+    return 0;
 }
 
-void loop()
+static void cart_event_post(const detection_event_t event, const detection_cartid_t cart_id)
 {
-    detection_state_t state = detection_handle();
-    usleep((state == DETECTION_STATE_WAIT) ? 1000U : 100U);
+    // Runs on the detection thread: hand the event over instead of blocking the read path on D-Bus.
+    // Writes below PIPE_BUF are atomic, so the message is never split.
+    const cart_event_msg_t msg = {.event = event, .cart_id = cart_id};
+    if (write(s_event_pipe[1], &msg, sizeof(msg)) != sizeof(msg))
+        LOG_ERR("Could not post detection event (error '%s')", strerror(errno));
 }
 
-static void cart_event(const detection_event_t event, const unsigned cart_id)
+static void cart_event(const detection_event_t event, const detection_cartid_t cart_id)
 {
-    char unit_file[256] = {0};
+    char id[24] = {0};
+    const char *p_unit_file = NULL;
     unit_find_result_t ufind_res = UNIT_FIND_NOTFOUND;
 
     switch (event)
     {
     case DETECTION_EVENT_INSERTED:
-        LOG_INF("Cartridge inserted! (id=%u)", cart_id);
-        ufind_res = unit_find(cart_id, config.cartdb_path, unit_file);
+        detection_cartid_str(cart_id, id, sizeof(id));
+        LOG_INF("Cartridge inserted! (id=%s, %u bytes)", id, cart_id.len);
+        s_cycle_start_us = time_now_us();
+        if (cart_state_adopt(cart_id))
+            break;
+        ufind_res = cartdb_find(&s_cartdb, cart_id, &p_unit_file);
         switch (ufind_res)
         {
         case UNIT_FIND_SUCCESS:
-            cart_unit_load(unit_file);
+            cart_unit_load(p_unit_file, cart_id);
             break;
         case UNIT_FIND_AMBIGOUS:
-            LOG_ERR("Cartridge #%04X ambigous unit files", cart_id);
+            LOG_ERR("Cartridge #%s ambigous unit files", id);
+            sd_notifyf(0, "STATUS=Cartridge #%s has ambiguous unit files", id);
             break;
         case UNIT_FIND_NOTFOUND:
-            LOG_ERR("Cartridge #%04X no unit file found", cart_id);
-            notify_notfound(cart_id);
+            LOG_ERR("Cartridge #%s no unit file found", id);
+            sd_notifyf(0, "STATUS=Cartridge #%s is unknown", id);
+            notify_notfound(id);
             break;
         }
         break;
 
     case DETECTION_EVENT_REMOVED:
-        LOG_INF("Cartridge removed! (id=%u)", cart_id);
-        if (p_unit_active)
-        {
-            unit_deactive(p_unit_active);
-            unit_destroy(p_unit_active);
-            p_unit_active = NULL;
-        }
+        LOG_INF("Cartridge removed! (id=%s)", detection_cartid_str(cart_id, id, sizeof(id)));
+        cart_unit_release(true);
+        sd_notify(0, "STATUS=Waiting for cartridge");
+        // Resident memory per cycle shows whether long runs of hot-swaps grow the daemon
+        LOG_INF("Cartridge cycle %lu took %llu us, resident memory %ld kB", ++s_cycle_count,
+                (unsigned long long)(time_now_us() - s_cycle_start_us), rss_kb());
         break;
 
     default:
@@ -106,6 +596,7 @@ static void unit_print(unit_t *p_unit)
 {
     printf("Unit '%s'\n", p_unit->p_unit_name);
     printf("Description: %s\n", p_unit->p_description);
+    printf("Activation: %s\n", (p_unit->activation == UNIT_ACTIVATION_TARGET) ? "target" : "sequential");
     for (size_t i = 0; i < p_unit->services.size; ++i)
     {
         printf(" - Service '%s'\n", p_unit->services.elem[i].p_name);
@@ -114,60 +605,244 @@ static void unit_print(unit_t *p_unit)
     }
 }
 
+// Icon paths in unit files are relative to the cartridge DB unless absolute
+static bool icon_path(const unit_t *p_unit, char *p_path, const size_t size)
+{
+    if (!p_unit->p_icon)
+        return false;
+    if (p_unit->p_icon[0] == '/')
+        (void)snprintf(p_path, size, "%s", p_unit->p_icon);
+    else
+        (void)snprintf(p_path, size, "%s/%s", p_config->cartdb_path, p_unit->p_icon);
+    return true;
+}
+
+// Walks all unit files of the DB once, so the first insertion does not pay for work that can be done up front
+static void cartdb_prepare(void)
+{
+    char pattern[sizeof(p_config->cartdb_path) + 16] = {0};
+    char path[512] = {0};
+    glob_t result;
+    unit_t *p_unit = NULL;
+
+    (void)snprintf(pattern, sizeof(pattern), "%s/*.cart", p_config->cartdb_path);
+    if (glob(pattern, 0, NULL, &result) != 0)
+        return;
+    for (size_t i = 0; i < result.gl_pathc; ++i)
+    {
+        if (unit_parse(&p_unit, result.gl_pathv[i]) != UNIT_PARSE_OKAY)
+            continue;
+        // Decode every icon now, so an insertion only ships already scaled pixels
+        if (p_config->notification_enabled && icon_path(p_unit, path, sizeof(path)))
+            notify_prepare_icon(path);
+        // Let systemd load the services in the background
+        if (p_config->prewarm_enabled)
+            unit_prewarm(p_unit);
+        // Compile overlays now, so an insertion only writes cached blobs
+        unit_prepare_overlays(p_unit);
+        unit_destroy(p_unit);
+    }
+    globfree(&result);
+}
+
 static void notify_plugin(unit_t *p_unit)
 {
     char msg[255] = {0};
+    char path[512] = {0};
 
-    if (!config.notification_enabled)
+    if (!p_config->notification_enabled)
         return;
 
     sprintf(msg, "Inserted '%s' cartridge", p_unit->p_unit_name);
-    notify_send_to_all("DevTerm Cartridge", msg, NULL);
+    notify_sched_post("DevTerm Cartridge", msg, icon_path(p_unit, path, sizeof(path)) ? path : NULL);
+}
+
+static void notify_unplug(unit_t *p_unit)
+{
+    char msg[255] = {0};
+    char path[512] = {0};
+
+    if (!p_config->notification_enabled)
+        return;
+
+    (void)snprintf(msg, sizeof(msg), "Removed '%s' cartridge", p_unit->p_unit_name);
+    notify_sched_post("DevTerm Cartridge", msg, icon_path(p_unit, path, sizeof(path)) ? path : NULL);
+}
+
+static void notify_service_failed(unit_t *p_unit, unit_service_t *p_serv)
+{
+    char msg[255] = {0};
+    char path[512] = {0};
+
+    if (!p_config->notification_enabled || !p_config->failure_notification_enabled)
+        return;
+
+    (void)snprintf(msg, sizeof(msg), "Service '%s' of the '%s' cartridge failed.", p_serv->p_name,
+                   p_unit->p_unit_name);
+    notify_sched_post("DevTerm Cartridge", msg, icon_path(p_unit, path, sizeof(path)) ? path : NULL);
 }
 
-static void notify_notfound(unsigned int number)
+static void notify_notfound(const char *const p_id)
 {
     char msg[255] = {0};
 
-    if (!config.notification_enabled)
+    if (!p_config->notification_enabled)
         return;
 
     sprintf(msg,
-            "Could not find description for cartridge no. '%X'.\n"
+            "Could not find description for cartridge no. '%s'.\n"
             "Try to reseat cartridge if software is installed.",
-            number);
-    notify_send_to_all("DevTerm Cartridge", msg, NULL);
+            p_id);
+    notify_sched_post("DevTerm Cartridge", msg, NULL);
+}
+
+static void status_update(void)
+{
+    char health[128] = {0};
+
+    if (!p_unit_active)
+        return;
+    unit_health_summary(p_unit_active, health, sizeof(health));
+    sd_notifyf(0, "STATUS=Cartridge '%s' active, %s", p_unit_active->p_unit_name, health);
+}
+
+static void cart_service_health(unit_t *p_unit, unit_service_t *p_serv, const bool failed)
+{
+    if (failed)
+    {
+        LOG_WRN("Service '%s' of cartridge '%s' failed (%s)", p_serv->p_sdunit, p_unit->p_unit_name,
+                p_serv->sub_state);
+        notify_service_failed(p_unit, p_serv);
+    }
+    if (p_unit == p_unit_active)
+        status_update();
+}
+
+static void cart_unit_release(const bool stop)
+{
+    if (!p_unit_active)
+        return;
+    // Services going down from here on are expected, stop tracking them first
+    unit_health_unwatch(p_unit_active);
+    if (stop)
+    {
+        notify_unplug(p_unit_active);
+        unit_deactive(p_unit_active, p_config->stop_timeout_ms);
+        state_clear(STATE_FILE);
+    }
+    unit_destroy(p_unit_active);
+    p_unit_active = NULL;
 }
 
-static void cart_unit_load(const char *const p_unit_path)
+static void cart_unit_load(const char *const p_unit_path, const detection_cartid_t cart_id)
 {
     unit_t *p_unit = NULL;
     unit_parse_result_t unit_parse_rc = UNIT_PARSE_ERR;
+    int rc = 0;
 
+    // An insertion without a removal before, e.g. after a bouncing contact: the old unit must not leak
+    if (p_unit_active)
+    {
+        LOG_WRN("Cartridge '%s' still active, stopping it first", p_unit_active->p_unit_name);
+        cart_unit_release(true);
+    }
     LOG_INF("Loading unit file '%s'", p_unit_path);
     unit_parse_rc = unit_parse(&p_unit, p_unit_path);
     if (unit_parse_rc == UNIT_PARSE_OKAY)
     {
+        if (p_unit->activation == UNIT_ACTIVATION_DEFAULT)
+            p_unit->activation = p_config->activation;
         unit_print(p_unit);
 
         p_unit_active = p_unit;
 
         notify_plugin(p_unit_active);
+        // Watch before starting, so no transition is missed
+        unit_health_watch(p_unit_active, cart_service_health, NULL);
         unit_activate(p_unit_active);
+        status_update();
+        rc = state_save(STATE_FILE, cart_id, p_unit_path, p_unit_active);
+        if (rc != 0)
+            LOG_WRN("Could not save state to '%s' (error '%s')", STATE_FILE, strerror(-rc));
     }
     else
     {
-        p_unit_active = NULL;
+        sd_notifyf(0, "STATUS=Cartridge unit '%s' failed to parse", p_unit_path);
+    }
+}
+
+static void cart_state_drop(void)
+{
+    if (!p_unit_restored)
+        return;
+    LOG_INF("Cartridge '%s' is gone, stopping the services it left running", p_unit_restored->p_unit_name);
+    unit_deactive(p_unit_restored, p_config->stop_timeout_ms);
+    unit_destroy(p_unit_restored);
+    p_unit_restored = NULL;
+    state_clear(STATE_FILE);
+}
+
+// Picks up the cartridge a previous run left active. If the slot is empty now, its services are stopped right
+// away, otherwise the first ID read decides in cart_state_adopt().
+static void cart_state_restore(void)
+{
+    if (state_load(STATE_FILE, &s_restored_id, s_restored_path, sizeof(s_restored_path), &p_unit_restored) != 0)
+        return;
+    LOG_INF("Found cartridge '%s' from a previous run", p_unit_restored->p_unit_name);
+    // What it started is not known, so stopping it covers everything
+    unit_assume_active(p_unit_restored);
+    if (!detection_present())
+        cart_state_drop();
+}
+
+// Runs once the states of the adopted cartridge's services are known. Only issues jobs for what went down while the
+// daemon was away.
+static void cart_state_resume(unit_t *p_unit)
+{
+    if (p_unit != p_unit_active)
+        return;
+    if (!unit_health_all_active(p_unit))
+        unit_resume(p_unit);
+    status_update();
+}
+
+static bool cart_state_adopt(const detection_cartid_t cart_id)
+{
+    if (!p_unit_restored)
+        return false;
+    if ((cart_id.value != s_restored_id.value) || (cart_id.len != s_restored_id.len))
+    {
+        cart_state_drop();
+        return false;
+    }
+    LOG_INF("Taking over running cartridge '%s' from '%s'", p_unit_restored->p_unit_name, s_restored_path);
+    p_unit_active = p_unit_restored;
+    p_unit_restored = NULL;
+    status_update();
+    unit_health_watch(p_unit_active, cart_service_health, cart_state_resume);
+    return true;
+}
+
+static void shutdown_daemon(void)
+{
+    sd_notify(0, "STOPPING=1");
+    notify_sched_deinit();
+    // Let the detection thread finish its iteration before its GPIO lines go away
+    if (eventfd_write(s_detection_stop_fd, 1) == 0)
+    {
+        pthread_join(s_detection_thread, NULL);
+        detection_deinit();
     }
+    s_event = sd_event_unref(s_event);
 }
 
 int main()
 {
+    int rc = 0;
     setup();
     LOG_INF("%s", "ExtCart daemon started.");
     /*debug();*/
-    while (1)
-    {
-        loop();
-    }
+    rc = sd_event_loop(s_event);
+    shutdown_daemon();
+    return (rc < 0) ? EXIT_FAILURE : EXIT_SUCCESS;
 }
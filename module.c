@@ -0,0 +1,101 @@
+#include "module.h"
+
+#include <errno.h>
+#include <libkmod.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "log.h"
+
+static struct kmod_ctx *s_kmod = NULL;
+
+int module_init(const char *const p_root)
+{
+    int rc = 0;
+
+    module_deinit();
+    s_kmod = kmod_new((p_root && (p_root[0] != '\0')) ? p_root : NULL, NULL);
+    if (!s_kmod)
+    {
+        LOG_ERR("Could not create kmod context for '%s'", p_root ? p_root : "");
+        return -ENOMEM;
+    }
+    // Keeps modules.dep and the alias indexes mapped, so an insertion does not parse them again
+    rc = kmod_load_resources(s_kmod);
+    if (rc < 0)
+        LOG_WRN("Could not load module index of '%s' (error '%s')", kmod_get_dirname(s_kmod), strerror(-rc));
+    return 0;
+}
+
+void module_deinit(void)
+{
+    if (s_kmod)
+        kmod_unref(s_kmod);
+    s_kmod = NULL;
+}
+
+int module_load(const char *const p_name, const char *const p_options, bool *p_inserted)
+{
+    struct kmod_list *p_list = NULL;
+    struct kmod_list *p_it = NULL;
+    int rc = s_kmod ? kmod_module_new_from_lookup(s_kmod, p_name, &p_list) : -ENODEV;
+    bool present = false;
+
+    *p_inserted = false;
+    if ((rc == 0) && !p_list)
+        rc = -ENOENT;
+    kmod_list_foreach(p_it, p_list)
+    {
+        struct kmod_module *p_mod = kmod_module_get_module(p_it);
+        const int state = kmod_module_get_initstate(p_mod);
+
+        // Loaded before the cartridge came, it stays when the cartridge goes
+        present = (state == KMOD_MODULE_LIVE) || (state == KMOD_MODULE_COMING) || (state == KMOD_MODULE_BUILTIN);
+        rc = present ? 0 : kmod_module_probe_insert_module(p_mod, 0, p_options, NULL, NULL, NULL);
+        kmod_module_unref(p_mod);
+        if (rc == 0)
+            break;
+    }
+    kmod_module_unref_list(p_list);
+    if (rc != 0)
+        LOG_ERR("Could not load module '%s' (error '%s')", p_name, strerror((rc < 0) ? -rc : EINVAL));
+    else if (present)
+        LOG_INF("Module '%s' is loaded already, leaving it to whoever loaded it", p_name);
+    else
+        LOG_INF("Loaded module '%s'", p_name);
+    *p_inserted = (rc == 0) && !present;
+    return rc;
+}
+
+int module_unload(const char *const p_name)
+{
+    struct kmod_list *p_list = NULL;
+    struct kmod_list *p_it = NULL;
+    int rc = s_kmod ? kmod_module_new_from_lookup(s_kmod, p_name, &p_list) : -ENODEV;
+
+    kmod_list_foreach(p_it, p_list)
+    {
+        struct kmod_module *p_mod = kmod_module_get_module(p_it);
+        struct kmod_list *p_holders = NULL;
+        const int state = kmod_module_get_initstate(p_mod);
+
+        // Built-in and unloaded modules have nothing to remove, used ones are left for their users
+        if ((state == KMOD_MODULE_LIVE) && (kmod_module_get_refcnt(p_mod) == 0) &&
+            !(p_holders = kmod_module_get_holders(p_mod)))
+        {
+            rc = kmod_module_remove_module(p_mod, 0);
+            if (rc == 0)
+                LOG_INF("Unloaded module '%s'", kmod_module_get_name(p_mod));
+            else
+                LOG_WRN("Could not unload module '%s' (error '%s')", kmod_module_get_name(p_mod), strerror(-rc));
+        }
+        else if (state == KMOD_MODULE_LIVE)
+        {
+            LOG_INF("Module '%s' is still in use, keeping it", kmod_module_get_name(p_mod));
+        }
+        kmod_module_unref_list(p_holders);
+        kmod_module_unref(p_mod);
+    }
+    kmod_module_unref_list(p_list);
+    return rc;
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <stdbool.h>
+
+// Loads the module index of the given tree once and keeps it resident, NULL or empty for the running kernel's
+int module_init(const char *const p_root);
+void module_deinit(void);
+// Inserts the module or alias and its dependencies, a module that is already loaded is left alone. *p_inserted tells
+// whether this call inserted it, only then is it the caller's to unload.
+int module_load(const char *const p_name, const char *const p_options, bool *p_inserted);
+// Unloads the module unless something still uses it. Dependencies inserted along with it stay loaded, they may be
+// shared with other modules and take no resources of the cartridge.
+int module_unload(const char *const p_name);
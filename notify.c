@@ -1,22 +1,66 @@
-#include "notify.h"
+#include "notify_module.h"
+#include "notify_icon.h"
 
 #include <errno.h>
 #include <libnotify/notify.h>
 #include <pwd.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <systemd/sd-event.h>
+#include <sys/epoll.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
 #include <utmp.h>
 
+#include "log.h"
+
+#define NOTIFY_MAX_USERS (16)
+#define NOTIFY_MAX_PENDING (NOTIFY_MAX_USERS)
+// A child that has not exited by then is killed
+#define NOTIFY_CHILD_TIMEOUT_US (5U * 1000000U)
+// Between checks whether a child that reported back has exited
+#define NOTIFY_REAP_INTERVAL_US (50U * 1000U)
+
+// Id of the last popup shown to a user, a new one replaces it instead of stacking up
+typedef struct
+{
+    int uid;
+    unsigned id;
+} notify_user_t;
+
+static notify_user_t s_users[NOTIFY_MAX_USERS];
+static size_t s_user_cnt = 0;
+
+// Child showing a popup, the event loop reads the id once the child wrote it and reaps the child
+typedef struct
+{
+    sd_event_source *p_source; // id pipe, NULL once read
+    sd_event_source *p_timer;  // deadline and reap checks, NULL if the slot is free
+    pid_t child;
+    int fd;
+    uint64_t deadline;
+    bool killed;
+    unsigned *p_id;
+} notify_pending_t;
+
+static notify_pending_t s_pending[NOTIFY_MAX_PENDING];
+static sd_event *s_event = NULL;
+
+static int notify_send_to_all(const char *const p_title, const char *const p_text, const char *const p_iconpath);
 static bool get_user_id(char const *const p_name, int *p_uid, int *p_gid);
+static unsigned *notify_user_id(const int uid);
 
-static int notify_as(int uid, int gid, const char *const p_title, const char *const p_text,
-                     const char *const p_iconpath);
+static int notify_as(int uid, int gid, const char *const p_title, const char *const p_text, GVariant *p_image,
+                     unsigned *p_id);
 
-int notify_send_to_all(const char *const p_title, const char *const p_text, const char *const p_iconpath)
+const notify_module_t cartridged_notify_module = {
+    .abi = NOTIFY_MODULE_ABI, .send_to_all = notify_send_to_all, .prepare_icon = notify_icon_prepare};
+
+static int notify_send_to_all(const char *const p_title, const char *const p_text, const char *const p_iconpath)
 {
     // Holds a list of users notified to not send to the same user twice
     char userlist[255] = {0};
@@ -26,6 +70,7 @@ int notify_send_to_all(const char *const p_title, const char *const p_text, cons
     int uid = 0;
     int gid = 0;
     int rc = 0;
+    GVariant *p_image = notify_icon_get(p_iconpath);
     setutent();
     data = getutent();
     while (data != NULL)
@@ -41,7 +86,7 @@ int notify_send_to_all(const char *const p_title, const char *const p_text, cons
         if (strstr(userlist, userlookup) == NULL)
         {
             get_user_id(aux, &uid, &gid);
-            rc |= notify_as(uid, gid, p_title, p_text, p_iconpath);
+            rc |= notify_as(uid, gid, p_title, p_text, p_image, notify_user_id(uid));
 
             strcat(userlist, "^");
             strcat(userlist, aux);
@@ -50,6 +95,8 @@ int notify_send_to_all(const char *const p_title, const char *const p_text, cons
         data = getutent();
     }
 
+    if (p_image)
+        g_variant_unref(p_image);
     return rc;
 }
 
@@ -69,16 +116,164 @@ static bool get_user_id(char const *const p_name, int *p_uid, int *p_gid)
     return rc;
 }
 
-static int notify_as(int uid, int gid, const char *const p_title, const char *const p_text,
-                     const char *const p_iconpath)
+static unsigned *notify_user_id(const int uid)
+{
+    for (size_t i = 0; i < s_user_cnt; ++i)
+    {
+        if (s_users[i].uid == uid)
+            return &s_users[i].id;
+    }
+    if (s_user_cnt >= NOTIFY_MAX_USERS)
+        return NULL;
+    s_users[s_user_cnt] = (notify_user_t){.uid = uid, .id = 0};
+    return &s_users[s_user_cnt++].id;
+}
+
+// Frees the slot, the child was reaped or is left to init
+static void notify_release(notify_pending_t *p_pending)
+{
+    p_pending->p_source = sd_event_source_disable_unref(p_pending->p_source);
+    p_pending->p_timer = sd_event_source_disable_unref(p_pending->p_timer);
+    if (p_pending->fd >= 0)
+        close(p_pending->fd);
+    p_pending->fd = -1;
+}
+
+// Reaps the child if it exited and checks again shortly otherwise, the event loop never waits for a child
+static void notify_reap(notify_pending_t *p_pending)
+{
+    uint64_t now = 0;
+    uint64_t next = 0;
+    int status = 0;
+
+    if (waitpid(p_pending->child, &status, WNOHANG) != 0)
+    {
+        notify_release(p_pending);
+        return;
+    }
+    (void)sd_event_now(s_event, CLOCK_MONOTONIC, &now);
+    next = now + NOTIFY_REAP_INTERVAL_US;
+    if (!p_pending->killed && (next > p_pending->deadline))
+        next = p_pending->deadline;
+    (void)sd_event_source_set_time(p_pending->p_timer, next);
+    (void)sd_event_source_set_enabled(p_pending->p_timer, SD_EVENT_ONESHOT);
+}
+
+static int notify_id_ready(sd_event_source *p_source, int fd, uint32_t revents, void *p_userdata)
+{
+    notify_pending_t *p_pending = p_userdata;
+    gint id = 0;
+    (void)p_source;
+    (void)revents;
+
+    // Readable means the id was written or the child closed the pipe, neither blocks
+    if (read(fd, &id, sizeof(id)) == sizeof(id))
+    {
+        if (p_pending->p_id)
+            *p_pending->p_id = (unsigned)id;
+    }
+    else
+    {
+        LOG_WRN("Notification of child %d was not shown", (int)p_pending->child);
+    }
+    p_pending->p_source = sd_event_source_disable_unref(p_pending->p_source);
+    close(p_pending->fd);
+    p_pending->fd = -1;
+    notify_reap(p_pending);
+    return 0;
+}
+
+static int notify_child_timer(sd_event_source *p_source, uint64_t usec, void *p_userdata)
+{
+    notify_pending_t *p_pending = p_userdata;
+    (void)p_source;
+
+    // A child stuck on the session bus or in GLib would hold its slot forever
+    if (!p_pending->killed && (usec >= p_pending->deadline))
+    {
+        LOG_WRN("Notification child %d did not finish in time, killing it", (int)p_pending->child);
+        (void)kill(p_pending->child, SIGKILL);
+        p_pending->killed = true;
+    }
+    notify_reap(p_pending);
+    return 0;
+}
+
+// Takes a free slot and has the event loop watch the pipe and the deadline of the child about to be forked, so the
+// daemon does not wait for the notification server. NULL if no slot is free.
+static notify_pending_t *notify_pending_new(const int fd, unsigned *p_id)
+{
+    notify_pending_t *p_pending = NULL;
+    uint64_t now = 0;
+
+    if (!s_event && (sd_event_default(&s_event) < 0))
+    {
+        s_event = NULL;
+        return NULL;
+    }
+    for (size_t i = 0; (i < NOTIFY_MAX_PENDING) && !p_pending; ++i)
+    {
+        if (!s_pending[i].p_timer)
+            p_pending = &s_pending[i];
+    }
+    if (!p_pending)
+        return NULL;
+    *p_pending = (notify_pending_t){.p_source = NULL, .p_timer = NULL, .child = -1, .fd = -1, .p_id = p_id};
+    (void)sd_event_now(s_event, CLOCK_MONOTONIC, &now);
+    p_pending->deadline = now + NOTIFY_CHILD_TIMEOUT_US;
+    if ((sd_event_add_time(s_event, &p_pending->p_timer, CLOCK_MONOTONIC, p_pending->deadline, 0, notify_child_timer,
+                           p_pending) < 0) ||
+        (sd_event_add_io(s_event, &p_pending->p_source, fd, EPOLLIN, notify_id_ready, p_pending) < 0))
+    {
+        notify_release(p_pending);
+        return NULL;
+    }
+    p_pending->fd = fd;
+    return p_pending;
+}
+
+// Children still out when the module is unloaded are killed, their sources must not outlive the code. The daemon
+// is exiting then, a child not reaped right away is left to init.
+__attribute__((destructor)) static void notify_deinit(void)
 {
-    int rc = 0;
     int status = 0;
+
+    for (size_t i = 0; i < NOTIFY_MAX_PENDING; ++i)
+    {
+        if (!s_pending[i].p_timer)
+            continue;
+        (void)kill(s_pending[i].child, SIGKILL);
+        (void)waitpid(s_pending[i].child, &status, WNOHANG);
+        notify_release(&s_pending[i]);
+    }
+    s_event = sd_event_unref(s_event);
+}
+
+static int notify_as(int uid, int gid, const char *const p_title, const char *const p_text, GVariant *p_image,
+                     unsigned *p_id)
+{
+    int rc = 0;
     char buf[255] = {0};
+    int fds[2] = {-1, -1};
+    gint id = 0;
+    notify_pending_t *p_pending = NULL;
+
+    // The child reports the id the server assigned back through this pipe
+    if (pipe(fds) != 0)
+        return -1;
+    p_pending = notify_pending_new(fds[0], p_id);
+    if (!p_pending)
+    {
+        LOG_WRN("Too many notifications outstanding, not notifying user %d", uid);
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
     int child = fork();
 
     if (child == 0)
     {
+        close(fds[0]);
         setgid(gid);
         setuid(uid);
 
@@ -87,21 +282,32 @@ static int notify_as(int uid, int gid, const char *const p_title, const char *co
         putenv(buf);
 
         notify_init("DevTerm Cartridge Daemon");
-        NotifyNotification *n = notify_notification_new(p_title, p_text, p_iconpath);
+        NotifyNotification *n = notify_notification_new(p_title, p_text, NULL);
+        // Ship the pre-rendered pixels, the notification server does not need to load anything
+        if (p_image)
+            notify_notification_set_hint(n, "image-data", p_image);
         notify_notification_set_timeout(n, 10000); // 10 seconds
-        if (!notify_notification_show(n, 0))
+        if (p_id && (*p_id != 0))
+            g_object_set(G_OBJECT(n), "id", (gint)*p_id, NULL);
+        if (notify_notification_show(n, 0))
         {
-            rc = -1;
+            g_object_get(G_OBJECT(n), "id", &id, NULL);
+            if (write(fds[1], &id, sizeof(id)) != sizeof(id))
+                _exit(1);
         }
-        exit(0);
+        // Not exit(), the atexit handlers and stdio buffers belong to the daemon
+        _exit(0);
     }
     else if (child > 0)
     {
-        waitpid(child, &status, WEXITED);
+        close(fds[1]);
+        p_pending->child = child;
         putenv("DBUS_SESSION_BUS_ADDRESS=unix:path=/run/user/0/bus");
     }
     else
     {
+        notify_release(p_pending);
+        close(fds[1]);
         rc = -1;
     }
 
@@ -1,3 +1,7 @@
 #pragma once
 
+#include <stdbool.h>
+
+int notify_enable(const bool enable);
 int notify_send_to_all(const char *const p_title, const char *const p_text, const char *const p_iconpath);
+int notify_prepare_icon(const char *const p_iconpath);
@@ -0,0 +1,179 @@
+#include "notify_icon.h"
+
+#include <gdk-pixbuf/gdk-pixbuf.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "log.h"
+
+#ifndef NOTIFY_ICON_CACHE_DIR
+#define NOTIFY_ICON_CACHE_DIR "/var/cache/cartridged/icons"
+#endif
+#define NOTIFY_ICON_SIZE (48)
+#define NOTIFY_ICON_MAX (64)
+#define NOTIFY_ICON_MAGIC (0x31434943U) // "CIC1"
+
+// Header of a cache file, followed by height * rowstride bytes of pixel data
+typedef struct
+{
+    uint32_t magic;
+    int32_t width;
+    int32_t height;
+    int32_t rowstride;
+    int32_t has_alpha;
+    int32_t bits_per_sample;
+    int32_t channels;
+} notify_icon_header_t;
+
+typedef struct
+{
+    char path[256];
+    GVariant *p_image;
+} notify_icon_t;
+
+// Icons ready to be sent, in the notification spec's image-data format. Only touched from the main thread.
+static notify_icon_t s_icons[NOTIFY_ICON_MAX] = {0};
+static size_t s_icon_cnt = 0;
+
+static GVariant *icon_variant(const notify_icon_header_t *p_hdr, const guchar *p_data)
+{
+    GVariant *p_pixels = g_variant_new_fixed_array(G_VARIANT_TYPE_BYTE, p_data,
+                                                   (gsize)p_hdr->height * p_hdr->rowstride, sizeof(guchar));
+    return g_variant_ref_sink(g_variant_new("(iiibii@ay)", p_hdr->width, p_hdr->height, p_hdr->rowstride,
+                                            p_hdr->has_alpha, p_hdr->bits_per_sample, p_hdr->channels, p_pixels));
+}
+
+static GVariant *icon_cache_load(const char *const p_cachepath)
+{
+    gchar *p_contents = NULL;
+    gsize len = 0;
+    GVariant *p_image = NULL;
+    notify_icon_header_t hdr;
+
+    if (!g_file_get_contents(p_cachepath, &p_contents, &len, NULL))
+        return NULL;
+    if (len >= sizeof(hdr))
+    {
+        memcpy(&hdr, p_contents, sizeof(hdr));
+        if ((hdr.magic == NOTIFY_ICON_MAGIC) && (len == sizeof(hdr) + (gsize)hdr.height * hdr.rowstride))
+            p_image = icon_variant(&hdr, (const guchar *)p_contents + sizeof(hdr));
+    }
+    g_free(p_contents);
+    return p_image;
+}
+
+static GVariant *icon_decode(const char *const p_iconpath, const char *const p_cachepath)
+{
+    GError *p_err = NULL;
+    GVariant *p_image = NULL;
+    GdkPixbuf *p_pixbuf = gdk_pixbuf_new_from_file_at_scale(p_iconpath, NOTIFY_ICON_SIZE, NOTIFY_ICON_SIZE, TRUE, &p_err);
+
+    if (!p_pixbuf)
+    {
+        LOG_ERR("Could not decode icon '%s': %s", p_iconpath, p_err->message);
+        g_error_free(p_err);
+        return NULL;
+    }
+
+    const notify_icon_header_t hdr = {
+        .magic = NOTIFY_ICON_MAGIC,
+        .width = gdk_pixbuf_get_width(p_pixbuf),
+        .height = gdk_pixbuf_get_height(p_pixbuf),
+        .rowstride = gdk_pixbuf_get_rowstride(p_pixbuf),
+        .has_alpha = gdk_pixbuf_get_has_alpha(p_pixbuf),
+        .bits_per_sample = gdk_pixbuf_get_bits_per_sample(p_pixbuf),
+        .channels = gdk_pixbuf_get_n_channels(p_pixbuf),
+    };
+    // The last row of a pixbuf may be shorter than rowstride, pad it so the cache file has a fixed layout
+    const gsize data_len = (gsize)hdr.height * hdr.rowstride;
+    guchar *p_buf = g_malloc0(sizeof(hdr) + data_len);
+    memcpy(p_buf, &hdr, sizeof(hdr));
+    memcpy(p_buf + sizeof(hdr), gdk_pixbuf_read_pixels(p_pixbuf), gdk_pixbuf_get_byte_length(p_pixbuf));
+    g_object_unref(p_pixbuf);
+
+    if ((g_mkdir_with_parents(NOTIFY_ICON_CACHE_DIR, 0755) != 0) ||
+        !g_file_set_contents(p_cachepath, (const gchar *)p_buf, sizeof(hdr) + data_len, &p_err))
+    {
+        LOG_WRN("Could not cache icon '%s' at '%s'", p_iconpath, p_cachepath);
+        if (p_err)
+            g_error_free(p_err);
+    }
+    p_image = icon_variant(&hdr, p_buf + sizeof(hdr));
+    g_free(p_buf);
+    return p_image;
+}
+
+static notify_icon_t *icon_slot(const char *const p_iconpath)
+{
+    for (size_t i = 0; i < s_icon_cnt; ++i)
+    {
+        if (strcmp(s_icons[i].path, p_iconpath) == 0)
+            return &s_icons[i];
+    }
+    if ((s_icon_cnt >= NOTIFY_ICON_MAX) || (strlen(p_iconpath) >= sizeof(s_icons[0].path)))
+        return NULL;
+    strcpy(s_icons[s_icon_cnt].path, p_iconpath);
+    return &s_icons[s_icon_cnt++];
+}
+
+int notify_icon_prepare(const char *const p_iconpath)
+{
+    char cachepath[sizeof(NOTIFY_ICON_CACHE_DIR) + 80] = {0};
+    gchar *p_contents = NULL;
+    gchar *p_hash = NULL;
+    gsize len = 0;
+    GVariant *p_image = NULL;
+    notify_icon_t *p_slot = icon_slot(p_iconpath);
+
+    if (!p_slot)
+    {
+        LOG_WRN("No room to cache icon '%s'", p_iconpath);
+        return -1;
+    }
+    if (!g_file_get_contents(p_iconpath, &p_contents, &len, NULL))
+    {
+        LOG_WRN("Could not read icon '%s'", p_iconpath);
+        return -1;
+    }
+    // Keyed by content, so a changed icon gets a new entry and identical icons share one
+    p_hash = g_compute_checksum_for_data(G_CHECKSUM_SHA256, (const guchar *)p_contents, len);
+    g_free(p_contents);
+    (void)snprintf(cachepath, sizeof(cachepath), "%s/%s.raw", NOTIFY_ICON_CACHE_DIR, p_hash);
+    g_free(p_hash);
+
+    p_image = icon_cache_load(cachepath);
+    if (!p_image)
+        p_image = icon_decode(p_iconpath, cachepath);
+    if (!p_image)
+        return -1;
+
+    if (p_slot->p_image)
+        g_variant_unref(p_slot->p_image);
+    p_slot->p_image = p_image;
+    return 0;
+}
+
+GVariant *notify_icon_get(const char *const p_iconpath)
+{
+    if (!p_iconpath)
+        return NULL;
+    for (size_t i = 0; i < s_icon_cnt; ++i)
+    {
+        if ((strcmp(s_icons[i].path, p_iconpath) == 0) && s_icons[i].p_image)
+            return g_variant_ref(s_icons[i].p_image);
+    }
+    // Not prepared with the cartridge DB, e.g. unreadable then, the notification goes without it
+    return NULL;
+}
+
+__attribute__((destructor)) static void notify_icon_deinit(void)
+{
+    for (size_t i = 0; i < s_icon_cnt; ++i)
+    {
+        if (s_icons[i].p_image)
+            g_variant_unref(s_icons[i].p_image);
+        s_icons[i].p_image = NULL;
+    }
+    s_icon_cnt = 0;
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+#include <glib.h>
+
+int notify_icon_prepare(const char *const p_iconpath);
+// Returns a reference released with g_variant_unref(), or NULL for an icon not prepared. Sending never decodes,
+// the process forks right after and must not have other threads in GLib at that point.
+GVariant *notify_icon_get(const char *const p_iconpath);
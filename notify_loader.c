@@ -0,0 +1,65 @@
+#include "notify.h"
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <stddef.h>
+
+#include "log.h"
+#include "notify_module.h"
+
+#ifndef NOTIFY_MODULE_PATH
+#define NOTIFY_MODULE_PATH "/usr/local/lib/cartridged/cartridged-notify.so"
+#endif
+
+static void *s_handle = NULL;
+static const notify_module_t *s_module = NULL;
+
+// libnotify and its GLib/gdk-pixbuf dependencies are only mapped while notifications are enabled
+int notify_enable(const bool enable)
+{
+    if (!enable)
+    {
+        if (s_handle)
+        {
+            LOG_INF("%s", "Unloading notification module");
+            s_module = NULL;
+            dlclose(s_handle);
+            s_handle = NULL;
+        }
+        return 0;
+    }
+    if (s_handle)
+        return 0;
+
+    s_handle = dlopen(NOTIFY_MODULE_PATH, RTLD_NOW | RTLD_LOCAL);
+    if (!s_handle)
+    {
+        LOG_ERR("Could not load notification module: %s", dlerror());
+        return -ENOENT;
+    }
+    s_module = dlsym(s_handle, NOTIFY_MODULE_SYMBOL);
+    if (!s_module || (s_module->abi != NOTIFY_MODULE_ABI))
+    {
+        LOG_ERR("Notification module '%s' is incompatible", NOTIFY_MODULE_PATH);
+        s_module = NULL;
+        dlclose(s_handle);
+        s_handle = NULL;
+        return -EINVAL;
+    }
+    LOG_INF("Loaded notification module '%s'", NOTIFY_MODULE_PATH);
+    return 0;
+}
+
+int notify_send_to_all(const char *const p_title, const char *const p_text, const char *const p_iconpath)
+{
+    if (!s_module)
+        return -ENOENT;
+    return s_module->send_to_all(p_title, p_text, p_iconpath);
+}
+
+int notify_prepare_icon(const char *const p_iconpath)
+{
+    if (!s_module)
+        return -ENOENT;
+    return s_module->prepare_icon(p_iconpath);
+}
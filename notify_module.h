@@ -0,0 +1,13 @@
+#pragma once
+
+// Interface between the daemon and the dlopen'd notification module
+#define NOTIFY_MODULE_ABI (2)
+#define NOTIFY_MODULE_SYMBOL "cartridged_notify_module"
+
+typedef struct
+{
+    unsigned abi;
+    int (*send_to_all)(const char *const p_title, const char *const p_text, const char *const p_iconpath);
+    // Decodes and caches an icon ahead of time, so sending never decodes it
+    int (*prepare_icon)(const char *const p_iconpath);
+} notify_module_t;
@@ -0,0 +1,109 @@
+#include "notify_sched.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "log.h"
+#include "notify.h"
+
+// Timer accuracy, the default of 250 ms would be in the order of the window itself
+#define NOTIFY_SCHED_ACCURACY_US (1000U)
+
+typedef struct
+{
+    unsigned long posted;    // messages handed to the scheduler
+    unsigned long sent;      // rounds actually sent to all users
+    unsigned long coalesced; // messages replaced by a later one before they were sent
+} notify_sched_stats_t;
+
+static sd_event *s_event = NULL;
+static sd_event_source *s_timer = NULL;
+static uint64_t s_window_us = 0;
+static uint64_t s_interval_us = 0;
+static uint64_t s_first_us = 0;
+static uint64_t s_last_sent_us = 0;
+static bool s_pending = false;
+static bool s_has_icon = false;
+static char s_title[64] = {0};
+static char s_text[256] = {0};
+static char s_icon[512] = {0};
+static notify_sched_stats_t s_stats = {0};
+
+static int notify_sched_send(sd_event_source *p_source, uint64_t usec, void *p_userdata)
+{
+    (void)p_source;
+    (void)p_userdata;
+
+    if (!s_pending)
+        return 0;
+    s_pending = false;
+    s_last_sent_us = usec;
+    s_stats.sent++;
+    if (notify_send_to_all(s_title, s_text, s_has_icon ? s_icon : NULL) != 0)
+        LOG_WRN("Could not notify all users of '%s'", s_text);
+    LOG_INF("Notified '%s' (%lu sent, %lu coalesced)", s_text, s_stats.sent, s_stats.coalesced);
+    return 0;
+}
+
+int notify_sched_init(sd_event *p_event, const unsigned window_ms, const unsigned interval_ms)
+{
+    int rc = 0;
+
+    s_event = sd_event_ref(p_event);
+    notify_sched_configure(window_ms, interval_ms);
+    rc = sd_event_add_time(s_event, &s_timer, CLOCK_MONOTONIC, 0, NOTIFY_SCHED_ACCURACY_US, notify_sched_send, NULL);
+    if (rc >= 0)
+        rc = sd_event_source_set_enabled(s_timer, SD_EVENT_OFF);
+    return rc;
+}
+
+void notify_sched_configure(const unsigned window_ms, const unsigned interval_ms)
+{
+    s_window_us = (uint64_t)window_ms * 1000U;
+    s_interval_us = (uint64_t)interval_ms * 1000U;
+}
+
+void notify_sched_post(const char *const p_title, const char *const p_text, const char *const p_iconpath)
+{
+    uint64_t now = 0;
+    uint64_t due = 0;
+
+    s_stats.posted++;
+    if (!s_timer || (sd_event_now(s_event, CLOCK_MONOTONIC, &now) < 0))
+    {
+        // No event loop yet, nothing to coalesce with
+        notify_send_to_all(p_title, p_text, p_iconpath);
+        return;
+    }
+    // Only the final state of a burst is worth showing, an older pending message is simply replaced
+    if (s_pending)
+        s_stats.coalesced++;
+    else
+        s_first_us = now;
+    (void)snprintf(s_title, sizeof(s_title), "%s", p_title);
+    (void)snprintf(s_text, sizeof(s_text), "%s", p_text);
+    s_has_icon = (p_iconpath != NULL);
+    if (s_has_icon)
+        (void)snprintf(s_icon, sizeof(s_icon), "%s", p_iconpath);
+    s_pending = true;
+
+    due = s_first_us + s_window_us;
+    if ((s_stats.sent > 0) && (due < s_last_sent_us + s_interval_us))
+        due = s_last_sent_us + s_interval_us;
+    sd_event_source_set_time(s_timer, due);
+    sd_event_source_set_enabled(s_timer, SD_EVENT_ONESHOT);
+}
+
+void notify_sched_deinit(void)
+{
+    if (s_event)
+    {
+        LOG_INF("Notifications: %lu posted, %lu sent, %lu coalesced", s_stats.posted, s_stats.sent,
+                s_stats.coalesced);
+    }
+    s_timer = sd_event_source_disable_unref(s_timer);
+    s_event = sd_event_unref(s_event);
+    s_pending = false;
+}
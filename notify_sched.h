@@ -0,0 +1,10 @@
+#pragma once
+
+#include <systemd/sd-event.h>
+
+// Notifications are collected for window_ms after the first one and only the last is sent. Rounds are at least
+// interval_ms apart, so no user sees more than one popup per interval.
+int notify_sched_init(sd_event *p_event, const unsigned window_ms, const unsigned interval_ms);
+void notify_sched_configure(const unsigned window_ms, const unsigned interval_ms);
+void notify_sched_post(const char *const p_title, const char *const p_text, const char *const p_iconpath);
+void notify_sched_deinit(void);
@@ -0,0 +1,249 @@
+#include "overlay.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "log.h"
+
+#ifndef OVERLAY_CACHE_DIR
+#define OVERLAY_CACHE_DIR "/var/cache/cartridged/overlays"
+#endif
+#define OVERLAY_MAX_SIZE (1024 * 1024)
+
+static char s_root[255] = OVERLAY_DEFAULT_ROOT;
+
+static bool overlay_is_dtbo(const char *const p_source)
+{
+    const size_t len = strlen(p_source);
+    return (len > 5) && (strcmp(p_source + len - 5, ".dtbo") == 0);
+}
+
+// Reads a whole file, the caller frees the buffer
+static int overlay_read(const char *const p_path, char **pp_buf, size_t *p_len)
+{
+    struct stat st;
+    ssize_t rd = 0;
+    int rc = 0;
+    const int fd = open(p_path, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0)
+        return -errno;
+    if (fstat(fd, &st) != 0)
+        rc = -errno;
+    else if ((st.st_size <= 0) || (st.st_size > OVERLAY_MAX_SIZE))
+        rc = -EFBIG;
+    if (rc == 0)
+    {
+        *pp_buf = malloc(st.st_size);
+        if (!*pp_buf)
+            rc = -ENOMEM;
+    }
+    if (rc == 0)
+    {
+        *p_len = 0;
+        while ((*p_len < (size_t)st.st_size) && ((rd = read(fd, *pp_buf + *p_len, st.st_size - *p_len)) > 0))
+            *p_len += rd;
+        if (rd < 0)
+        {
+            rc = -errno;
+            free(*pp_buf);
+            *pp_buf = NULL;
+        }
+    }
+    close(fd);
+    return rc;
+}
+
+// The cache is keyed by the FNV-1a hash of the source, so an edited source gets a new entry
+static int overlay_cache_path(const char *const p_source, char *p_path, const size_t size)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    char *p_buf = NULL;
+    size_t len = 0;
+    const int rc = overlay_read(p_source, &p_buf, &len);
+
+    if (rc != 0)
+        return rc;
+    for (size_t i = 0; i < len; ++i)
+        hash = (hash ^ (unsigned char)p_buf[i]) * 0x100000001b3ULL;
+    free(p_buf);
+    (void)snprintf(p_path, size, "%s/%016llx.dtbo", OVERLAY_CACHE_DIR, (unsigned long long)hash);
+    return 0;
+}
+
+static int overlay_compile(const char *const p_source, const char *const p_output)
+{
+    int status = 0;
+    const pid_t pid = fork();
+
+    if (pid < 0)
+        return -errno;
+    if (pid == 0)
+    {
+        // -@ keeps the symbols the overlay references its target nodes by
+        execlp("dtc", "dtc", "-q", "-@", "-I", "dts", "-O", "dtb", "-o", p_output, p_source, (char *)NULL);
+        _exit(127);
+    }
+    while (waitpid(pid, &status, 0) < 0)
+    {
+        if (errno != EINTR)
+            return -errno;
+    }
+    return (WIFEXITED(status) && (WEXITSTATUS(status) == 0)) ? 0 : -EINVAL;
+}
+
+void overlay_set_root(const char *const p_root)
+{
+    (void)snprintf(s_root, sizeof(s_root), "%s", p_root);
+}
+
+int overlay_prepare(const char *const p_source)
+{
+    char cachepath[sizeof(OVERLAY_CACHE_DIR) + 32] = {0};
+    char tmp[sizeof(cachepath) + 8] = {0};
+    int rc = 0;
+
+    if (overlay_is_dtbo(p_source))
+        return 0;
+    rc = overlay_cache_path(p_source, cachepath, sizeof(cachepath));
+    if (rc != 0)
+    {
+        LOG_WRN("Could not read overlay '%s' (error '%s')", p_source, strerror(-rc));
+        return rc;
+    }
+    if (access(cachepath, R_OK) == 0)
+        return 0;
+
+    (void)mkdir("/var/cache/cartridged", 0755);
+    if ((mkdir(OVERLAY_CACHE_DIR, 0755) != 0) && (errno != EEXIST))
+    {
+        rc = -errno;
+        LOG_WRN("Could not create overlay cache '%s' (error '%s')", OVERLAY_CACHE_DIR, strerror(errno));
+        return rc;
+    }
+    // Compiled next to the cache entry and moved in place, so a cache entry is never partial
+    (void)snprintf(tmp, sizeof(tmp), "%s.tmp", cachepath);
+    rc = overlay_compile(p_source, tmp);
+    if ((rc == 0) && (rename(tmp, cachepath) != 0))
+        rc = -errno;
+    if (rc != 0)
+    {
+        unlink(tmp);
+        LOG_ERR("Could not compile overlay '%s' (error '%s')", p_source, strerror(-rc));
+        return rc;
+    }
+    LOG_INF("Compiled overlay '%s' to '%s'", p_source, cachepath);
+    return 0;
+}
+
+static void overlay_dir(const char *const p_name, char *p_dir, const size_t size)
+{
+    const int prefix = snprintf(p_dir, size, "%s/cartridged-", s_root);
+    int len = prefix + snprintf(p_dir + prefix, size - prefix, "%s", p_name);
+    if ((len < 0) || ((size_t)len >= size))
+        len = size - 1;
+    // The name becomes a single directory entry
+    for (int i = prefix; i < len; ++i)
+    {
+        if ((p_dir[i] == '/') || (p_dir[i] == ' '))
+            p_dir[i] = '_';
+    }
+}
+
+int overlay_apply(const char *const p_name, const char *const p_source)
+{
+    char cachepath[sizeof(OVERLAY_CACHE_DIR) + 32] = {0};
+    char dir[sizeof(s_root) + 128] = {0};
+    char path[sizeof(dir) + 16] = {0};
+    char status[32] = {0};
+    char *p_blob = NULL;
+    size_t len = 0;
+    int fd = -1;
+    int rc = 0;
+
+    // Only blobs that were compiled ahead of time are applied, dtc is far too slow for an insertion
+    if (overlay_is_dtbo(p_source))
+        (void)snprintf(cachepath, sizeof(cachepath), "%s", p_source);
+    else
+        rc = overlay_cache_path(p_source, cachepath, sizeof(cachepath));
+    if (rc == 0)
+        rc = overlay_read(cachepath, &p_blob, &len);
+    if (rc != 0)
+    {
+        LOG_ERR("Overlay '%s' is not compiled, reload the daemon after changing '%s' (error '%s')", p_name, p_source,
+                strerror(-rc));
+        return rc;
+    }
+
+    overlay_dir(p_name, dir, sizeof(dir));
+    if (mkdir(dir, 0755) != 0)
+    {
+        rc = -errno;
+        free(p_blob);
+        // Overlays survive a daemon restart, the active cartridge's are still in place
+        if (rc == -EEXIST)
+        {
+            LOG_INF("Overlay '%s' is already applied", p_name);
+            return 0;
+        }
+        LOG_ERR("Could not create overlay '%s' (error '%s')", dir, strerror(-rc));
+        return rc;
+    }
+
+    (void)snprintf(path, sizeof(path), "%s/dtbo", dir);
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        rc = -errno;
+    else if (write(fd, p_blob, len) != (ssize_t)len)
+        rc = -EIO;
+    if ((fd >= 0) && (close(fd) != 0) && (rc == 0))
+        rc = -errno;
+    free(p_blob);
+
+    // The kernel reports the outcome in status, a stand-in for configfs has none
+    (void)snprintf(path, sizeof(path), "%s/status", dir);
+    fd = (rc == 0) ? open(path, O_RDONLY | O_CLOEXEC) : -1;
+    if (fd >= 0)
+    {
+        const ssize_t rd = read(fd, status, sizeof(status) - 1);
+        close(fd);
+        if ((rd > 0) && (strncmp(status, "applied", sizeof("applied") - 1) != 0))
+            rc = -EINVAL;
+    }
+
+    if (rc != 0)
+    {
+        LOG_ERR("Could not apply overlay '%s' from '%s' (error '%s')", p_name, cachepath, strerror(-rc));
+        (void)overlay_remove(p_name);
+        return rc;
+    }
+    LOG_INF("Applied overlay '%s'", p_name);
+    return 0;
+}
+
+int overlay_remove(const char *const p_name)
+{
+    char dir[sizeof(s_root) + 128] = {0};
+    char path[sizeof(dir) + 16] = {0};
+
+    overlay_dir(p_name, dir, sizeof(dir));
+    // configfs refuses this, a stand-in directory keeps the blob as a plain file
+    (void)snprintf(path, sizeof(path), "%s/dtbo", dir);
+    (void)unlink(path);
+    if ((rmdir(dir) != 0) && (errno != ENOENT))
+    {
+        const int rc = -errno;
+        LOG_ERR("Could not remove overlay '%s' (error '%s')", dir, strerror(errno));
+        return rc;
+    }
+    LOG_INF("Removed overlay '%s'", p_name);
+    return 0;
+}
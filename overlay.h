@@ -0,0 +1,13 @@
+#pragma once
+
+#include <stddef.h>
+
+#define OVERLAY_DEFAULT_ROOT "/sys/kernel/config/device-tree/overlays"
+
+// Directory overlays are applied in, a plain directory stands in for configfs when testing
+void overlay_set_root(const char *const p_root);
+// Compiles a .dts source into the cache unless it is already there, never done during an insertion
+int overlay_prepare(const char *const p_source);
+// Applies the precompiled overlay under the given name, a name that is already applied is left alone
+int overlay_apply(const char *const p_name, const char *const p_source);
+int overlay_remove(const char *const p_name);
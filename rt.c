@@ -0,0 +1,75 @@
+#define _GNU_SOURCE
+
+#include "rt.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "log.h"
+
+// Amount of stack touched up front so the read path never faults in new stack pages
+#define RT_STACK_PREFAULT (64 * 1024)
+
+static void stack_prefault(void)
+{
+    volatile unsigned char dummy[RT_STACK_PREFAULT];
+    memset((unsigned char *)dummy, 0, sizeof(dummy));
+}
+
+int rt_memory_lock(void)
+{
+    // Lock everything mapped now and later (including thread stacks) into RAM
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+    {
+        LOG_ERR("Could not lock memory (error '%s')", strerror(errno));
+        return -errno;
+    }
+    return 0;
+}
+
+int rt_thread_create(pthread_t *p_thread, void *(*p_fun)(void *), void *p_arg)
+{
+    pthread_attr_t attr;
+    int rc = pthread_attr_init(&attr);
+
+    if (rc != 0)
+        return rc;
+    rc = pthread_attr_setstacksize(&attr, RT_THREAD_STACK_SIZE);
+    if (rc == 0)
+        rc = pthread_create(p_thread, &attr, p_fun, p_arg);
+    pthread_attr_destroy(&attr);
+    return rc;
+}
+
+int rt_thread_setup(const rt_config_t *const p_cfg)
+{
+    int rc = 0;
+    struct sched_param param = {.sched_priority = p_cfg->priority};
+
+    if (p_cfg->cpu >= 0)
+    {
+        cpu_set_t cpuset;
+        CPU_ZERO(&cpuset);
+        CPU_SET(p_cfg->cpu, &cpuset);
+        rc = pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+        if (rc != 0)
+        {
+            LOG_ERR("Could not pin thread to cpu %d (error '%s')", p_cfg->cpu, strerror(rc));
+            return -rc;
+        }
+    }
+
+    rc = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    if (rc != 0)
+    {
+        LOG_ERR("Could not set SCHED_FIFO priority %d (error '%s')", p_cfg->priority, strerror(rc));
+        return -rc;
+    }
+
+    stack_prefault();
+    LOG_INF("Real-time mode active (SCHED_FIFO prio=%d, cpu=%d)", p_cfg->priority, p_cfg->cpu);
+    return 0;
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+
+// Stack of every thread the daemon starts. With mlockall() all of it is resident, so it is kept small.
+#define RT_THREAD_STACK_SIZE (256 * 1024)
+
+typedef struct
+{
+    int priority; // SCHED_FIFO priority (1..99)
+    int cpu;      // CPU to pin the thread to, -1 for no pinning
+} rt_config_t;
+
+int rt_memory_lock(void);
+int rt_thread_setup(const rt_config_t *const p_cfg);
+// pthread_create() with a stack of RT_THREAD_STACK_SIZE instead of the 8 MB default
+int rt_thread_create(pthread_t *p_thread, void *(*p_fun)(void *), void *p_arg);
@@ -0,0 +1,96 @@
+#include "state.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ini.h"
+#include "log.h"
+
+// The state file is a cartridge unit file with an extra [State] section, unit_parse() skips that section
+// and restores the unit exactly as it was started.
+int state_save(const char *const p_path, const detection_cartid_t id, const char *const p_unit_path,
+               const unit_t *p_unit)
+{
+    char tmp[512] = {0};
+    FILE *p_file = NULL;
+    int rc = 0;
+
+    (void)snprintf(tmp, sizeof(tmp), "%s.tmp", p_path);
+    p_file = fopen(tmp, "w");
+    if (!p_file)
+        return -errno;
+    fprintf(p_file, "[State]\nId=%llX\nLength=%u\nPath=%s\n\n", (unsigned long long)id.value, id.len, p_unit_path);
+    rc = unit_write(p_unit, p_file);
+    if ((fflush(p_file) != 0) || ferror(p_file))
+        rc = -EIO;
+    fclose(p_file);
+    // Readers see either the old or the new file, never a partial one
+    if ((rc == 0) && (rename(tmp, p_path) != 0))
+        rc = -errno;
+    if (rc != 0)
+        unlink(tmp);
+    return rc;
+}
+
+int state_load(const char *const p_path, detection_cartid_t *p_id, char *p_unit_path, const size_t size,
+               unit_t **pp_unit)
+{
+    char buf[24] = {0};
+    ini_t ini;
+    ini_token_t token = INI_TOKEN_END;
+    bool in_state = false;
+    bool have_id = false;
+    int rc = ini_open(&ini, p_path);
+
+    if (rc != 0)
+        return rc;
+    p_unit_path[0] = '\0';
+    *p_id = (detection_cartid_t){.value = 0, .len = 0};
+    while ((token = ini_next(&ini)) != INI_TOKEN_END)
+    {
+        if (token == INI_TOKEN_ERROR)
+        {
+            rc = -EINVAL;
+            break;
+        }
+        if (token == INI_TOKEN_SECTION)
+        {
+            in_state = ini_span_eq(ini.section, "State");
+            continue;
+        }
+        if (!in_state)
+            continue;
+        ini_span_copy(ini.value, buf, sizeof(buf));
+        if (ini_span_eq(ini.key, "Id"))
+        {
+            p_id->value = strtoull(buf, NULL, 16);
+            have_id = true;
+        }
+        else if (ini_span_eq(ini.key, "Length"))
+        {
+            p_id->len = (uint8_t)atoi(buf);
+        }
+        else if (ini_span_eq(ini.key, "Path"))
+        {
+            ini_span_copy(ini.value, p_unit_path, size);
+        }
+    }
+    ini_close(&ini);
+    if ((rc == 0) && (!have_id || (p_unit_path[0] == '\0')))
+        rc = -EINVAL;
+    if ((rc == 0) && (unit_parse(pp_unit, p_path) != UNIT_PARSE_OKAY))
+        rc = -EINVAL;
+    if (rc != 0)
+        LOG_WRN("Ignoring invalid state file '%s'", p_path);
+    return rc;
+}
+
+void state_clear(const char *const p_path)
+{
+    if ((unlink(p_path) != 0) && (errno != ENOENT))
+        LOG_WRN("Could not remove state file '%s' (error '%s')", p_path, strerror(errno));
+}
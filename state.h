@@ -0,0 +1,13 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "detection.h"
+#include "unit.h"
+
+// Persisted state of the active cartridge, so a restarted daemon can take over its running services
+int state_save(const char *const p_path, const detection_cartid_t id, const char *const p_unit_path,
+               const unit_t *p_unit);
+int state_load(const char *const p_path, detection_cartid_t *p_id, char *p_unit_path, const size_t size,
+               unit_t **pp_unit);
+void state_clear(const char *const p_path);
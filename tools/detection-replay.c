@@ -0,0 +1,235 @@
+// Feeds GPIO captures taken with gpio_capture back through the detection state machine, without any hardware.
+// Every pin access and clock read is answered from the capture, so a replay takes the same path through the state
+// machine the daemon took. Replays run as fast as possible by default, or with the captured timing.
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../detection.h"
+#include "../detection_capture.h"
+#include "../log.h"
+
+static const char *const s_pin_names[] = {"route_en", "clock", "data"};
+
+static detection_capture_t s_capture;
+static const char *p_capture_name = NULL;
+static bool s_realtime = false;
+static bool s_done = false;
+static bool s_diverged = false;
+static unsigned long s_records = 0;
+static unsigned long s_events = 0;
+static uint64_t s_capture_us = 0;
+static uint64_t s_replay_start_us = 0;
+static uint32_t s_last_time = 0;
+static int s_last_level[3] = {1, 1, 1};
+
+static uint64_t time_real_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000U + ts.tv_nsec / 1000U;
+}
+
+static const char *pin_name(const unsigned pin)
+{
+    return (pin < sizeof(s_pin_names) / sizeof(s_pin_names[0])) ? s_pin_names[pin] : "unknown";
+}
+
+static const char *kind_name(const unsigned kind)
+{
+    switch (kind)
+    {
+    case DETECTION_CAPTURE_TIME:
+        return "clock read";
+    case DETECTION_CAPTURE_GET:
+        return "get";
+    case DETECTION_CAPTURE_SET:
+        return "set";
+    default:
+        return "unknown";
+    }
+}
+
+// Fetches the record the state machine is expected to ask for next, NULL once the replay is over
+static const detection_capture_rec_t *replay_next(const detection_capture_kind_t kind, const unsigned pin)
+{
+    static detection_capture_rec_t rec;
+    uint32_t time_us = 0;
+
+    if (s_done)
+        return NULL;
+    if (!detection_capture_read(&s_capture, &rec, &time_us))
+    {
+        s_done = true;
+        return NULL;
+    }
+    if (s_records > 0)
+        s_capture_us += rec.delta_us;
+    s_records++;
+    s_last_time = time_us;
+    if ((rec.kind != kind) || ((kind != DETECTION_CAPTURE_TIME) && (rec.pin != pin)))
+    {
+        fprintf(stdout, "%s: diverged at record %lu, %s %s instead of the captured %s %s\n", p_capture_name,
+                s_records, kind_name(kind), pin_name(pin), kind_name(rec.kind), pin_name(rec.pin));
+        s_diverged = true;
+        s_done = true;
+        return NULL;
+    }
+    if (s_realtime)
+    {
+        const uint64_t due = s_replay_start_us + s_capture_us;
+        const uint64_t now = time_real_us();
+        if (due > now)
+            usleep(due - now);
+    }
+    return &rec;
+}
+
+static int replay_pin_get(const unsigned pin)
+{
+    const detection_capture_rec_t *p_rec = replay_next(DETECTION_CAPTURE_GET, pin);
+    if (pin >= sizeof(s_last_level) / sizeof(s_last_level[0]))
+        return 1;
+    // Once the capture ends the lines stay where they were, so no event is made up before the loop stops
+    if (p_rec)
+        s_last_level[pin] = p_rec->value;
+    return s_last_level[pin];
+}
+
+static void replay_pin_set(const unsigned pin, const int val)
+{
+    const detection_capture_rec_t *p_rec = replay_next(DETECTION_CAPTURE_SET, pin);
+    if (p_rec && (p_rec->value != (unsigned)val))
+    {
+        fprintf(stdout, "%s: diverged at record %lu, set %s=%d instead of the captured %u\n", p_capture_name,
+                s_records, pin_name(pin), val, p_rec->value);
+        s_diverged = true;
+        s_done = true;
+    }
+}
+
+static unsigned replay_time_now_us(void)
+{
+    replay_next(DETECTION_CAPTURE_TIME, 0);
+    return s_last_time;
+}
+
+static void replay_event(const detection_event_t event, const detection_cartid_t cart_id)
+{
+    char id[32];
+    s_events++;
+    fprintf(stdout, "%s: %s %s (%u bytes) at %llu us\n", p_capture_name,
+            (event == DETECTION_EVENT_INSERTED) ? "inserted" : "removed",
+            detection_cartid_str(cart_id, id, sizeof(id)), cart_id.len, (unsigned long long)s_capture_us);
+}
+
+static const detection_io_t s_replay_io = {
+    .pin_get = replay_pin_get, .pin_set = replay_pin_set, .time_now_us = replay_time_now_us};
+
+static const detection_config_t s_replay_cfg = {.pin_route_en = {0, 0},
+                                                .pin_clock = {0, 0},
+                                                .pin_data = {0, 0},
+                                                .p_event_listener = replay_event,
+                                                .p_capture_path = NULL,
+                                                .p_io = &s_replay_io};
+
+// Replays one run of the daemon, returns false if it did not go the way it was recorded
+static bool replay_run(const char *const p_path, const unsigned run)
+{
+    uint64_t elapsed = 0;
+
+    fprintf(stdout, "%s: run %u, captured at %llu\n", p_path, run, (unsigned long long)s_capture.run_started);
+    s_done = false;
+    s_diverged = false;
+    s_records = 0;
+    s_events = 0;
+    s_capture_us = 0;
+    for (size_t i = 0; i < sizeof(s_last_level) / sizeof(s_last_level[0]); ++i)
+        s_last_level[i] = 1;
+    s_replay_start_us = time_real_us();
+    (void)detection_init(&s_replay_cfg);
+    while (!s_done)
+        (void)detection_handle();
+    detection_deinit();
+
+    elapsed = time_real_us() - s_replay_start_us;
+    fprintf(stdout, "%s: %lu records, %lu events, %llu us captured, replayed in %llu us\n", p_path, s_records,
+            s_events, (unsigned long long)s_capture_us, (unsigned long long)elapsed);
+    return !s_diverged;
+}
+
+// A diverged run leaves the rest of its records unread, the next run is still replayed from its start
+static void replay_skip(void)
+{
+    detection_capture_rec_t rec;
+    uint32_t time_us = 0;
+
+    while (detection_capture_read(&s_capture, &rec, &time_us))
+        ;
+}
+
+// Returns 0 if every run of the capture replayed the way it was recorded
+static int replay(const char *const p_path)
+{
+    unsigned run = 0;
+    bool diverged = false;
+    int rc = detection_capture_open(&s_capture, p_path);
+
+    if (rc != 0)
+    {
+        LOG_ERR("Could not open capture '%s' (error '%s')", p_path, strerror(-rc));
+        return rc;
+    }
+    p_capture_name = p_path;
+    do
+    {
+        diverged |= !replay_run(p_path, ++run);
+        replay_skip();
+    } while (detection_capture_next(&s_capture));
+    detection_capture_close(&s_capture);
+    return diverged ? -EPROTO : 0;
+}
+
+static void usage(const char *const p_prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-r] capture...\n"
+            "  -r  replay with the captured timing instead of as fast as possible\n",
+            p_prog);
+}
+
+int main(int argc, char *argv[])
+{
+    int failed = 0;
+    int opt = 0;
+
+    while ((opt = getopt(argc, argv, "rh")) != -1)
+    {
+        switch (opt)
+        {
+        case 'r':
+            s_realtime = true;
+            break;
+        default:
+            usage(argv[0]);
+            return (opt == 'h') ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if (optind >= argc)
+    {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    for (int i = optind; i < argc; ++i)
+    {
+        if (replay(argv[i]) != 0)
+            failed++;
+    }
+    return (failed > 0) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
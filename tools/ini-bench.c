@@ -0,0 +1,320 @@
+// Measures the INI tokenizer and the two parsers built on it, and fuzzes them with mutations of a seed corpus.
+// The benchmark parses every file repeatedly and prints the throughput of the tokenizer alone, of unit_parse() for
+// .cart files and of config_load() for .ini files. Fuzzing writes deterministic mutations of the seeds to a scratch
+// file and runs all three on each, build with -fsanitize=address,undefined to have memory errors caught as well.
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../config.h"
+#include "../ini.h"
+#include "../unit.h"
+
+#define BENCH_MAX_SEEDS (64)
+#define BENCH_MAX_SIZE (64 * 1024)
+#define FUZZ_MAX_MUTATIONS (8)
+
+typedef struct
+{
+    const char *p_path;
+    char *p_data;
+    size_t size;
+    bool unit; // .cart, parsed by unit_parse(), config_load() otherwise
+} bench_seed_t;
+
+static bench_seed_t s_seeds[BENCH_MAX_SEEDS];
+static size_t s_seed_cnt = 0;
+static unsigned long s_diagnostics = 0;
+static uint64_t s_rng = 1;
+
+// The parsers log through these, diagnostics are only counted so they do not dominate the measurement
+void log_fatal(const char *fmt, ...)
+{
+    va_list argp;
+    va_start(argp, fmt);
+    vfprintf(stderr, fmt, argp);
+    va_end(argp);
+    fputc('\n', stderr);
+    exit(2);
+}
+
+void log_error(const char *fmt, ...)
+{
+    (void)fmt;
+    s_diagnostics++;
+}
+
+void log_warning(const char *fmt, ...)
+{
+    (void)fmt;
+    s_diagnostics++;
+}
+
+void log_info(const char *fmt, ...)
+{
+    (void)fmt;
+}
+
+static uint64_t time_now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000U + ts.tv_nsec / 1000U;
+}
+
+// xorshift64, the same seed gives the same mutations on every machine
+static uint32_t rng_next(const uint32_t range)
+{
+    s_rng ^= s_rng << 13;
+    s_rng ^= s_rng >> 7;
+    s_rng ^= s_rng << 17;
+    return (range > 0) ? (uint32_t)(s_rng % range) : 0;
+}
+
+static bool seed_load(const char *const p_path)
+{
+    FILE *p_file = NULL;
+    bench_seed_t *p_seed = NULL;
+    const char *p_ext = strrchr(p_path, '.');
+
+    if (s_seed_cnt >= BENCH_MAX_SEEDS)
+        return false;
+    p_file = fopen(p_path, "rb");
+    if (!p_file)
+    {
+        fprintf(stderr, "Could not open '%s': %s\n", p_path, strerror(errno));
+        return false;
+    }
+    p_seed = &s_seeds[s_seed_cnt];
+    p_seed->p_data = malloc(BENCH_MAX_SIZE);
+    p_seed->size = p_seed->p_data ? fread(p_seed->p_data, 1, BENCH_MAX_SIZE, p_file) : 0;
+    p_seed->p_path = p_path;
+    p_seed->unit = p_ext && (strcmp(p_ext, ".cart") == 0);
+    fclose(p_file);
+    if (!p_seed->p_data)
+        return false;
+    s_seed_cnt++;
+    return true;
+}
+
+// Walks all tokens and checks the spans stay within the file, returns the number of tokens or -1
+static long tokenize(const char *const p_path)
+{
+    ini_t ini;
+    ini_token_t token = INI_TOKEN_END;
+    long tokens = 0;
+
+    if (ini_open(&ini, p_path) != 0)
+        return -1;
+    while ((token = ini_next(&ini)) <= INI_TOKEN_KEY)
+    {
+        const ini_span_t spans[] = {ini.section, ini.key, ini.value};
+        for (size_t i = 0; i < sizeof(spans) / sizeof(spans[0]); ++i)
+        {
+            if (spans[i].p && ((spans[i].p < ini.p_data) || (spans[i].p + spans[i].len > ini.p_data + ini.size)))
+            {
+                fprintf(stderr, "'%s': span out of the file in line %u\n", p_path, ini.line);
+                abort();
+            }
+        }
+        // Every token ends a line, more tokens than bytes means the tokenizer does not advance
+        if ((size_t)++tokens > ini.size + 1)
+        {
+            fprintf(stderr, "'%s': tokenizer does not advance in line %u\n", p_path, ini.line);
+            abort();
+        }
+    }
+    ini_close(&ini);
+    return tokens;
+}
+
+static int parse(const bench_seed_t *p_seed, const char *const p_path)
+{
+    if (p_seed->unit)
+    {
+        unit_t *p_unit = NULL;
+        const unit_parse_result_t rc = unit_parse(&p_unit, p_path);
+        unit_destroy(p_unit);
+        return rc;
+    }
+    config_t config;
+    return config_load(p_path, &config);
+}
+
+static void bench(const unsigned iterations)
+{
+    for (size_t i = 0; i < s_seed_cnt; ++i)
+    {
+        const bench_seed_t *p_seed = &s_seeds[i];
+        const uint64_t start = time_now_us();
+        long tokens = 0;
+
+        for (unsigned n = 0; n < iterations; ++n)
+            tokens = tokenize(p_seed->p_path);
+        const uint64_t tokenized = time_now_us();
+        for (unsigned n = 0; n < iterations; ++n)
+            (void)parse(p_seed, p_seed->p_path);
+        const uint64_t parsed = time_now_us();
+
+        const double tok_s = (tokenized > start) ? (tokenized - start) / 1e6 : 1e-6;
+        const double parse_s = (parsed > tokenized) ? (parsed - tokenized) / 1e6 : 1e-6;
+        fprintf(stdout, "%s: %zu bytes, %ld tokens\n", p_seed->p_path, p_seed->size, tokens);
+        fprintf(stdout, "  tokenizer: %.0f files/s, %.1f MB/s\n", iterations / tok_s,
+                (double)p_seed->size * iterations / tok_s / 1e6);
+        fprintf(stdout, "  %s: %.0f files/s, %.1f MB/s\n", p_seed->unit ? "unit_parse" : "config_load",
+                iterations / parse_s, (double)p_seed->size * iterations / parse_s / 1e6);
+    }
+}
+
+// One mutation of the kinds that break line based formats: bit flips, syntax characters, inserted, removed and
+// repeated ranges, and truncation
+static void mutate(char *p_buf, size_t *p_size)
+{
+    static const char s_special[] = "[]=#;:-/\n\r\t \0";
+    const size_t size = *p_size;
+    const size_t pos = rng_next(size + 1);
+    const size_t len = 1 + rng_next(32);
+
+    switch (rng_next(6))
+    {
+    case 0:
+        if (pos < size)
+            p_buf[pos] ^= (char)(1U << rng_next(8));
+        break;
+    case 1:
+        if (pos < size)
+            p_buf[pos] = s_special[rng_next(sizeof(s_special))];
+        break;
+    case 2:
+        if (size + len <= BENCH_MAX_SIZE)
+        {
+            memmove(p_buf + pos + len, p_buf + pos, size - pos);
+            for (size_t i = 0; i < len; ++i)
+                p_buf[pos + i] = (char)rng_next(256);
+            *p_size += len;
+        }
+        break;
+    case 3:
+        if (pos + len <= size)
+        {
+            memmove(p_buf + pos, p_buf + pos + len, size - pos - len);
+            *p_size -= len;
+        }
+        break;
+    case 4:
+    {
+        const size_t from = rng_next(size + 1);
+        if ((from + len <= size) && (size + len <= BENCH_MAX_SIZE))
+        {
+            memmove(p_buf + pos + len, p_buf + pos, size - pos);
+            memmove(p_buf + pos, p_buf + from + ((from >= pos) ? len : 0), len);
+            *p_size += len;
+        }
+        break;
+    }
+    default:
+        *p_size = pos;
+        break;
+    }
+}
+
+static int fuzz(const unsigned cases)
+{
+    char path[] = "/tmp/ini-bench-XXXXXX";
+    char *p_buf = malloc(BENCH_MAX_SIZE);
+    unsigned long results[UNIT_PARSE_BAD_MATCH + 2] = {0};
+    const int fd = mkstemp(path);
+
+    if ((fd < 0) || !p_buf)
+    {
+        fprintf(stderr, "Could not set up the scratch file: %s\n", strerror(errno));
+        free(p_buf);
+        return -1;
+    }
+    for (size_t i = 0; i < s_seed_cnt; ++i)
+    {
+        const bench_seed_t *p_seed = &s_seeds[i];
+        for (unsigned n = 0; n < cases; ++n)
+        {
+            size_t size = p_seed->size;
+            const unsigned mutations = 1 + rng_next(FUZZ_MAX_MUTATIONS);
+
+            memcpy(p_buf, p_seed->p_data, size);
+            for (unsigned m = 0; m < mutations; ++m)
+                mutate(p_buf, &size);
+            if ((ftruncate(fd, 0) != 0) || (pwrite(fd, p_buf, size, 0) != (ssize_t)size))
+            {
+                fprintf(stderr, "Could not write the scratch file: %s\n", strerror(errno));
+                break;
+            }
+            (void)tokenize(path);
+            const int rc = parse(p_seed, path);
+            results[(rc >= 0) && (rc <= UNIT_PARSE_BAD_MATCH) ? rc : UNIT_PARSE_BAD_MATCH + 1]++;
+        }
+        fprintf(stdout, "%s: %u mutations survived\n", p_seed->p_path, cases);
+    }
+    fprintf(stdout, "Results: %lu parsed, %lu rejected, %lu diagnostics\n", results[0],
+            cases * (unsigned long)s_seed_cnt - results[0], s_diagnostics);
+    close(fd);
+    unlink(path);
+    free(p_buf);
+    return 0;
+}
+
+static void usage(const char *const p_prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-n iterations] [-f cases] [-s seed] file...\n"
+            "  -n  parse every file this many times and print the throughput (default 10000)\n"
+            "  -f  fuzz instead, with this many mutations of every file\n"
+            "  -s  seed of the mutations, runs are reproducible by default\n",
+            p_prog);
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned iterations = 10000;
+    unsigned cases = 0;
+    int opt = 0;
+
+    while ((opt = getopt(argc, argv, "n:f:s:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            iterations = (unsigned)strtoul(optarg, NULL, 10);
+            break;
+        case 'f':
+            cases = (unsigned)strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            s_rng = strtoull(optarg, NULL, 10) | 1U;
+            break;
+        default:
+            usage(argv[0]);
+            return (opt == 'h') ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if (optind >= argc)
+    {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    for (int i = optind; i < argc; ++i)
+    {
+        if (!seed_load(argv[i]))
+            return EXIT_FAILURE;
+    }
+
+    if (cases > 0)
+        return (fuzz(cases) == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+    bench(iterations);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,341 @@
+// Soak test of the insert/remove path: runs cartridge insertions and removals through the daemon's own cart_event()
+// against tools/systemd-standin.elf and tracks resident memory, heap use and the time each cycle takes. main.c is
+// compiled into this file, so every cycle takes the path the daemon takes, only the GPIO lines are replaced by the
+// events of a replayed capture or by fixed IDs. Fails if memory grew after the warmup cycles.
+
+#include <malloc.h>
+
+#include "../detection_capture.h"
+
+// Keeps the soak away from the state of a daemon running on the same machine
+#define STATE_FILE "/tmp/cartridged-soak.state"
+#define main cartridged_main
+#include "../main.c"
+#undef main
+
+#define SOAK_MAX_EVENTS (256)
+#define SOAK_SETTLE_TIMEOUT_US (30U * 1000000U)
+
+typedef struct
+{
+    unsigned long cycles;
+    uint64_t sum_us;
+    uint64_t min_us;
+    uint64_t max_us;
+} soak_latency_t;
+
+static cart_event_msg_t s_events[SOAK_MAX_EVENTS];
+static size_t s_event_cnt = 0;
+static detection_capture_t s_capture;
+static bool s_capture_done = false;
+static uint32_t s_capture_time = 0;
+static int s_capture_level[3] = {1, 1, 1};
+
+// Answers the state machine from the capture, the replay ends with the run or where the state machine takes
+// another path than the one captured
+static const detection_capture_rec_t *capture_next(const detection_capture_kind_t kind, const unsigned pin)
+{
+    static detection_capture_rec_t rec;
+
+    if (s_capture_done)
+        return NULL;
+    if (!detection_capture_read(&s_capture, &rec, &s_capture_time) || (rec.kind != kind) ||
+        ((kind != DETECTION_CAPTURE_TIME) && (rec.pin != pin)))
+    {
+        s_capture_done = true;
+        return NULL;
+    }
+    return &rec;
+}
+
+static int capture_pin_get(const unsigned pin)
+{
+    const detection_capture_rec_t *p_rec = capture_next(DETECTION_CAPTURE_GET, pin);
+    if (pin >= sizeof(s_capture_level) / sizeof(s_capture_level[0]))
+        return 1;
+    if (p_rec)
+        s_capture_level[pin] = p_rec->value;
+    return s_capture_level[pin];
+}
+
+static void capture_pin_set(const unsigned pin, const int val)
+{
+    (void)val;
+    (void)capture_next(DETECTION_CAPTURE_SET, pin);
+}
+
+static unsigned capture_time_now_us(void)
+{
+    (void)capture_next(DETECTION_CAPTURE_TIME, 0);
+    return s_capture_time;
+}
+
+static void soak_event_add(const detection_event_t event, const detection_cartid_t cart_id)
+{
+    if (s_event_cnt < SOAK_MAX_EVENTS)
+        s_events[s_event_cnt++] = (cart_event_msg_t){.event = event, .cart_id = cart_id};
+}
+
+static const detection_io_t s_capture_io = {
+    .pin_get = capture_pin_get, .pin_set = capture_pin_set, .time_now_us = capture_time_now_us};
+
+static const detection_config_t s_capture_cfg = {.pin_route_en = {0, 0},
+                                                 .pin_clock = {0, 0},
+                                                 .pin_data = {0, 0},
+                                                 .p_event_listener = soak_event_add,
+                                                 .p_capture_path = NULL,
+                                                 .p_io = &s_capture_io};
+
+// Replays every run of the capture once and keeps the insertions and removals it produced
+static int capture_load(const char *const p_path)
+{
+    detection_capture_rec_t rec;
+    uint32_t time_us = 0;
+    const int rc = detection_capture_open(&s_capture, p_path);
+
+    if (rc != 0)
+    {
+        LOG_ERR("Could not open capture '%s' (error '%s')", p_path, strerror(-rc));
+        return rc;
+    }
+    do
+    {
+        s_capture_done = false;
+        for (size_t i = 0; i < sizeof(s_capture_level) / sizeof(s_capture_level[0]); ++i)
+            s_capture_level[i] = 1;
+        (void)detection_init(&s_capture_cfg);
+        while (!s_capture_done)
+            (void)detection_handle();
+        detection_deinit();
+        // A run left early is skipped to its end, the next one is replayed from its start
+        while (detection_capture_read(&s_capture, &rec, &time_us))
+            ;
+    } while (detection_capture_next(&s_capture));
+    detection_capture_close(&s_capture);
+    return 0;
+}
+
+// Accepts hex IDs as printed by the daemon, with the number of bytes read after a colon if it is not the minimum
+static bool soak_id_add(const char *const p_arg)
+{
+    char *p_end = NULL;
+    detection_cartid_t id = {.value = strtoull(p_arg, &p_end, 16), .len = 1};
+
+    while ((id.len < 8) && (id.value >> (8U * id.len)))
+        id.len++;
+    if (*p_end == ':')
+        id.len = (uint8_t)strtoul(p_end + 1, &p_end, 10);
+    if ((p_end == p_arg) || (*p_end != '\0') || (id.len > 8))
+        return false;
+    soak_event_add(DETECTION_EVENT_INSERTED, id);
+    soak_event_add(DETECTION_EVENT_REMOVED, id);
+    return true;
+}
+
+// Runs the event loop until the activation is through and nothing else is pending, false if it does not finish
+static bool soak_settle(void)
+{
+    const uint64_t until = time_now_us() + SOAK_SETTLE_TIMEOUT_US;
+    int rc = 0;
+
+    while (p_unit_active && p_unit_active->p_job)
+    {
+        if (time_now_us() >= until)
+            return false;
+        rc = sd_event_run(s_event, 100000);
+        if (rc < 0)
+            return false;
+    }
+    // Replies and signals that arrived meanwhile, e.g. the state changes unit_health watches
+    while ((rc = sd_event_run(s_event, 0)) > 0)
+        ;
+    return rc >= 0;
+}
+
+// Bytes allocated from the main arena, including chunks served by mmap
+static size_t heap_used(void)
+{
+    const struct mallinfo2 info = mallinfo2();
+    return info.uordblks + info.hblkhd;
+}
+
+static void latency_add(soak_latency_t *p_lat, const uint64_t took_us)
+{
+    if ((p_lat->cycles == 0) || (took_us < p_lat->min_us))
+        p_lat->min_us = took_us;
+    if (took_us > p_lat->max_us)
+        p_lat->max_us = took_us;
+    p_lat->sum_us += took_us;
+    p_lat->cycles++;
+}
+
+static void soak_report(const unsigned long cycle, soak_latency_t *p_lat)
+{
+    fprintf(stderr, "cycle %lu: rss %ld kB, heap %zu bytes, latency min %llu avg %llu max %llu us\n", cycle,
+            rss_kb(), heap_used(), (unsigned long long)p_lat->min_us,
+            (unsigned long long)(p_lat->cycles ? p_lat->sum_us / p_lat->cycles : 0),
+            (unsigned long long)p_lat->max_us);
+    *p_lat = (soak_latency_t){0};
+}
+
+static void usage(const char *const p_prog)
+{
+    fprintf(stderr,
+            "Usage: %s -a address -d cartdb [-c capture | -i id[:bytes]...] [-n cycles] [-w warmup] [-r interval]"
+            " [-g growth_kb]\n"
+            "  -a  bus address of the systemd stand-in\n"
+            "  -d  cartridge DB the IDs are looked up in\n"
+            "  -c  replay this capture once and cycle through the insertions and removals it produced\n"
+            "  -i  insert and remove this ID instead, may be repeated\n"
+            "  -n  number of removals to run (default 1000000)\n"
+            "  -w  cycles before memory is taken as the baseline (default 1000)\n"
+            "  -r  print memory and latency every this many cycles (default 10000)\n"
+            "  -g  growth of resident memory and of the heap over the baseline that fails the soak (default 256)\n",
+            p_prog);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *p_address = NULL;
+    const char *p_cartdb = NULL;
+    const char *p_capture = NULL;
+    unsigned long cycles = 1000000;
+    unsigned long warmup = 1000;
+    unsigned long interval = 10000;
+    long growth_kb = 256;
+    long rss_base = -1;
+    size_t heap_base = 0;
+    bool removals = false;
+    bool failed = false;
+    int opt = 0;
+
+    while ((opt = getopt(argc, argv, "a:d:c:i:n:w:r:g:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 'a':
+            p_address = optarg;
+            break;
+        case 'd':
+            p_cartdb = optarg;
+            break;
+        case 'c':
+            p_capture = optarg;
+            break;
+        case 'i':
+            if (!soak_id_add(optarg))
+            {
+                fprintf(stderr, "Invalid cartridge ID '%s'\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'n':
+            cycles = strtoul(optarg, NULL, 10);
+            break;
+        case 'w':
+            warmup = strtoul(optarg, NULL, 10);
+            break;
+        case 'r':
+            interval = strtoul(optarg, NULL, 10);
+            break;
+        case 'g':
+            growth_kb = strtol(optarg, NULL, 10);
+            break;
+        default:
+            usage(argv[0]);
+            return (opt == 'h') ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if (!p_address || !p_cartdb || (!p_capture && (s_event_cnt == 0)))
+    {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (p_capture && (capture_load(p_capture) != 0))
+        return EXIT_FAILURE;
+    for (size_t i = 0; i < s_event_cnt; ++i)
+        removals |= (s_events[i].event == DETECTION_EVENT_REMOVED);
+    if (!removals)
+    {
+        fprintf(stderr, "%s\n", "No removal to cycle through, the capture holds no complete insertion");
+        return EXIT_FAILURE;
+    }
+
+    // The daemon's setup without GPIO lines, notifications and the watches of the configuration
+    p_config = calloc(1, sizeof(*p_config));
+    if (!p_config)
+        LOG_FTL("%s", "Out of memory");
+    config_defaults(p_config);
+    (void)snprintf(p_config->cartdb_path, sizeof(p_config->cartdb_path), "%s", p_cartdb);
+    (void)snprintf(p_config->bus_address, sizeof(p_config->bus_address), "%s", p_address);
+    p_config->notification_enabled = false;
+    p_config->prewarm_enabled = false;
+    if (sd_event_default(&s_event) < 0)
+        LOG_FTL("%s", "Could not create the event loop");
+    if ((bus_set_address(p_config->bus_address) != 0) || (bus_attach(s_event) != 0))
+        LOG_FTL("Could not connect to the stand-in on '%s'", p_address);
+    cartdb_reload();
+    overlay_set_root(p_config->overlay_root);
+    (void)module_init(p_config->module_root);
+    state_clear(STATE_FILE);
+
+    soak_latency_t interval_lat = {0};
+    soak_latency_t total_lat = {0};
+    uint64_t inserted_us = 0;
+    unsigned long cycle = 0;
+    size_t next = 0;
+    while (cycle < cycles)
+    {
+        const cart_event_msg_t *p_msg = &s_events[next++ % s_event_cnt];
+
+        if (p_msg->event == DETECTION_EVENT_INSERTED)
+            inserted_us = time_now_us();
+        cart_event(p_msg->event, p_msg->cart_id);
+        if (!soak_settle())
+        {
+            fprintf(stderr, "cycle %lu: activation did not finish\n", cycle + 1);
+            failed = true;
+            break;
+        }
+        if (p_msg->event != DETECTION_EVENT_REMOVED)
+            continue;
+        // Insertion to the services being stopped again, a removal without an insertion before is no cycle
+        if (inserted_us > 0)
+        {
+            const uint64_t took_us = time_now_us() - inserted_us;
+            latency_add(&interval_lat, took_us);
+            latency_add(&total_lat, took_us);
+            inserted_us = 0;
+        }
+        if (++cycle == warmup)
+        {
+            rss_base = rss_kb();
+            heap_base = heap_used();
+        }
+        if ((interval > 0) && (cycle % interval == 0))
+            soak_report(cycle, &interval_lat);
+    }
+
+    if (!failed && (rss_base >= 0))
+    {
+        const long rss_growth = rss_kb() - rss_base;
+        const long heap_growth = ((long)heap_used() - (long)heap_base) / 1024;
+
+        fprintf(stderr, "after %lu cycles: rss grew %ld kB, heap grew %ld kB\n", cycle, rss_growth, heap_growth);
+        failed = (rss_growth > growth_kb) || (heap_growth > growth_kb);
+    }
+    else if (!failed)
+    {
+        fprintf(stderr, "%s\n", "No memory check, the soak ended within the warmup");
+    }
+    fprintf(stderr, "%lu cycles, latency min %llu avg %llu max %llu us\n", total_lat.cycles,
+            (unsigned long long)total_lat.min_us,
+            (unsigned long long)(total_lat.cycles ? total_lat.sum_us / total_lat.cycles : 0),
+            (unsigned long long)total_lat.max_us);
+    fprintf(stderr, "%s\n", failed ? "FAILED" : "PASSED");
+
+    cart_unit_release(true);
+    destroy();
+    s_event = sd_event_unref(s_event);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
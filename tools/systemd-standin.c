@@ -0,0 +1,477 @@
+// Stand-in for the part of org.freedesktop.systemd1.Manager used by cartridged, so the activation path can be
+// measured and stressed without a real PID 1. It runs on a private dbus-daemon, cartridged is pointed at that bus
+// with bus_address in its configuration. Jobs finish after a configurable latency, can be made to fail, and every
+// call can be recorded with a timestamp.
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <systemd/sd-bus.h>
+#include <systemd/sd-event.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../log.h"
+
+#define SD_NAME "org.freedesktop.systemd1"
+#define SD_PATH "/org/freedesktop/systemd1"
+#define SD_PATH_UNIT "/org/freedesktop/systemd1/unit"
+#define SD_PATH_JOB "/org/freedesktop/systemd1/job"
+#define SD_INTERFACE_MANAGER "org.freedesktop.systemd1.Manager"
+#define SD_INTERFACE_UNIT "org.freedesktop.systemd1.Unit"
+#define SD_INTERFACE_JOB "org.freedesktop.systemd1.Job"
+#define STANDIN_MAX_UNITS (256)
+#define STANDIN_MAX_FAIL (16)
+
+typedef struct
+{
+    char name[256];
+    char active_state[16];
+    char sub_state[32];
+} standin_unit_t;
+
+typedef struct standin_job
+{
+    uint32_t id;
+    standin_unit_t *p_unit;
+    bool start;
+    bool fail;
+    sd_event_source *p_timer;
+    struct standin_job *p_next;
+} standin_job_t;
+
+static sd_bus *s_bus = NULL;
+static sd_event *s_event = NULL;
+static standin_unit_t s_units[STANDIN_MAX_UNITS];
+static size_t s_unit_cnt = 0;
+static uint32_t s_job_id = 0;
+// Jobs not finished yet, they can be cancelled or replaced until then
+static standin_job_t *s_jobs = NULL;
+static uint64_t s_latency_us = 0;
+static unsigned s_fail_percent = 0;
+static const char *s_fail_units[STANDIN_MAX_FAIL];
+static size_t s_fail_cnt = 0;
+static FILE *p_record = NULL;
+
+static uint64_t time_now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000U + ts.tv_nsec / 1000U;
+}
+
+static void record(const char *const p_method, const char *const p_unit)
+{
+    if (!p_record)
+        return;
+    fprintf(p_record, "%llu %s %s\n", (unsigned long long)time_now_us(), p_method, p_unit);
+    fflush(p_record);
+}
+
+static void unit_state_set(standin_unit_t *p_unit, const char *const p_active, const char *const p_sub)
+{
+    char *p_path = NULL;
+
+    snprintf(p_unit->active_state, sizeof(p_unit->active_state), "%s", p_active);
+    snprintf(p_unit->sub_state, sizeof(p_unit->sub_state), "%s", p_sub);
+    if (sd_bus_path_encode(SD_PATH_UNIT, p_unit->name, &p_path) < 0)
+        return;
+    (void)sd_bus_emit_properties_changed(s_bus, p_path, SD_INTERFACE_UNIT, "ActiveState", "SubState", NULL);
+    free(p_path);
+}
+
+// Units are created on first reference and start out inactive, as loaded but stopped units do in systemd
+static standin_unit_t *unit_get(const char *const p_name)
+{
+    for (size_t i = 0; i < s_unit_cnt; ++i)
+    {
+        if (strcmp(s_units[i].name, p_name) == 0)
+            return &s_units[i];
+    }
+    if ((s_unit_cnt >= STANDIN_MAX_UNITS) || (strlen(p_name) >= sizeof(s_units[0].name)))
+        return NULL;
+    standin_unit_t *p_unit = &s_units[s_unit_cnt++];
+    snprintf(p_unit->name, sizeof(p_unit->name), "%s", p_name);
+    snprintf(p_unit->active_state, sizeof(p_unit->active_state), "inactive");
+    snprintf(p_unit->sub_state, sizeof(p_unit->sub_state), "dead");
+    return p_unit;
+}
+
+static bool job_should_fail(const char *const p_unit)
+{
+    for (size_t i = 0; i < s_fail_cnt; ++i)
+    {
+        if (strcmp(s_fail_units[i], p_unit) == 0)
+            return true;
+    }
+    return (s_fail_percent > 0) && ((unsigned)(rand() % 100) < s_fail_percent);
+}
+
+// Takes the job off the list and sends JobRemoved with the given result
+static void job_remove(standin_job_t *p_job, const char *const p_result)
+{
+    char path[64] = {0};
+
+    for (standin_job_t **pp_it = &s_jobs; *pp_it; pp_it = &(*pp_it)->p_next)
+    {
+        if (*pp_it == p_job)
+        {
+            *pp_it = p_job->p_next;
+            break;
+        }
+    }
+    snprintf(path, sizeof(path), SD_PATH_JOB "/%u", p_job->id);
+    (void)sd_bus_emit_signal(s_bus, SD_PATH, SD_INTERFACE_MANAGER, "JobRemoved", "uoss", p_job->id, path,
+                             p_job->p_unit->name, p_result);
+    sd_event_source_disable_unref(p_job->p_timer);
+    free(p_job);
+}
+
+// As in systemd the unit stays where it was before the job, for a start that is stopped
+static void job_cancel(standin_job_t *p_job)
+{
+    if (p_job->start)
+        unit_state_set(p_job->p_unit, "inactive", "dead");
+    else
+        unit_state_set(p_job->p_unit, "active", "running");
+    job_remove(p_job, "canceled");
+}
+
+static int job_finish(sd_event_source *p_source, uint64_t usec, void *p_userdata)
+{
+    standin_job_t *p_job = p_userdata;
+    const char *p_result = "done";
+    (void)p_source;
+    (void)usec;
+
+    if (p_job->fail)
+    {
+        unit_state_set(p_job->p_unit, "failed", "failed");
+        p_result = "failed";
+    }
+    else if (p_job->start)
+    {
+        unit_state_set(p_job->p_unit, "active", "running");
+    }
+    else
+    {
+        unit_state_set(p_job->p_unit, "inactive", "dead");
+    }
+    job_remove(p_job, p_result);
+    return 0;
+}
+
+// Replies with the job path right away, the job itself completes once the configured latency passed
+static int job_queue(sd_bus_message *m, const char *const p_method, const char *const p_name, const bool start,
+                     sd_bus_error *ret_error)
+{
+    char path[64] = {0};
+    standin_job_t *p_job = NULL;
+    standin_unit_t *p_unit = unit_get(p_name);
+    int rc = 0;
+
+    record(p_method, p_name);
+    if (!p_unit)
+        return sd_bus_error_setf(ret_error, SD_BUS_ERROR_INVALID_ARGS, "Too many units");
+    // Every call is made in "replace" mode, a pending job of the unit is cancelled by the new one
+    for (standin_job_t *p_it = s_jobs; p_it; p_it = p_it->p_next)
+    {
+        if (p_it->p_unit == p_unit)
+        {
+            job_cancel(p_it);
+            break;
+        }
+    }
+    p_job = malloc(sizeof(*p_job));
+    if (!p_job)
+        return -ENOMEM;
+    *p_job = (standin_job_t){
+        .id = ++s_job_id, .p_unit = p_unit, .start = start, .fail = job_should_fail(p_name), .p_next = s_jobs};
+    rc = sd_event_add_time_relative(s_event, &p_job->p_timer, CLOCK_MONOTONIC, s_latency_us, 1, job_finish, p_job);
+    if (rc < 0)
+    {
+        free(p_job);
+        return rc;
+    }
+    s_jobs = p_job;
+    if (start)
+        unit_state_set(p_unit, "activating", "start");
+    else
+        unit_state_set(p_unit, "deactivating", "stop");
+    snprintf(path, sizeof(path), SD_PATH_JOB "/%u", p_job->id);
+    return sd_bus_reply_method_return(m, "o", path);
+}
+
+static int method_subscribe(sd_bus_message *m, void *p_userdata, sd_bus_error *ret_error)
+{
+    (void)p_userdata;
+    (void)ret_error;
+    record("Subscribe", "-");
+    return sd_bus_reply_method_return(m, "");
+}
+
+static int method_load_unit(sd_bus_message *m, void *p_userdata, sd_bus_error *ret_error)
+{
+    const char *p_name = NULL;
+    char *p_path = NULL;
+    int rc = 0;
+    (void)p_userdata;
+
+    rc = sd_bus_message_read(m, "s", &p_name);
+    if (rc < 0)
+        return rc;
+    record("LoadUnit", p_name);
+    if (!unit_get(p_name))
+        return sd_bus_error_setf(ret_error, SD_BUS_ERROR_INVALID_ARGS, "Too many units");
+    rc = sd_bus_path_encode(SD_PATH_UNIT, p_name, &p_path);
+    if (rc < 0)
+        return rc;
+    rc = sd_bus_reply_method_return(m, "o", p_path);
+    free(p_path);
+    return rc;
+}
+
+static int method_start_unit(sd_bus_message *m, void *p_userdata, sd_bus_error *ret_error)
+{
+    const char *p_name = NULL;
+    const char *p_mode = NULL;
+    const int rc = sd_bus_message_read(m, "ss", &p_name, &p_mode);
+    (void)p_userdata;
+    return (rc < 0) ? rc : job_queue(m, "StartUnit", p_name, true, ret_error);
+}
+
+static int method_stop_unit(sd_bus_message *m, void *p_userdata, sd_bus_error *ret_error)
+{
+    const char *p_name = NULL;
+    const char *p_mode = NULL;
+    const int rc = sd_bus_message_read(m, "ss", &p_name, &p_mode);
+    (void)p_userdata;
+    return (rc < 0) ? rc : job_queue(m, "StopUnit", p_name, false, ret_error);
+}
+
+// Unit.Start on the object LoadUnit returned, the daemon uses it for prewarmed units
+static int method_unit_start(sd_bus_message *m, void *p_userdata, sd_bus_error *ret_error)
+{
+    const standin_unit_t *p_unit = p_userdata;
+    const char *p_mode = NULL;
+    const int rc = sd_bus_message_read(m, "s", &p_mode);
+    return (rc < 0) ? rc : job_queue(m, "Start", p_unit->name, true, ret_error);
+}
+
+static int method_job_cancel(sd_bus_message *m, void *p_userdata, sd_bus_error *ret_error)
+{
+    standin_job_t *p_job = p_userdata;
+    (void)ret_error;
+
+    record("Cancel", p_job->p_unit->name);
+    job_cancel(p_job);
+    return sd_bus_reply_method_return(m, "");
+}
+
+static int method_start_transient_unit(sd_bus_message *m, void *p_userdata, sd_bus_error *ret_error)
+{
+    const char *p_name = NULL;
+    const char *p_mode = NULL;
+    int rc = sd_bus_message_read(m, "ss", &p_name, &p_mode);
+    (void)p_userdata;
+
+    // Properties are accepted but not interpreted, only the job timing matters here
+    if (rc >= 0)
+        rc = sd_bus_message_skip(m, "a(sv)a(sa(sv))");
+    return (rc < 0) ? rc : job_queue(m, "StartTransientUnit", p_name, true, ret_error);
+}
+
+static int method_kill_unit(sd_bus_message *m, void *p_userdata, sd_bus_error *ret_error)
+{
+    const char *p_name = NULL;
+    const char *p_whom = NULL;
+    int32_t sig = 0;
+    standin_unit_t *p_unit = NULL;
+    int rc = sd_bus_message_read(m, "ssi", &p_name, &p_whom, &sig);
+    (void)p_userdata;
+
+    if (rc < 0)
+        return rc;
+    record("KillUnit", p_name);
+    p_unit = unit_get(p_name);
+    if (!p_unit)
+        return sd_bus_error_setf(ret_error, SD_BUS_ERROR_INVALID_ARGS, "Too many units");
+    unit_state_set(p_unit, "failed", "failed");
+    return sd_bus_reply_method_return(m, "");
+}
+
+static int property_string(sd_bus *bus, const char *path, const char *interface, const char *property,
+                           sd_bus_message *reply, void *p_userdata, sd_bus_error *ret_error)
+{
+    (void)bus;
+    (void)path;
+    (void)interface;
+    (void)property;
+    (void)ret_error;
+    // Points into the unit found by unit_find(), already offset to the property
+    return sd_bus_message_append(reply, "s", (const char *)p_userdata);
+}
+
+static int unit_find(sd_bus *bus, const char *path, const char *interface, void *p_userdata, void **pp_found,
+                     sd_bus_error *ret_error)
+{
+    char *p_name = NULL;
+    int rc = 0;
+    (void)bus;
+    (void)interface;
+    (void)p_userdata;
+    (void)ret_error;
+
+    rc = sd_bus_path_decode(path, SD_PATH_UNIT, &p_name);
+    if (rc <= 0)
+        return rc;
+    // As in systemd, accessing a unit's object loads the unit
+    *pp_found = unit_get(p_name);
+    free(p_name);
+    return *pp_found ? 1 : 0;
+}
+
+// Only jobs still pending exist, as in systemd a finished job has no object anymore
+static int job_find(sd_bus *bus, const char *path, const char *interface, void *p_userdata, void **pp_found,
+                    sd_bus_error *ret_error)
+{
+    unsigned id = 0;
+    (void)bus;
+    (void)interface;
+    (void)p_userdata;
+    (void)ret_error;
+
+    if (sscanf(path, SD_PATH_JOB "/%u", &id) != 1)
+        return 0;
+    for (standin_job_t *p_it = s_jobs; p_it; p_it = p_it->p_next)
+    {
+        if (p_it->id == id)
+        {
+            *pp_found = p_it;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static const sd_bus_vtable s_manager_vtable[] = {
+    SD_BUS_VTABLE_START(0),
+    SD_BUS_METHOD("Subscribe", "", "", method_subscribe, SD_BUS_VTABLE_UNPRIVILEGED),
+    SD_BUS_METHOD("LoadUnit", "s", "o", method_load_unit, SD_BUS_VTABLE_UNPRIVILEGED),
+    SD_BUS_METHOD("StartUnit", "ss", "o", method_start_unit, SD_BUS_VTABLE_UNPRIVILEGED),
+    SD_BUS_METHOD("StopUnit", "ss", "o", method_stop_unit, SD_BUS_VTABLE_UNPRIVILEGED),
+    SD_BUS_METHOD("StartTransientUnit", "ssa(sv)a(sa(sv))", "o", method_start_transient_unit,
+                  SD_BUS_VTABLE_UNPRIVILEGED),
+    SD_BUS_METHOD("KillUnit", "ssi", "", method_kill_unit, SD_BUS_VTABLE_UNPRIVILEGED),
+    SD_BUS_SIGNAL("JobRemoved", "uoss", 0),
+    SD_BUS_VTABLE_END};
+
+static const sd_bus_vtable s_unit_vtable[] = {
+    SD_BUS_VTABLE_START(0),
+    SD_BUS_PROPERTY("ActiveState", "s", property_string, offsetof(standin_unit_t, active_state),
+                    SD_BUS_VTABLE_PROPERTY_EMITS_CHANGE),
+    SD_BUS_PROPERTY("SubState", "s", property_string, offsetof(standin_unit_t, sub_state),
+                    SD_BUS_VTABLE_PROPERTY_EMITS_CHANGE),
+    SD_BUS_METHOD("Start", "s", "o", method_unit_start, SD_BUS_VTABLE_UNPRIVILEGED),
+    SD_BUS_VTABLE_END};
+
+static const sd_bus_vtable s_job_vtable[] = {
+    SD_BUS_VTABLE_START(0),
+    SD_BUS_METHOD("Cancel", "", "", method_job_cancel, SD_BUS_VTABLE_UNPRIVILEGED),
+    SD_BUS_VTABLE_END};
+
+static void usage(const char *const p_prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-a address] [-l latency_ms] [-f unit]... [-p fail_percent] [-s seed] [-r record_file]\n"
+            "  -a  bus to serve on, defaults to the system bus\n"
+            "  -l  time every job takes before JobRemoved is sent\n"
+            "  -f  let all jobs of this unit fail, may be repeated\n"
+            "  -p  let this share of all jobs fail at random\n"
+            "  -s  seed for the random failures, runs are reproducible by default\n"
+            "  -r  append '<monotonic us> <method> <unit>' for every call to this file\n",
+            p_prog);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *p_address = NULL;
+    unsigned seed = 1;
+    int opt = 0;
+    int rc = 0;
+
+    while ((opt = getopt(argc, argv, "a:l:f:p:s:r:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 'a':
+            p_address = optarg;
+            break;
+        case 'l':
+            s_latency_us = strtoull(optarg, NULL, 10) * 1000U;
+            break;
+        case 'f':
+            if (s_fail_cnt < STANDIN_MAX_FAIL)
+                s_fail_units[s_fail_cnt++] = optarg;
+            break;
+        case 'p':
+            s_fail_percent = (unsigned)atoi(optarg);
+            break;
+        case 's':
+            seed = (unsigned)strtoul(optarg, NULL, 10);
+            break;
+        case 'r':
+            p_record = fopen(optarg, "a");
+            if (!p_record)
+                LOG_FTL("Could not open '%s' (error '%s')", optarg, strerror(errno));
+            break;
+        default:
+            usage(argv[0]);
+            return (opt == 'h') ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    srand(seed);
+
+    rc = sd_event_default(&s_event);
+    if (rc >= 0)
+    {
+        if (p_address)
+        {
+            rc = sd_bus_new(&s_bus);
+            if (rc >= 0)
+                rc = sd_bus_set_address(s_bus, p_address);
+            if (rc >= 0)
+                rc = sd_bus_set_bus_client(s_bus, 1);
+            if (rc >= 0)
+                rc = sd_bus_start(s_bus);
+        }
+        else
+        {
+            rc = sd_bus_open_system(&s_bus);
+        }
+    }
+    if (rc >= 0)
+        rc = sd_bus_add_object_vtable(s_bus, NULL, SD_PATH, SD_INTERFACE_MANAGER, s_manager_vtable, NULL);
+    if (rc >= 0)
+        rc = sd_bus_add_fallback_vtable(s_bus, NULL, SD_PATH_UNIT, SD_INTERFACE_UNIT, s_unit_vtable, unit_find, NULL);
+    if (rc >= 0)
+        rc = sd_bus_add_fallback_vtable(s_bus, NULL, SD_PATH_JOB, SD_INTERFACE_JOB, s_job_vtable, job_find, NULL);
+    if (rc >= 0)
+        rc = sd_bus_request_name(s_bus, SD_NAME, 0);
+    if (rc >= 0)
+        rc = sd_bus_attach_event(s_bus, s_event, SD_EVENT_PRIORITY_NORMAL);
+    if (rc < 0)
+        LOG_FTL("Setup failed (error '%s')", strerror(-rc));
+
+    LOG_INF("Serving %s, job latency %llu us, %zu failing units, %u%% random failures", SD_NAME,
+            (unsigned long long)s_latency_us, s_fail_cnt, s_fail_percent);
+    rc = sd_event_loop(s_event);
+    s_bus = sd_bus_flush_close_unref(s_bus);
+    s_event = sd_event_unref(s_event);
+    if (p_record)
+        fclose(p_record);
+    return (rc < 0) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -1,17 +1,35 @@
 
 #include "unit.h"
+#include "bus.h"
+#include "ini.h"
 #include "log.h"
+#include "module.h"
+#include "overlay.h"
+#include "unit_cache.h"
+#include "unit_health.h"
+#include "unit_stop.h"
+#include "userbus.h"
 #include "util.h"
 
 #include <dirent.h>
 #include <errno.h>
-#include <glob.h>
-#include <mini.h>
+#include <libgen.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <systemd/sd-bus.h>
+#include <strings.h>
+
+#define UNIT_MAX_SERVICES (16)
+#define UNIT_MAX_OVERLAYS (8)
+#define UNIT_MAX_MODULES (8)
+#define UNIT_NAME_MAX (255)
+#define SD_DESTINATION "org.freedesktop.systemd1"
+#define SD_PATH "/org/freedesktop/systemd1"
+#define SD_INTERFACE_MANAGER "org.freedesktop.systemd1.Manager"
+#define SD_INTERFACE_UNIT "org.freedesktop.systemd1.Unit"
+#define SD_INTERFACE_JOB "org.freedesktop.systemd1.Job"
+#define SD_ERROR_UNIT_EXISTS "org.freedesktop.systemd1.UnitExists"
 
 #define LEX(str, fun)                                                                                                  \
     (unit_lex_t)                                                                                                       \
@@ -19,7 +37,7 @@
         .p_lex = str, .length = sizeof(str), .p_fun = (lex_parse_func)fun                                              \
     }
 
-typedef unit_parse_result_t (*lex_parse_func)(void * /*p_ctx*/, char * /*p_value*/);
+typedef unit_parse_result_t (*lex_parse_func)(void * /*p_ctx*/, const ini_span_t /*value*/);
 
 typedef struct
 {
@@ -28,159 +46,238 @@ typedef struct
     lex_parse_func p_fun;
 } unit_lex_t;
 
-static unit_parse_result_t parse_name(unit_t *p_unit, char *p_value);
-static unit_parse_result_t parse_desc(unit_t *p_unit, char *p_value);
+typedef enum
+{
+    UNIT_SECTION_NONE = 0,
+    UNIT_SECTION_CARTRIDGE,
+    UNIT_SECTION_SERVICE,
+    UNIT_SECTION_OVERLAY,
+    UNIT_SECTION_MODULE,
+    UNIT_SECTION_UNKNOWN
+} unit_section_t;
+
+typedef enum
+{
+    UNIT_JOB_MODULES = 0,
+    UNIT_JOB_OVERLAYS,
+    UNIT_JOB_SERVICES,
+    UNIT_JOB_USER,
+    UNIT_JOB_DONE
+} unit_job_phase_t;
+
+struct unit_job
+{
+    unit_t *p_unit;
+    sd_event_source *p_step;
+    sd_bus_slot *p_call;       // start call waiting for its reply
+    unit_service_t *p_pending; // service the call is for, NULL for the target
+    unit_job_phase_t phase;
+    size_t idx;
+    bool resume; // only services that are down are started, see unit_resume()
+};
+
+static unit_parse_result_t parse_name(unit_t *p_unit, const ini_span_t value);
+static unit_parse_result_t parse_desc(unit_t *p_unit, const ini_span_t value);
+static unit_parse_result_t parse_activation(unit_t *p_unit, const ini_span_t value);
+static unit_parse_result_t parse_icon(unit_t *p_unit, const ini_span_t value);
+static unit_parse_result_t parse_match(unit_t *p_unit, const ini_span_t value);
 
 unit_lex_t KEYS_CARTRIDGE[] = {
     LEX("Name", parse_name),
     LEX("Description", parse_desc),
+    LEX("Activation", parse_activation),
+    LEX("Icon", parse_icon),
+    LEX("Match", parse_match),
 };
 
-static unit_parse_result_t parse_service_scope(unit_service_t *p_serv, char *p_value);
-static unit_parse_result_t parse_service_unit(unit_service_t *p_serv, char *p_value);
+static unit_parse_result_t parse_service_scope(unit_service_t *p_serv, const ini_span_t value);
+static unit_parse_result_t parse_service_unit(unit_service_t *p_serv, const ini_span_t value);
 
 unit_lex_t KEYS_SERVICE[] = {
     LEX("Scope", parse_service_scope),
     LEX("Unit", parse_service_unit),
 };
 
-static int unit_systemd_servcall(const char *const p_method, const char *const p_service);
+static unit_parse_result_t parse_overlay_source(unit_overlay_t *p_ov, const ini_span_t value);
 
-unit_find_result_t unit_find(const uint16_t id, const char *const p_path, char *p_name)
-{
-    unit_find_result_t ret = UNIT_FIND_SUCCESS;
-    glob_t result;
-    char globpath[255] = {0};
+unit_lex_t KEYS_OVERLAY[] = {
+    LEX("Source", parse_overlay_source),
+};
 
-    ///@todo evaluate return code
-    (void)snprintf(globpath, sizeof(globpath), "%s/%04X-*.cart", p_path, id);
-    const int rc = glob(globpath, 0, NULL, &result);
-    if ((rc == 0) && (result.gl_pathc == 1))
-    {
-        strcpy(p_name, result.gl_pathv[0]);
-        ret = UNIT_FIND_SUCCESS;
-    }
-    else if (rc != 0)
-    {
-        ret = UNIT_FIND_NOTFOUND;
-    }
-    else
+static unit_parse_result_t parse_module_options(unit_module_t *p_mod, const ini_span_t value);
+
+unit_lex_t KEYS_MODULE[] = {
+    LEX("Options", parse_module_options),
+};
+
+static void unit_service_name(const unit_service_t *p_serv, char *p_name, const size_t size);
+static void unit_target_name(const unit_t *p_unit, char *p_name, const size_t size);
+static void unit_user_servcall(const char *const p_method, unit_t *p_unit);
+static void unit_job_free(unit_t *p_unit);
+static void unit_job_in_flight(unit_job_t *p_job);
+static void unit_job_cancel(char **pp_job_path);
+static int unit_job_step(sd_event_source *p_source, void *p_userdata);
+
+// Keys may appear in any order: the length is compared before any characters are
+static const unit_lex_t *unit_lex_find(const unit_lex_t *p_table, const size_t size, const ini_span_t key)
+{
+    for (size_t i = 0; i < size; ++i)
     {
-        ret = UNIT_FIND_AMBIGOUS;
+        if (((p_table[i].length - 1) == key.len) && (memcmp(p_table[i].p_lex, key.p, key.len) == 0))
+            return &p_table[i];
     }
-    globfree(&result);
-    return ret;
+    return NULL;
 }
 
-unit_parse_result_t unit_parse_cartridge(mini_t *p_mini, unit_t *p_unit)
+static unit_parse_result_t parse_name(unit_t *p_unit, const ini_span_t value)
 {
-    unit_parse_result_t rc = UNIT_PARSE_OKAY;
-    int i = 0;
+    free(p_unit->p_unit_name);
+    p_unit->p_unit_name = ini_span_dup(value);
+    return p_unit->p_unit_name ? UNIT_PARSE_OKAY : UNIT_PARSE_ERR;
+}
 
-    mini_next(p_mini);
-    for (i = 0; (i < NELEMS(KEYS_CARTRIDGE)) && (rc == UNIT_PARSE_OKAY); ++i)
-    {
-        if (!p_mini->key)
-        {
-            rc = UNIT_PARSE_SYN_ERR;
-        }
-        else if (!p_mini->value)
-        {
-            rc = UNIT_PARSE_SYN_ERR;
-        }
-        else
-        {
-            if (strncmp(p_mini->key, KEYS_CARTRIDGE[i].p_lex, KEYS_CARTRIDGE[i].length - 1) == 0)
-            {
-                rc = KEYS_CARTRIDGE[i].p_fun(p_unit, p_mini->value);
-                if (i != (NELEMS(KEYS_CARTRIDGE) - 1))
-                {
-                    mini_next(p_mini);
-                }
-            }
-        }
-    }
-    return rc;
+static unit_parse_result_t parse_desc(unit_t *p_unit, const ini_span_t value)
+{
+    free(p_unit->p_description);
+    p_unit->p_description = ini_span_dup(value);
+    return p_unit->p_description ? UNIT_PARSE_OKAY : UNIT_PARSE_ERR;
 }
 
-static unit_parse_result_t parse_name(unit_t *p_unit, char *p_value)
+static unit_parse_result_t parse_icon(unit_t *p_unit, const ini_span_t value)
 {
-    p_unit->p_unit_name = malloc(strlen(p_value));
-    if (p_unit->p_unit_name)
-    {
-        strcpy(p_unit->p_unit_name, p_value);
-    }
-    return UNIT_PARSE_OKAY;
+    free(p_unit->p_icon);
+    p_unit->p_icon = ini_span_dup(value);
+    return p_unit->p_icon ? UNIT_PARSE_OKAY : UNIT_PARSE_ERR;
 }
 
-static unit_parse_result_t parse_desc(unit_t *p_unit, char *p_value)
+static bool parse_hex(const char *p_str, const char *p_end, uint64_t *p_value, unsigned *p_digits)
 {
-    p_unit->p_description = malloc(strlen(p_value));
-    if (p_unit->p_description)
+    char buf[24] = {0};
+    char *p_stop = NULL;
+
+    if ((p_end <= p_str) || ((size_t)(p_end - p_str) >= sizeof(buf)))
+        return false;
+    memcpy(buf, p_str, p_end - p_str);
+    errno = 0;
+    *p_value = strtoull(buf, &p_stop, 16);
+    if (p_digits)
+        *p_digits = strlen(buf) - ((strncasecmp(buf, "0x", 2) == 0) ? 2 : 0);
+    return (errno == 0) && (*p_stop == '\0');
+}
+
+// Match=<id>, Match=<lo>-<hi> or Match=<value>/<mask>, all in hexadecimal, optionally followed by :<bytes>.
+// Masks must cover the upper bits of the ID, so every match is a contiguous range. Without :<bytes> IDs of any
+// length match by their value.
+static unit_parse_result_t parse_match(unit_t *p_unit, const ini_span_t value)
+{
+    const char *p_end = value.p + value.len;
+    const char *p_sep = NULL;
+    const char *p_len = memchr(value.p, ':', value.len);
+    unit_match_t match = {0};
+    unit_match_t *p_elem = NULL;
+    unsigned digits = 0;
+    uint64_t len = 0;
+
+    if (p_len)
+    {
+        if (!parse_hex(p_len + 1, p_end, &len, NULL) || (len < 1) || (len > 8))
+            return UNIT_PARSE_BAD_MATCH;
+        p_end = p_len;
+    }
+    if ((p_sep = memchr(value.p, '-', p_end - value.p)))
+    {
+        if (!parse_hex(value.p, p_sep, &match.lo, NULL) || !parse_hex(p_sep + 1, p_end, &match.hi, NULL) ||
+            (match.hi < match.lo))
+            return UNIT_PARSE_BAD_MATCH;
+    }
+    else if ((p_sep = memchr(value.p, '/', p_end - value.p)))
     {
-        strcpy(p_unit->p_description, p_value);
+        uint64_t id = 0;
+        uint64_t mask = 0;
+        if (!parse_hex(value.p, p_sep, &id, NULL) || !parse_hex(p_sep + 1, p_end, &mask, &digits) || (digits > 16))
+            return UNIT_PARSE_BAD_MATCH;
+        // The mask is as wide as written, e.g. FF00 covers 16 bits
+        const uint64_t width = (digits >= 16) ? UINT64_MAX : ((1ULL << (digits * 4)) - 1);
+        const uint64_t wildcard = ~mask & width;
+        if ((wildcard & (wildcard + 1)) != 0)
+            return UNIT_PARSE_BAD_MATCH;
+        match.lo = id & mask & width;
+        match.hi = match.lo | wildcard;
     }
+    else
+    {
+        if (!parse_hex(value.p, p_end, &match.lo, NULL))
+            return UNIT_PARSE_BAD_MATCH;
+        match.hi = match.lo;
+    }
+    match.len = (uint8_t)len;
+    // An ID read with len bytes cannot be any larger
+    if ((match.len > 0) && (match.len < 8) && (match.hi >> (match.len * 8)))
+        return UNIT_PARSE_BAD_MATCH;
+
+    p_elem = realloc(p_unit->matches.elem, sizeof(unit_match_t) * (p_unit->matches.size + 1));
+    if (!p_elem)
+        return UNIT_PARSE_ERR;
+    p_elem[p_unit->matches.size++] = match;
+    p_unit->matches.elem = p_elem;
     return UNIT_PARSE_OKAY;
 }
 
-unit_parse_result_t unit_parse_service(mini_t *p_mini, unit_service_t *p_serv, const char *const p_servicename)
+static unit_parse_result_t parse_activation(unit_t *p_unit, const ini_span_t value)
 {
-    unit_parse_result_t rc = UNIT_PARSE_OKAY;
-    int i = 0;
+    char buf[16] = {0};
+    ini_span_copy(value, buf, sizeof(buf));
+    return (unit_activation_from_str(buf, &p_unit->activation) == 0) ? UNIT_PARSE_OKAY : UNIT_PARSE_BAD_ACTIVATION;
+}
 
-    // Copy name
-    p_serv->p_name = malloc(strlen(p_servicename));
-    if (p_serv->p_name)
+int unit_activation_from_str(const char *const p_str, unit_activation_t *p_activation)
+{
+    int rc = 0;
+    if (strcmp(p_str, "sequential") == 0)
     {
-        strcpy(p_serv->p_name, p_servicename);
+        *p_activation = UNIT_ACTIVATION_SEQUENTIAL;
     }
-
-    mini_next(p_mini);
-    for (i = 0; (i < NELEMS(KEYS_SERVICE)) && (rc == UNIT_PARSE_OKAY); ++i)
+    else if (strcmp(p_str, "target") == 0)
     {
-        if (!p_mini->key)
-        {
-            rc = UNIT_PARSE_SYN_ERR;
-        }
-        else if (!p_mini->value)
-        {
-            rc = UNIT_PARSE_SYN_ERR;
-        }
-        else
-        {
-            if (strncmp(p_mini->key, KEYS_SERVICE[i].p_lex, KEYS_SERVICE[i].length - 1) == 0)
-            {
-                rc = KEYS_SERVICE[i].p_fun(p_serv, p_mini->value);
-                if (i != (NELEMS(KEYS_SERVICE) - 1))
-                {
-                    mini_next(p_mini);
-                }
-            }
-        }
+        *p_activation = UNIT_ACTIVATION_TARGET;
+    }
+    else
+    {
+        rc = -EINVAL;
     }
-
     return rc;
 }
 
-static unit_parse_result_t parse_service_unit(unit_service_t *p_serv, char *p_value)
+static unit_parse_result_t parse_service_unit(unit_service_t *p_serv, const ini_span_t value)
 {
-    p_serv->p_sdunit = malloc(strlen(p_value));
-    if (p_serv->p_sdunit)
-    {
-        strcpy(p_serv->p_sdunit, p_value);
-    }
-    return UNIT_PARSE_OKAY;
+    free(p_serv->p_sdunit);
+    p_serv->p_sdunit = ini_span_dup(value);
+    return p_serv->p_sdunit ? UNIT_PARSE_OKAY : UNIT_PARSE_ERR;
+}
+
+static unit_parse_result_t parse_overlay_source(unit_overlay_t *p_ov, const ini_span_t value)
+{
+    free(p_ov->p_source);
+    p_ov->p_source = ini_span_dup(value);
+    return p_ov->p_source ? UNIT_PARSE_OKAY : UNIT_PARSE_ERR;
+}
+
+static unit_parse_result_t parse_module_options(unit_module_t *p_mod, const ini_span_t value)
+{
+    free(p_mod->p_options);
+    p_mod->p_options = ini_span_dup(value);
+    return p_mod->p_options ? UNIT_PARSE_OKAY : UNIT_PARSE_ERR;
 }
 
-static unit_parse_result_t parse_service_scope(unit_service_t *p_serv, char *p_value)
+static unit_parse_result_t parse_service_scope(unit_service_t *p_serv, const ini_span_t value)
 {
     unit_parse_result_t rc = UNIT_PARSE_OKAY;
 
-    if (strncmp(p_value, "System", sizeof("System") - 1) == 0)
+    if (ini_span_eq(value, "System"))
     {
         p_serv->sdscope = UNIT_SCOPE_SYSTEM;
     }
-    else if (strncmp(p_value, "User", sizeof("User") - 1) == 0)
+    else if (ini_span_eq(value, "User"))
     {
         p_serv->sdscope = UNIT_SCOPE_USER;
     }
@@ -191,61 +288,279 @@ static unit_parse_result_t parse_service_scope(unit_service_t *p_serv, char *p_v
     return rc;
 }
 
-unit_parse_result_t unit_parse_section(mini_t *p_mini, unit_t *p_unit, const char *const p_section,
-                                       unit_service_t *p_services, size_t *p_service_cnt)
+static unit_parse_result_t unit_parse_section(const ini_span_t section, unit_section_t *p_kind,
+                                              unit_service_t *p_services, size_t *p_service_cnt,
+                                              unit_overlay_t *p_overlays, size_t *p_overlay_cnt,
+                                              unit_module_t *p_modules, size_t *p_module_cnt)
 {
-    unit_parse_result_t rc = UNIT_PARSE_OKAY;
-    if (strncmp(p_section, "Cartridge", sizeof("Cartridge") - 1) == 0)
+    if (ini_span_eq(section, "Cartridge"))
     {
-        rc = unit_parse_cartridge(p_mini, p_unit);
+        *p_kind = UNIT_SECTION_CARTRIDGE;
     }
-    else if (strncmp(p_section, "Service", sizeof("Service") - 1) == 0)
+    else if (ini_span_prefix(section, "Service ") && (section.len > (sizeof("Service ") - 1)))
     {
-        rc = unit_parse_service(p_mini, &p_services[*p_service_cnt], &p_section[sizeof("Service ") - 1]);
+        if (*p_service_cnt >= UNIT_MAX_SERVICES)
+            return UNIT_PARSE_SYN_ERR;
+        const ini_span_t name = {.p = section.p + sizeof("Service ") - 1, .len = section.len - sizeof("Service ") + 1};
+        unit_service_t *p_serv = &p_services[*p_service_cnt];
         (*p_service_cnt)++;
+        p_serv->p_name = ini_span_dup(name);
+        if (!p_serv->p_name)
+            return UNIT_PARSE_ERR;
+        *p_kind = UNIT_SECTION_SERVICE;
+    }
+    else if (ini_span_prefix(section, "Overlay ") && (section.len > (sizeof("Overlay ") - 1)))
+    {
+        if (*p_overlay_cnt >= UNIT_MAX_OVERLAYS)
+            return UNIT_PARSE_SYN_ERR;
+        const ini_span_t name = {.p = section.p + sizeof("Overlay ") - 1, .len = section.len - sizeof("Overlay ") + 1};
+        unit_overlay_t *p_ov = &p_overlays[*p_overlay_cnt];
+        (*p_overlay_cnt)++;
+        p_ov->p_name = ini_span_dup(name);
+        if (!p_ov->p_name)
+            return UNIT_PARSE_ERR;
+        *p_kind = UNIT_SECTION_OVERLAY;
+    }
+    else if (ini_span_prefix(section, "Module ") && (section.len > (sizeof("Module ") - 1)))
+    {
+        if (*p_module_cnt >= UNIT_MAX_MODULES)
+            return UNIT_PARSE_SYN_ERR;
+        const ini_span_t name = {.p = section.p + sizeof("Module ") - 1, .len = section.len - sizeof("Module ") + 1};
+        unit_module_t *p_mod = &p_modules[*p_module_cnt];
+        (*p_module_cnt)++;
+        p_mod->p_name = ini_span_dup(name);
+        if (!p_mod->p_name)
+            return UNIT_PARSE_ERR;
+        *p_kind = UNIT_SECTION_MODULE;
+    }
+    else
+    {
+        *p_kind = UNIT_SECTION_UNKNOWN;
+    }
+    return UNIT_PARSE_OKAY;
+}
+
+static unit_parse_result_t unit_parse_key(ini_t *p_ini, const unit_section_t kind, unit_t *p_unit,
+                                          unit_service_t *p_serv, unit_overlay_t *p_ov, unit_module_t *p_mod)
+{
+    const unit_lex_t *p_lex = NULL;
+    void *p_ctx = NULL;
+
+    switch (kind)
+    {
+    case UNIT_SECTION_CARTRIDGE:
+        p_lex = unit_lex_find(KEYS_CARTRIDGE, NELEMS(KEYS_CARTRIDGE), p_ini->key);
+        p_ctx = p_unit;
+        break;
+    case UNIT_SECTION_SERVICE:
+        p_lex = unit_lex_find(KEYS_SERVICE, NELEMS(KEYS_SERVICE), p_ini->key);
+        p_ctx = p_serv;
+        break;
+    case UNIT_SECTION_OVERLAY:
+        p_lex = unit_lex_find(KEYS_OVERLAY, NELEMS(KEYS_OVERLAY), p_ini->key);
+        p_ctx = p_ov;
+        break;
+    case UNIT_SECTION_MODULE:
+        p_lex = unit_lex_find(KEYS_MODULE, NELEMS(KEYS_MODULE), p_ini->key);
+        p_ctx = p_mod;
+        break;
+    case UNIT_SECTION_UNKNOWN:
+        // keys of sections this daemon does not know about are ignored
+        return UNIT_PARSE_OKAY;
+    default:
+        // keys before the first section
+        return UNIT_PARSE_SYN_ERR;
     }
 
-    return rc;
+    if (!p_lex)
+    {
+        LOG_WRN("Ignoring unknown key '%.*s' in line %u", (int)p_ini->key.len, p_ini->key.p, p_ini->line);
+        return UNIT_PARSE_OKAY;
+    }
+    return p_lex->p_fun(p_ctx, p_ini->value);
+}
+
+static void unit_service_free(unit_service_t *p_serv)
+{
+    free(p_serv->p_name);
+    free(p_serv->p_sdunit);
+}
+
+static void unit_overlay_free(unit_overlay_t *p_ov)
+{
+    free(p_ov->p_name);
+    free(p_ov->p_source);
+}
+
+static void unit_module_free(unit_module_t *p_mod)
+{
+    free(p_mod->p_name);
+    free(p_mod->p_options);
+}
+
+// Sources are relative to the unit file, the path is resolved once so activation never depends on it
+static unit_parse_result_t unit_overlay_resolve(unit_overlay_t *p_ov, const char *const p_path)
+{
+    char dir[512] = {0};
+    char *p_abs = NULL;
+
+    if (p_ov->p_source[0] == '/')
+        return UNIT_PARSE_OKAY;
+    (void)snprintf(dir, sizeof(dir), "%s", p_path);
+    p_abs = malloc(strlen(dir) + strlen(p_ov->p_source) + 2);
+    if (!p_abs)
+        return UNIT_PARSE_ERR;
+    sprintf(p_abs, "%s/%s", dirname(dir), p_ov->p_source);
+    free(p_ov->p_source);
+    p_ov->p_source = p_abs;
+    return UNIT_PARSE_OKAY;
+}
+
+static unit_parse_result_t unit_validate(const unit_t *p_unit, const unit_service_t *p_services,
+                                         const size_t service_cnt, const unit_overlay_t *p_overlays,
+                                         const size_t overlay_cnt)
+{
+    if (!p_unit->p_unit_name)
+    {
+        LOG_ERR("%s", "Missing 'Name' in [Cartridge] section");
+        return UNIT_PARSE_SYN_ERR;
+    }
+    for (size_t i = 0; i < service_cnt; ++i)
+    {
+        if (!p_services[i].p_sdunit)
+        {
+            LOG_ERR("Missing 'Unit' in [Service %s] section", p_services[i].p_name);
+            return UNIT_PARSE_SYN_ERR;
+        }
+    }
+    for (size_t i = 0; i < overlay_cnt; ++i)
+    {
+        if (!p_overlays[i].p_source)
+        {
+            LOG_ERR("Missing 'Source' in [Overlay %s] section", p_overlays[i].p_name);
+            return UNIT_PARSE_SYN_ERR;
+        }
+    }
+    return UNIT_PARSE_OKAY;
 }
 
 unit_parse_result_t unit_parse(unit_t **pp_unit, const char *const p_path)
 {
     unit_parse_result_t parse_rc = UNIT_PARSE_OKAY;
-    mini_t *p_mini = NULL;
+    ini_t ini;
+    ini_token_t token = INI_TOKEN_END;
+    unit_section_t kind = UNIT_SECTION_NONE;
     unit_t *p_unit = NULL;
-    unit_service_t services[16];
+    unit_service_t services[UNIT_MAX_SERVICES] = {0};
     size_t service_cnt = 0;
+    unit_overlay_t overlays[UNIT_MAX_OVERLAYS] = {0};
+    size_t overlay_cnt = 0;
+    unit_module_t modules[UNIT_MAX_MODULES] = {0};
+    size_t module_cnt = 0;
+    int rc = 0;
 
-    p_mini = mini_init(p_path);
-    p_unit = malloc(sizeof(*p_unit));
-
-    while (mini_next(p_mini))
+    rc = ini_open(&ini, p_path);
+    if (rc != 0)
     {
-        if (!p_mini->key)
-        {
-            parse_rc = unit_parse_section(p_mini, p_unit, p_mini->section, services, &service_cnt);
-        }
+        LOG_ERR("Error reading configuration at '%s' (error '%s')", p_path, strerror(-rc));
+        return UNIT_PARSE_FILE_ERR;
     }
-    if (!p_mini->eof)
+    p_unit = calloc(1, sizeof(*p_unit));
+    if (!p_unit)
     {
-        LOG_ERR("Error reading configuration at '%s' (error '%s')", p_path, strerror(errno));
-        parse_rc = UNIT_PARSE_FILE_ERR;
+        ini_close(&ini);
+        return UNIT_PARSE_ERR;
     }
-    mini_free(p_mini);
+    // Services run on system level unless told otherwise
+    for (size_t i = 0; i < UNIT_MAX_SERVICES; ++i)
+        services[i].sdscope = UNIT_SCOPE_SYSTEM;
 
-    if (parse_rc != UNIT_PARSE_OKAY)
+    while ((parse_rc == UNIT_PARSE_OKAY) && ((token = ini_next(&ini)) != INI_TOKEN_END))
     {
-        free(p_unit);
+        switch (token)
+        {
+        case INI_TOKEN_SECTION:
+            parse_rc = unit_parse_section(ini.section, &kind, services, &service_cnt, overlays, &overlay_cnt, modules,
+                                          &module_cnt);
+            break;
+        case INI_TOKEN_KEY:
+            parse_rc = unit_parse_key(&ini, kind, p_unit, (service_cnt > 0) ? &services[service_cnt - 1] : NULL,
+                                      (overlay_cnt > 0) ? &overlays[overlay_cnt - 1] : NULL,
+                                      (module_cnt > 0) ? &modules[module_cnt - 1] : NULL);
+            break;
+        default:
+            parse_rc = UNIT_PARSE_SYN_ERR;
+            break;
+        }
     }
+    ini_close(&ini);
+
+    if (parse_rc == UNIT_PARSE_OKAY)
+        parse_rc = unit_validate(p_unit, services, service_cnt, overlays, overlay_cnt);
     else
+        LOG_ERR("Error parsing '%s' in line %u (error %d)", p_path, ini.line, parse_rc);
+
+    if ((parse_rc == UNIT_PARSE_OKAY) && (service_cnt > 0))
     {
-        if (service_cnt > 0)
+        p_unit->services.elem = malloc(sizeof(unit_service_t) * service_cnt);
+        if (p_unit->services.elem)
         {
             p_unit->services.size = service_cnt;
-            p_unit->services.elem = malloc(sizeof(unit_service_t) * service_cnt);
             memcpy(p_unit->services.elem, services, sizeof(unit_service_t) * service_cnt);
         }
+        else
+        {
+            parse_rc = UNIT_PARSE_ERR;
+        }
+    }
+    for (size_t i = 0; (parse_rc == UNIT_PARSE_OKAY) && (i < overlay_cnt); ++i)
+        parse_rc = unit_overlay_resolve(&overlays[i], p_path);
+    if ((parse_rc == UNIT_PARSE_OKAY) && (overlay_cnt > 0))
+    {
+        p_unit->overlays.elem = malloc(sizeof(unit_overlay_t) * overlay_cnt);
+        if (p_unit->overlays.elem)
+        {
+            p_unit->overlays.size = overlay_cnt;
+            memcpy(p_unit->overlays.elem, overlays, sizeof(unit_overlay_t) * overlay_cnt);
+        }
+        else
+        {
+            parse_rc = UNIT_PARSE_ERR;
+        }
+    }
+    if ((parse_rc == UNIT_PARSE_OKAY) && (module_cnt > 0))
+    {
+        p_unit->modules.elem = malloc(sizeof(unit_module_t) * module_cnt);
+        if (p_unit->modules.elem)
+        {
+            p_unit->modules.size = module_cnt;
+            memcpy(p_unit->modules.elem, modules, sizeof(unit_module_t) * module_cnt);
+        }
+        else
+        {
+            parse_rc = UNIT_PARSE_ERR;
+        }
+    }
 
+    if (parse_rc != UNIT_PARSE_OKAY)
+    {
+        // Services and overlays not handed over to the unit yet are only owned by this frame
+        if (!p_unit->services.elem)
+        {
+            for (size_t i = 0; i < service_cnt; ++i)
+                unit_service_free(&services[i]);
+        }
+        if (!p_unit->overlays.elem)
+        {
+            for (size_t i = 0; i < overlay_cnt; ++i)
+                unit_overlay_free(&overlays[i]);
+        }
+        for (size_t i = 0; i < module_cnt; ++i)
+            unit_module_free(&modules[i]);
+        unit_destroy(p_unit);
+    }
+    else
+    {
         *pp_unit = p_unit;
     }
 
@@ -255,103 +570,542 @@ unit_parse_result_t unit_parse(unit_t **pp_unit, const char *const p_path)
 void unit_destroy(unit_t *p_unit)
 {
     size_t i = 0;
+    if (!p_unit)
+        return;
+    // Whatever the activation got to stays as it is, stopping is up to unit_deactive()
+    unit_job_free(p_unit);
     for (i = 0; i < p_unit->services.size; ++i)
     {
         free(p_unit->services.elem[i].p_name);
         free(p_unit->services.elem[i].p_sdunit);
+        free(p_unit->services.elem[i].p_job_path);
+        sd_bus_slot_unref(p_unit->services.elem[i].p_watch);
+        sd_bus_slot_unref(p_unit->services.elem[i].p_state_call);
     }
     free(p_unit->services.elem);
+    for (i = 0; i < p_unit->overlays.size; ++i)
+        unit_overlay_free(&p_unit->overlays.elem[i]);
+    free(p_unit->overlays.elem);
+    for (i = 0; i < p_unit->modules.size; ++i)
+        unit_module_free(&p_unit->modules.elem[i]);
+    free(p_unit->modules.elem);
     free(p_unit->p_unit_name);
     free(p_unit->p_description);
+    free(p_unit->p_icon);
+    free(p_unit->matches.elem);
+    free(p_unit->p_target_job_path);
+    sd_bus_slot_unref(p_unit->p_job_watch);
+    free(p_unit);
 }
 
-void unit_activate(unit_t *p_unit)
+int unit_write(const unit_t *p_unit, FILE *p_file)
 {
-    LOG_INF("Starting Cartridge Unit '%s'", p_unit->p_unit_name);
+    fprintf(p_file, "[Cartridge]\nName=%s\n", p_unit->p_unit_name);
+    if (p_unit->p_description)
+        fprintf(p_file, "Description=%s\n", p_unit->p_description);
+    if (p_unit->p_icon)
+        fprintf(p_file, "Icon=%s\n", p_unit->p_icon);
+    if (p_unit->activation != UNIT_ACTIVATION_DEFAULT)
+        fprintf(p_file, "Activation=%s\n", (p_unit->activation == UNIT_ACTIVATION_TARGET) ? "target" : "sequential");
     for (size_t i = 0; i < p_unit->services.size; ++i)
     {
-        switch (p_unit->services.elem[i].sdscope)
+        const unit_service_t *p_serv = &p_unit->services.elem[i];
+        fprintf(p_file, "\n[Service %s]\nScope=%s\nUnit=%s\n", p_serv->p_name,
+                (p_serv->sdscope == UNIT_SCOPE_USER) ? "User" : "System", p_serv->p_sdunit);
+    }
+    for (size_t i = 0; i < p_unit->overlays.size; ++i)
+    {
+        const unit_overlay_t *p_ov = &p_unit->overlays.elem[i];
+        fprintf(p_file, "\n[Overlay %s]\nSource=%s\n", p_ov->p_name, p_ov->p_source);
+    }
+    for (size_t i = 0; i < p_unit->modules.size; ++i)
+    {
+        const unit_module_t *p_mod = &p_unit->modules.elem[i];
+        fprintf(p_file, "\n[Module %s]\n", p_mod->p_name);
+        if (p_mod->p_options)
+            fprintf(p_file, "Options=%s\n", p_mod->p_options);
+    }
+    return ferror(p_file) ? -EIO : 0;
+}
+
+static void unit_service_name(const unit_service_t *p_serv, char *p_name, const size_t size)
+{
+    ///@todo evaluate return code
+    (void)snprintf(p_name, size, "%s.service", p_serv->p_sdunit);
+}
+
+static void unit_target_name(const unit_t *p_unit, char *p_name, const size_t size)
+{
+    int len = snprintf(p_name, size, "cartridge-%s", p_unit->p_unit_name);
+    if ((len < 0) || ((size_t)len >= size - sizeof(".target")))
+        len = size - sizeof(".target");
+    // Only keep characters systemd accepts in unit names
+    for (int i = 0; i < len; ++i)
+    {
+        const char c = p_name[i];
+        if (!(((c >= 'a') && (c <= 'z')) || ((c >= 'A') && (c <= 'Z')) || ((c >= '0') && (c <= '9')) ||
+              (c == '-') || (c == '_') || (c == '.') || (c == ':')))
         {
-        case UNIT_SCOPE_SYSTEM:
-            // make d-bus call to systemd starting the service
-            unit_systemd_servcall("StartUnit", p_unit->services.elem[i].p_sdunit);
-            break;
-        default:
-            LOG_WRN("Unsupported scope=%d for service '%s' of '%s', ignoring.", p_unit->services.elem[i].sdscope,
-                    p_unit->services.elem[i].p_name, p_unit->p_unit_name);
+            p_name[i] = '_';
         }
     }
+    strcpy(&p_name[len], ".target");
 }
 
-void unit_deactive(unit_t *p_unit)
+void unit_deinit(void)
 {
-    LOG_INF("Stopping Cartridge Unit '%s'", p_unit->p_unit_name);
+    unit_cache_clear();
+    userbus_deinit();
+    bus_deinit();
+}
+
+// Forgets the path of a finished job, so a removal does not cancel it. The reply carrying the path is always
+// dispatched before the JobRemoved of its job, both come from systemd in that order.
+static int unit_job_removed(sd_bus_message *m, void *p_userdata, sd_bus_error *p_ret_error)
+{
+    unit_t *p_unit = p_userdata;
+    uint32_t id = 0;
+    const char *p_path = NULL;
+    const char *p_name = NULL;
+    const char *p_result = NULL;
+    (void)p_ret_error;
+
+    if (sd_bus_message_read(m, "uoss", &id, &p_path, &p_name, &p_result) < 0)
+        return 0;
     for (size_t i = 0; i < p_unit->services.size; ++i)
     {
-        switch (p_unit->services.elem[i].sdscope)
+        char **pp_job_path = &p_unit->services.elem[i].p_job_path;
+        if (*pp_job_path && (strcmp(*pp_job_path, p_path) == 0))
         {
-        case UNIT_SCOPE_SYSTEM:
-            // make d-bus call to systemd stopping the service
-            unit_systemd_servcall("StopUnit", p_unit->services.elem[i].p_sdunit);
-            break;
-        default:
-            LOG_WRN("Unsupported scope=%d for service '%s' of '%s', ignoring.", p_unit->services.elem[i].sdscope,
-                    p_unit->services.elem[i].p_name, p_unit->p_unit_name);
+            free(*pp_job_path);
+            *pp_job_path = NULL;
         }
     }
+    if (p_unit->p_target_job_path && (strcmp(p_unit->p_target_job_path, p_path) == 0))
+    {
+        free(p_unit->p_target_job_path);
+        p_unit->p_target_job_path = NULL;
+    }
+    return 0;
 }
 
-static int unit_systemd_servcall(const char *const p_method, const char *const p_service)
+static unit_job_t *unit_job_new(unit_t *p_unit, const unit_job_phase_t phase)
 {
-    char serv_name[255] = {0};
-    sd_bus_error error = SD_BUS_ERROR_NULL;
-    sd_bus_message *m = NULL;
-    sd_bus *bus = NULL;
-    const char *path;
-    int rc;
+    sd_event *p_event = bus_event();
+    sd_bus *p_bus = bus_system();
+    unit_job_t *p_job = NULL;
 
-    // Append .service to p_service
-    ///@todo evaluate return code
-    (void)snprintf(serv_name, sizeof(serv_name), "%s.service", p_service);
+    unit_job_free(p_unit);
+    if (p_bus && !p_unit->p_job_watch &&
+        (sd_bus_match_signal(p_bus, &p_unit->p_job_watch, SD_DESTINATION, SD_PATH, SD_INTERFACE_MANAGER,
+                             "JobRemoved", unit_job_removed, p_unit) < 0))
+    {
+        LOG_WRN("Could not watch the jobs of '%s', removals cancel them anyway", p_unit->p_unit_name);
+    }
+    p_job = calloc(1, sizeof(*p_job));
+    if (!p_job || !p_event || (sd_event_add_defer(p_event, &p_job->p_step, unit_job_step, p_job) < 0))
+    {
+        LOG_ERR("Could not schedule the activation of '%s'", p_unit->p_unit_name);
+        free(p_job);
+        return NULL;
+    }
+    // Anything else pending, a removal in particular, is dispatched before the next step
+    (void)sd_event_source_set_priority(p_job->p_step, SD_EVENT_PRIORITY_IDLE);
+    p_job->p_unit = p_unit;
+    p_job->phase = phase;
+    p_unit->p_job = p_job;
+    return p_job;
+}
+
+void unit_activate(unit_t *p_unit)
+{
+    LOG_INF("Starting Cartridge Unit '%s'", p_unit->p_unit_name);
+    (void)unit_job_new(p_unit, UNIT_JOB_MODULES);
+}
+
+void unit_resume(unit_t *p_unit)
+{
+    unit_job_t *p_job = NULL;
+
+    LOG_INF("Restarting stopped services of Cartridge Unit '%s'", p_unit->p_unit_name);
+    // Modules, overlays and user services are left as the previous run set them up
+    p_job = unit_job_new(p_unit, UNIT_JOB_SERVICES);
+    if (p_job)
+        p_job->resume = true;
+}
+
+void unit_assume_active(unit_t *p_unit)
+{
+    for (size_t i = 0; i < p_unit->services.size; ++i)
+        p_unit->services.elem[i].started = (p_unit->services.elem[i].sdscope == UNIT_SCOPE_SYSTEM);
+    for (size_t i = 0; i < p_unit->overlays.size; ++i)
+        p_unit->overlays.elem[i].applied = true;
+    for (size_t i = 0; i < p_unit->modules.size; ++i)
+        p_unit->modules.elem[i].loaded = true;
+    p_unit->user_started = true;
+    p_unit->target_started = (p_unit->activation == UNIT_ACTIVATION_TARGET);
+}
+
+void unit_prewarm(const unit_t *p_unit)
+{
+    char serv_name[UNIT_NAME_MAX] = {0};
+    for (size_t i = 0; i < p_unit->services.size; ++i)
+    {
+        if (p_unit->services.elem[i].sdscope != UNIT_SCOPE_SYSTEM)
+            continue;
+        unit_service_name(&p_unit->services.elem[i], serv_name, sizeof(serv_name));
+        unit_cache_prewarm(serv_name);
+    }
+}
+
+void unit_prepare_overlays(const unit_t *p_unit)
+{
+    for (size_t i = 0; i < p_unit->overlays.size; ++i)
+        (void)overlay_prepare(p_unit->overlays.elem[i].p_source);
+}
+
+void unit_deactive(unit_t *p_unit, const unsigned timeout_ms)
+{
+    char names[UNIT_MAX_SERVICES + 1][UNIT_NAME_MAX];
+    const char *p_names[UNIT_MAX_SERVICES + 1] = {0};
+    size_t cnt = 0;
+
+    LOG_INF("Stopping Cartridge Unit '%s'", p_unit->p_unit_name);
+    if (p_unit->p_job)
+    {
+        LOG_INF("Activation of '%s' still in progress, cancelling it", p_unit->p_unit_name);
+        unit_job_in_flight(p_unit->p_job);
+        unit_job_free(p_unit);
+    }
+    // Starts systemd has not run yet are dropped instead of being run and stopped again right after
+    for (size_t i = 0; i < p_unit->services.size; ++i)
+        unit_job_cancel(&p_unit->services.elem[i].p_job_path);
+    unit_job_cancel(&p_unit->p_target_job_path);
+    p_unit->p_job_watch = sd_bus_slot_unref(p_unit->p_job_watch);
+    if (p_unit->user_started)
+        unit_user_servcall("StopUnit", p_unit);
+    p_unit->user_started = false;
+
+    // Last started is queued first, systemd then stops dependent services before what they depend on
+    for (size_t i = p_unit->services.size; (i > 0) && (cnt < UNIT_MAX_SERVICES); --i)
+    {
+        unit_service_t *p_serv = &p_unit->services.elem[i - 1];
+        if ((p_serv->sdscope != UNIT_SCOPE_SYSTEM) || !p_serv->started)
+            continue;
+        p_serv->started = false;
+        unit_service_name(p_serv, names[cnt], sizeof(names[cnt]));
+        p_names[cnt] = names[cnt];
+        cnt++;
+    }
+    // The services are stopped explicitly in target mode too, so each of them gets a job to wait for
+    if (p_unit->target_started)
+    {
+        unit_target_name(p_unit, names[cnt], sizeof(names[cnt]));
+        p_names[cnt] = names[cnt];
+        cnt++;
+    }
+    p_unit->target_started = false;
+    unit_stop_all(p_names, cnt, timeout_ms);
+    for (size_t i = p_unit->overlays.size; i > 0; --i)
+    {
+        if (p_unit->overlays.elem[i - 1].applied)
+            (void)overlay_remove(p_unit->overlays.elem[i - 1].p_name);
+        p_unit->overlays.elem[i - 1].applied = false;
+    }
+    for (size_t i = p_unit->modules.size; i > 0; --i)
+    {
+        if (p_unit->modules.elem[i - 1].loaded)
+            (void)module_unload(p_unit->modules.elem[i - 1].p_name);
+        p_unit->modules.elem[i - 1].loaded = false;
+    }
+}
+
+static void unit_user_servcall(const char *const p_method, unit_t *p_unit)
+{
+    char names[UNIT_MAX_SERVICES][UNIT_NAME_MAX];
+    const char *p_names[UNIT_MAX_SERVICES] = {0};
+    size_t cnt = 0;
+
+    for (size_t i = 0; (i < p_unit->services.size) && (cnt < UNIT_MAX_SERVICES); ++i)
+    {
+        if (p_unit->services.elem[i].sdscope != UNIT_SCOPE_USER)
+            continue;
+        unit_service_name(&p_unit->services.elem[i], names[cnt], sizeof(names[cnt]));
+        p_names[cnt] = names[cnt];
+        cnt++;
+    }
+    userbus_call_all(p_method, p_names, cnt);
+}
+
+// Appends a dependency property listing all system scope services, e.g. Wants=a.service b.service
+static int unit_append_deps(sd_bus_message *m, const char *const p_property, const unit_t *p_unit)
+{
+    char serv_name[UNIT_NAME_MAX] = {0};
+    int rc = 0;
+
+    rc = sd_bus_message_open_container(m, 'r', "sv");
+    if (rc >= 0)
+        rc = sd_bus_message_append(m, "s", p_property);
+    if (rc >= 0)
+        rc = sd_bus_message_open_container(m, 'v', "as");
+    if (rc >= 0)
+        rc = sd_bus_message_open_container(m, 'a', "s");
+    for (size_t i = 0; (i < p_unit->services.size) && (rc >= 0); ++i)
+    {
+        if (p_unit->services.elem[i].sdscope != UNIT_SCOPE_SYSTEM)
+            continue;
+        unit_service_name(&p_unit->services.elem[i], serv_name, sizeof(serv_name));
+        rc = sd_bus_message_append(m, "s", serv_name);
+    }
+    if (rc >= 0)
+        rc = sd_bus_message_close_container(m);
+    if (rc >= 0)
+        rc = sd_bus_message_close_container(m);
+    if (rc >= 0)
+        rc = sd_bus_message_close_container(m);
+    return rc;
+}
 
-    // Connect to systemd system bus
-    rc = sd_bus_open_system(&bus);
+// A start call systemd accepted, in target mode it pulls in every system service
+static void unit_job_mark_started(unit_t *p_unit, unit_service_t *p_serv)
+{
+    if (p_serv)
+    {
+        p_serv->started = true;
+        return;
+    }
+    p_unit->target_started = true;
+    for (size_t i = 0; i < p_unit->services.size; ++i)
+        p_unit->services.elem[i].started |= (p_unit->services.elem[i].sdscope == UNIT_SCOPE_SYSTEM);
+}
+
+// Marks what a start call is for as started and stores its job path, nothing is started if systemd refused it
+static int unit_job_reply(sd_bus_message *m, void *p_userdata, sd_bus_error *p_ret_error)
+{
+    unit_job_t *p_job = p_userdata;
+    unit_t *p_unit = p_job->p_unit;
+    unit_service_t *p_serv = p_job->p_pending;
+    const sd_bus_error *p_error = sd_bus_message_get_error(m);
+    char **pp_job_path = p_serv ? &p_serv->p_job_path : &p_unit->p_target_job_path;
+    char target[UNIT_NAME_MAX] = {0};
+    const char *p_path = NULL;
+    int rc = 0;
+    (void)p_ret_error;
+
+    p_job->p_call = sd_bus_slot_unref(p_job->p_call);
+    p_job->p_pending = NULL;
+    if (p_error && !p_serv && sd_bus_error_has_name(p_error, SD_ERROR_UNIT_EXISTS))
+    {
+        // Left over from a previous run, it still carries the dependencies
+        unit_target_name(p_unit, target, sizeof(target));
+        LOG_WRN("Transient unit %s already exists, starting it", target);
+        rc = sd_bus_call_method_async(bus_system(), &p_job->p_call, SD_DESTINATION, SD_PATH, SD_INTERFACE_MANAGER,
+                                      "StartUnit", unit_job_reply, p_job, "ss", target, "replace");
+        if (rc >= 0)
+            return 0;
+        LOG_ERR("Failed to issue method call: %s", strerror(-rc));
+    }
+    else if (p_error)
+    {
+        LOG_ERR("Failed to issue method call: %s", p_error->message);
+    }
+    else if (sd_bus_message_read(m, "o", &p_path) >= 0)
+    {
+        unit_job_mark_started(p_unit, p_serv);
+        free(*pp_job_path);
+        *pp_job_path = strdup(p_path);
+        LOG_INF("Queued job as %s", p_path);
+    }
+    (void)sd_event_source_set_enabled(p_job->p_step, SD_EVENT_ONESHOT);
+    return 0;
+}
+
+static int unit_job_start_service(unit_job_t *p_job, unit_service_t *p_serv)
+{
+    char serv_name[UNIT_NAME_MAX] = {0};
+    sd_bus *bus = bus_system();
+    const char *p_object = NULL;
+    int rc = 0;
+
+    if (!bus)
+        return -ENOTCONN;
+    unit_service_name(p_serv, serv_name, sizeof(serv_name));
+    p_object = unit_cache_path(serv_name);
+    // A prewarmed unit is addressed through its own object, systemd neither resolves nor loads it again
+    if (p_object)
+        rc = sd_bus_call_method_async(bus, &p_job->p_call, SD_DESTINATION, p_object, SD_INTERFACE_UNIT, "Start",
+                                      unit_job_reply, p_job, "s", "replace");
+    else
+        rc = sd_bus_call_method_async(bus, &p_job->p_call, SD_DESTINATION, SD_PATH, SD_INTERFACE_MANAGER,
+                                      "StartUnit", unit_job_reply, p_job, "ss", serv_name, "replace");
     if (rc < 0)
     {
-        LOG_ERR("Failed to connect to system bus: %s\n", strerror(-rc));
-        goto finish;
+        LOG_ERR("Failed to start %s: %s", serv_name, strerror(-rc));
+        return rc;
     }
+    p_job->p_pending = p_serv;
+    return rc;
+}
+
+static int unit_job_start_target(unit_job_t *p_job)
+{
+    unit_t *p_unit = p_job->p_unit;
+    char target[UNIT_NAME_MAX] = {0};
+    char desc[UNIT_NAME_MAX] = {0};
+    sd_bus_message *m = NULL;
+    sd_bus *bus = bus_system();
+    int rc;
 
-    // Issue the method call and store the response message in m
-    rc = sd_bus_call_method(bus, "org.freedesktop.systemd1",    /* service to contact */
-                            "/org/freedesktop/systemd1",        /* object path */
-                            "org.freedesktop.systemd1.Manager", /* interface name */
-                            p_method,                           /* method name, e.g "StartUnit" or "StopUnit" */
-                            &error,                             /* object to return error in */
-                            &m,                                 /* return message on success */
-                            "ss",                               /* input signature */
-                            serv_name,                          /* first argument */
-                            "replace");                         /* second argument */
+    unit_target_name(p_unit, target, sizeof(target));
+    (void)snprintf(desc, sizeof(desc), "Cartridge %s", p_unit->p_unit_name);
+    if (!bus)
+        return -ENOTCONN;
+
+    // One transient target wants every service and is ordered after them, so systemd's job engine
+    // schedules all starts in parallel within a single call. Stopping the target stops them again.
+    rc = sd_bus_message_new_method_call(bus, &m, SD_DESTINATION, SD_PATH, SD_INTERFACE_MANAGER, "StartTransientUnit");
+    if (rc >= 0)
+        rc = sd_bus_message_append(m, "ss", target, "replace");
+    if (rc >= 0)
+        rc = sd_bus_message_open_container(m, 'a', "(sv)");
+    if (rc >= 0)
+        rc = sd_bus_message_append(m, "(sv)", "Description", "s", desc);
+    if (rc >= 0)
+        rc = unit_append_deps(m, "Wants", p_unit);
+    if (rc >= 0)
+        rc = unit_append_deps(m, "After", p_unit);
+    if (rc >= 0)
+        rc = unit_append_deps(m, "PropagatesStopTo", p_unit);
+    if (rc >= 0)
+        rc = sd_bus_message_close_container(m);
+    if (rc >= 0)
+        rc = sd_bus_message_append(m, "a(sa(sv))", 0);
     if (rc < 0)
     {
-        LOG_ERR("Failed to issue method call: %s\n", error.message);
+        LOG_ERR("Failed to build transient unit request: %s", strerror(-rc));
         goto finish;
     }
 
-    // Parse the response message
-    rc = sd_bus_message_read(m, "o", &path);
+    rc = sd_bus_call_async(bus, &p_job->p_call, m, unit_job_reply, p_job, 0);
     if (rc < 0)
     {
-        LOG_ERR("Failed to parse response message: %s\n", strerror(-rc));
+        LOG_ERR("Failed to start %s: %s", target, strerror(-rc));
         goto finish;
     }
-
-    LOG_INF("Queued service job as %s.\n", path);
+    p_job->p_pending = NULL;
 
 finish:
-    sd_bus_error_free(&error);
     sd_bus_message_unref(m);
-    sd_bus_unref(bus);
-
     return rc;
 }
+
+// Issues the next start of the services phase, returns false once there is none left
+static bool unit_job_next_service(unit_job_t *p_job)
+{
+    unit_t *p_unit = p_job->p_unit;
+
+    // A resumed target is still there, its services that went down are started one by one
+    if ((p_unit->activation == UNIT_ACTIVATION_TARGET) && !p_job->resume)
+        return (p_job->idx++ == 0) && (unit_job_start_target(p_job) >= 0);
+    while (p_job->idx < (size_t)p_unit->services.size)
+    {
+        unit_service_t *p_serv = &p_unit->services.elem[p_job->idx++];
+        // User services are started on all user managers at once by unit_user_servcall()
+        if (p_serv->sdscope != UNIT_SCOPE_SYSTEM)
+            continue;
+        if (p_job->resume && unit_health_service_up(p_serv))
+            continue;
+        if (unit_job_start_service(p_job, p_serv) >= 0)
+            return true;
+    }
+    return false;
+}
+
+// Does one step of the activation: a module load, an overlay or one start call. Between two steps the event loop
+// runs, so a removal cancels the activation after at most one of them.
+static int unit_job_step(sd_event_source *p_source, void *p_userdata)
+{
+    unit_job_t *p_job = p_userdata;
+    unit_t *p_unit = p_job->p_unit;
+    (void)p_source;
+
+    switch (p_job->phase)
+    {
+    case UNIT_JOB_MODULES:
+        // Drivers first, then the hardware described by the overlays, both before the services using them start
+        if (p_job->idx < (size_t)p_unit->modules.size)
+        {
+            unit_module_t *p_mod = &p_unit->modules.elem[p_job->idx++];
+            bool inserted = false;
+            (void)module_load(p_mod->p_name, p_mod->p_options, &inserted);
+            p_mod->loaded = inserted || p_mod->loaded;
+            break;
+        }
+        p_job->phase = UNIT_JOB_OVERLAYS;
+        p_job->idx = 0;
+        /* fall through */
+    case UNIT_JOB_OVERLAYS:
+        if (p_job->idx < (size_t)p_unit->overlays.size)
+        {
+            unit_overlay_t *p_ov = &p_unit->overlays.elem[p_job->idx++];
+            p_ov->applied = (overlay_apply(p_ov->p_name, p_ov->p_source) == 0) || p_ov->applied;
+            break;
+        }
+        p_job->phase = UNIT_JOB_SERVICES;
+        p_job->idx = 0;
+        /* fall through */
+    case UNIT_JOB_SERVICES:
+        // The reply schedules the next step
+        if (unit_job_next_service(p_job))
+            return 0;
+        p_job->phase = UNIT_JOB_USER;
+        /* fall through */
+    case UNIT_JOB_USER:
+        p_job->phase = UNIT_JOB_DONE;
+        if (p_job->resume)
+            break;
+        p_unit->user_started = true;
+        unit_user_servcall("StartUnit", p_unit);
+        break;
+    default:
+        LOG_INF("Cartridge Unit '%s' activated", p_unit->p_unit_name);
+        unit_job_free(p_unit);
+        return 0;
+    }
+    (void)sd_event_source_set_enabled(p_job->p_step, SD_EVENT_ONESHOT);
+    return 0;
+}
+
+static void unit_job_free(unit_t *p_unit)
+{
+    unit_job_t *p_job = p_unit->p_job;
+
+    if (!p_job)
+        return;
+    // Only drops the reply, a start already sent is up to systemd and cancelled through its job
+    sd_bus_slot_unref(p_job->p_call);
+    sd_event_source_disable_unref(p_job->p_step);
+    free(p_job);
+    p_unit->p_job = NULL;
+}
+
+// A start whose reply is still awaited may have been queued already, so it is stopped like an accepted one
+static void unit_job_in_flight(unit_job_t *p_job)
+{
+    if (p_job->p_call && (p_job->phase == UNIT_JOB_SERVICES))
+        unit_job_mark_started(p_job->p_unit, p_job->p_pending);
+}
+
+// Cancels a queued job, systemd refuses it for jobs already done, which is as good
+static void unit_job_cancel(char **pp_job_path)
+{
+    sd_bus *bus = bus_system();
+
+    if (!*pp_job_path)
+        return;
+    if (bus)
+        (void)sd_bus_call_method_async(bus, NULL, SD_DESTINATION, *pp_job_path, SD_INTERFACE_JOB, "Cancel", NULL,
+                                       NULL, "");
+    free(*pp_job_path);
+    *pp_job_path = NULL;
+}
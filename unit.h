@@ -1,6 +1,8 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 
 typedef enum
 {
@@ -8,12 +10,26 @@ typedef enum
     UNIT_SCOPE_SYSTEM = 1
 } unit_service_scope_t;
 
+typedef enum
+{
+    UNIT_ACTIVATION_DEFAULT = 0,    // use the daemon wide setting
+    UNIT_ACTIVATION_SEQUENTIAL = 1, // one StartUnit/StopUnit call per service
+    UNIT_ACTIVATION_TARGET = 2      // one transient target pulling in all services
+} unit_activation_t;
+
 typedef struct
 {
     char *p_name;
     int prio;
     char *p_sdunit;
     unit_service_scope_t sdscope;
+    // Last known systemd state, tracked while the cartridge is active
+    char active_state[16];
+    char sub_state[32];
+    struct sd_bus_slot *p_watch;
+    struct sd_bus_slot *p_state_call; // initial state read of the health watch, NULL once answered
+    bool started;      // a start was issued for it since the last stop
+    char *p_job_path; // start job systemd queued for it, NULL if none
 } unit_service_t;
 
 typedef struct
@@ -22,11 +38,66 @@ typedef struct
     unit_service_t *elem;
 } unit_services_t;
 
+// Device tree overlay, applied before the services start and removed after they stopped
+typedef struct
+{
+    char *p_name;
+    char *p_source; // .dts or .dtbo, absolute once parsed
+    bool applied;
+} unit_overlay_t;
+
+typedef struct
+{
+    int size;
+    unit_overlay_t *elem;
+} unit_overlays_t;
+
+// Kernel module or alias, loaded before the overlays are applied
+typedef struct
+{
+    char *p_name;
+    char *p_options; // NULL if the module takes none
+    bool loaded; // inserted by the daemon, only then is it unloaded again
+} unit_module_t;
+
+typedef struct
+{
+    int size;
+    unit_module_t *elem;
+} unit_modules_t;
+
+// Inclusive range of cartridge IDs a unit file applies to
+typedef struct
+{
+    uint64_t lo;
+    uint64_t hi;
+    uint8_t len; // number of bytes the IDs are read with, 0 for IDs of any length
+} unit_match_t;
+
+typedef struct
+{
+    int size;
+    unit_match_t *elem;
+} unit_matches_t;
+
+// Activation in progress, see unit_activate()
+typedef struct unit_job unit_job_t;
+
 typedef struct
 {
     char *p_unit_name;
     char *p_description;
+    char *p_icon;
+    unit_activation_t activation;
+    unit_matches_t matches;
     unit_services_t services;
+    unit_overlays_t overlays;
+    unit_modules_t modules;
+    bool user_started;
+    bool target_started;
+    char *p_target_job_path;
+    struct sd_bus_slot *p_job_watch; // clears the job paths once systemd finished their jobs
+    unit_job_t *p_job; // NULL once the activation finished or was cancelled
 } unit_t;
 
 typedef enum
@@ -35,7 +106,9 @@ typedef enum
     UNIT_PARSE_ERR = 1,
     UNIT_PARSE_FILE_ERR = 2,
     UNIT_PARSE_SYN_ERR = 3,
-    UNIT_PARSE_BAD_SERV_SCOPE = 4
+    UNIT_PARSE_BAD_SERV_SCOPE = 4,
+    UNIT_PARSE_BAD_ACTIVATION = 5,
+    UNIT_PARSE_BAD_MATCH = 6
 } unit_parse_result_t;
 
 typedef enum
@@ -45,8 +118,21 @@ typedef enum
     UNIT_FIND_NOTFOUND = 2
 } unit_find_result_t;
 
-unit_find_result_t unit_find(const uint16_t id, const char *const p_path, char *p_name);
+// On success *pp_unit is owned by the caller and released with unit_destroy()
 unit_parse_result_t unit_parse(unit_t **pp_unit, const char *const p_path);
 void unit_destroy(unit_t *p_unit);
+// Writes the unit in unit file syntax, with its activation mode resolved
+int unit_write(const unit_t *p_unit, FILE *p_file);
+int unit_activation_from_str(const char *const p_str, unit_activation_t *p_activation);
+// Runs one step per event loop iteration and returns right away, unit_deactive() cancels what is still left
 void unit_activate(unit_t *p_unit);
-void unit_deactive(unit_t *p_unit);
+// Treats everything of the unit as started, for units left active by a previous run
+void unit_assume_active(unit_t *p_unit);
+// Starts only the system services unit_health reports as down, for units taken over from a previous run
+void unit_resume(unit_t *p_unit);
+// Has systemd load all system services of the unit ahead of its activation
+void unit_prewarm(const unit_t *p_unit);
+// Compiles the overlays of the unit into the overlay cache
+void unit_prepare_overlays(const unit_t *p_unit);
+void unit_deactive(unit_t *p_unit, const unsigned timeout_ms);
+void unit_deinit(void);
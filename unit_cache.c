@@ -0,0 +1,139 @@
+#include "unit_cache.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bus.h"
+#include "log.h"
+
+#define UNIT_CACHE_MAX (256)
+#define SD_DESTINATION "org.freedesktop.systemd1"
+#define SD_PATH "/org/freedesktop/systemd1"
+#define SD_INTERFACE_MANAGER "org.freedesktop.systemd1.Manager"
+
+typedef struct
+{
+    char *p_name;
+    char *p_path;        // NULL until LoadUnit answered
+    sd_bus_slot *p_slot; // pending LoadUnit call
+} unit_cache_entry_t;
+
+static unit_cache_entry_t s_entries[UNIT_CACHE_MAX];
+static size_t s_entry_cnt = 0;
+static bool s_full_logged = false;
+
+// Paths and pending calls belong to the old connection, everything is resolved again on the new one
+static void unit_cache_reconnected(sd_bus *p_bus)
+{
+    (void)p_bus;
+    LOG_INF("Dropping %zu cached unit paths after reconnecting", s_entry_cnt);
+    unit_cache_clear();
+}
+
+void unit_cache_init(void)
+{
+    static bool s_init = false;
+
+    if (s_init)
+        return;
+    s_init = true;
+    if (bus_on_reconnect(unit_cache_reconnected) < 0)
+        LOG_WRN("%s", "Unit cache is not dropped on reconnects");
+}
+
+static unit_cache_entry_t *unit_cache_find(const char *const p_name)
+{
+    for (size_t i = 0; i < s_entry_cnt; ++i)
+    {
+        if (strcmp(s_entries[i].p_name, p_name) == 0)
+            return &s_entries[i];
+    }
+    return NULL;
+}
+
+static unit_cache_entry_t *unit_cache_add(const char *const p_name)
+{
+    unit_cache_entry_t *p_entry = unit_cache_find(p_name);
+    if (p_entry)
+        return p_entry;
+    if (s_entry_cnt >= UNIT_CACHE_MAX)
+    {
+        // Uncached units still work, they are only resolved by systemd on each start
+        if (!s_full_logged)
+            LOG_WRN("Unit cache is full (%d entries), '%s' and further units are not cached", UNIT_CACHE_MAX,
+                    p_name);
+        s_full_logged = true;
+        return NULL;
+    }
+    unit_cache_init();
+    p_entry = &s_entries[s_entry_cnt];
+    *p_entry = (unit_cache_entry_t){.p_name = strdup(p_name), .p_path = NULL, .p_slot = NULL};
+    if (!p_entry->p_name)
+        return NULL;
+    s_entry_cnt++;
+    return p_entry;
+}
+
+static int unit_cache_loaded(sd_bus_message *m, void *userdata, sd_bus_error *ret_error)
+{
+    unit_cache_entry_t *p_entry = userdata;
+    const char *p_path = NULL;
+    (void)ret_error;
+
+    p_entry->p_slot = sd_bus_slot_unref(p_entry->p_slot);
+    // Without a path nor a pending call the entry is prewarmed again next time
+    if (sd_bus_message_is_method_error(m, NULL))
+    {
+        LOG_WRN("Could not prewarm '%s': %s", p_entry->p_name, sd_bus_message_get_error(m)->message);
+        return 0;
+    }
+    if ((sd_bus_message_read(m, "o", &p_path) >= 0) && !p_entry->p_path)
+        p_entry->p_path = strdup(p_path);
+    return 0;
+}
+
+// Asks systemd to load the unit now, the reply is dispatched by the event loop later on
+void unit_cache_prewarm(const char *const p_name)
+{
+    sd_bus *p_bus = bus_system();
+    unit_cache_entry_t *p_entry = NULL;
+    int rc = 0;
+
+    if (!p_bus)
+        return;
+    p_entry = unit_cache_add(p_name);
+    if (!p_entry || p_entry->p_path || p_entry->p_slot)
+        return;
+    rc = sd_bus_call_method_async(p_bus, &p_entry->p_slot, SD_DESTINATION, SD_PATH, SD_INTERFACE_MANAGER, "LoadUnit",
+                                  unit_cache_loaded, p_entry, "s", p_name);
+    if (rc < 0)
+        LOG_WRN("Could not prewarm '%s': %s", p_name, strerror(-rc));
+}
+
+void unit_cache_store(const char *const p_name, const char *const p_path)
+{
+    unit_cache_entry_t *p_entry = unit_cache_add(p_name);
+    if (!p_entry || p_entry->p_path)
+        return;
+    p_entry->p_path = strdup(p_path);
+}
+
+const char *unit_cache_path(const char *const p_name)
+{
+    const unit_cache_entry_t *p_entry = unit_cache_find(p_name);
+    return p_entry ? p_entry->p_path : NULL;
+}
+
+void unit_cache_clear(void)
+{
+    for (size_t i = 0; i < s_entry_cnt; ++i)
+    {
+        sd_bus_slot_unref(s_entries[i].p_slot);
+        free(s_entries[i].p_name);
+        free(s_entries[i].p_path);
+    }
+    s_entry_cnt = 0;
+    s_full_logged = false;
+}
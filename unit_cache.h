@@ -0,0 +1,9 @@
+#pragma once
+
+// Object paths of systemd units, resolved ahead of time so activation does not wait for systemd to load them
+// Has the cache dropped on reconnects, users that resolve units again after a reconnect register after this
+void unit_cache_init(void);
+void unit_cache_prewarm(const char *const p_name);
+void unit_cache_store(const char *const p_name, const char *const p_path);
+const char *unit_cache_path(const char *const p_name);
+void unit_cache_clear(void);
@@ -0,0 +1,250 @@
+#include "unit_health.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bus.h"
+#include "log.h"
+#include "unit_cache.h"
+
+#define SD_DESTINATION "org.freedesktop.systemd1"
+#define SD_PATH_UNIT "/org/freedesktop/systemd1/unit"
+#define SD_INTERFACE_UNIT "org.freedesktop.systemd1.Unit"
+#define SD_INTERFACE_PROPERTIES "org.freedesktop.DBus.Properties"
+
+static unit_t *s_unit = NULL;
+static unit_health_cb s_listener = NULL;
+static unit_health_ready_cb s_ready = NULL;
+// Initial state reads of s_unit without a reply yet
+static size_t s_reads = 0;
+
+static void health_unwatch_slots(unit_t *p_unit)
+{
+    for (size_t i = 0; i < p_unit->services.size; ++i)
+    {
+        p_unit->services.elem[i].p_watch = sd_bus_slot_unref(p_unit->services.elem[i].p_watch);
+        p_unit->services.elem[i].p_state_call = sd_bus_slot_unref(p_unit->services.elem[i].p_state_call);
+    }
+}
+
+// The matches went with the old connection, the states are unknown until they are read again
+static void health_reconnected(sd_bus *p_bus)
+{
+    (void)p_bus;
+    if (!s_unit)
+        return;
+    LOG_INF("Watching the services of '%s' again", s_unit->p_unit_name);
+    health_unwatch_slots(s_unit);
+    // A caller still waiting for the states is answered from the new connection
+    unit_health_watch(s_unit, s_listener, s_ready);
+}
+
+static void health_update(unit_service_t *p_serv, const char *p_active, const char *p_sub)
+{
+    const bool was_failed = (strcmp(p_serv->active_state, "failed") == 0);
+
+    if (p_active)
+        (void)snprintf(p_serv->active_state, sizeof(p_serv->active_state), "%s", p_active);
+    if (p_sub)
+        (void)snprintf(p_serv->sub_state, sizeof(p_serv->sub_state), "%s", p_sub);
+    LOG_INF("Service '%s' is %s (%s)", p_serv->p_sdunit, p_serv->active_state, p_serv->sub_state);
+
+    // Flag a failure once per transition, not for every following property change
+    if (s_listener && s_unit)
+        s_listener(s_unit, p_serv, !was_failed && (strcmp(p_serv->active_state, "failed") == 0));
+}
+
+// Reads ActiveState and SubState from unit properties as sent by GetAll and PropertiesChanged, both are left NULL
+// if they are not included. The strings point into the message.
+static int health_read_states(sd_bus_message *m, const char **pp_active, const char **pp_sub)
+{
+    int rc = sd_bus_message_enter_container(m, 'a', "{sv}");
+    while ((rc >= 0) && (sd_bus_message_enter_container(m, 'e', "sv") > 0))
+    {
+        const char *p_name = NULL;
+        rc = sd_bus_message_read(m, "s", &p_name);
+        if ((rc >= 0) && (strcmp(p_name, "ActiveState") == 0))
+            rc = sd_bus_message_read(m, "v", "s", pp_active);
+        else if ((rc >= 0) && (strcmp(p_name, "SubState") == 0))
+            rc = sd_bus_message_read(m, "v", "s", pp_sub);
+        else if (rc >= 0)
+            rc = sd_bus_message_skip(m, "v");
+        if (rc >= 0)
+            rc = sd_bus_message_exit_container(m);
+    }
+    return rc;
+}
+
+static int health_properties_changed(sd_bus_message *m, void *userdata, sd_bus_error *ret_error)
+{
+    unit_service_t *p_serv = userdata;
+    const char *p_interface = NULL;
+    const char *p_active = NULL;
+    const char *p_sub = NULL;
+    int rc = 0;
+    (void)ret_error;
+
+    rc = sd_bus_message_read(m, "s", &p_interface);
+    if ((rc < 0) || (strcmp(p_interface, SD_INTERFACE_UNIT) != 0))
+        return 0;
+    rc = health_read_states(m, &p_active, &p_sub);
+    if (rc < 0)
+    {
+        LOG_ERR("Failed to parse PropertiesChanged of '%s': %s", p_serv->p_sdunit, strerror(-rc));
+        return 0;
+    }
+    if (p_active || p_sub)
+        health_update(p_serv, p_active, p_sub);
+    return 0;
+}
+
+static void health_read_done(void)
+{
+    unit_health_ready_cb p_ready = s_ready;
+
+    if ((s_reads == 0) || (--s_reads > 0))
+        return;
+    s_ready = NULL;
+    if (p_ready && s_unit)
+        p_ready(s_unit);
+}
+
+static int health_state_read(sd_bus_message *m, void *userdata, sd_bus_error *ret_error)
+{
+    unit_service_t *p_serv = userdata;
+    const char *p_active = NULL;
+    const char *p_sub = NULL;
+    int rc = 0;
+    (void)ret_error;
+
+    p_serv->p_state_call = sd_bus_slot_unref(p_serv->p_state_call);
+    if (sd_bus_message_is_method_error(m, NULL))
+        LOG_ERR("Failed to read the state of '%s': %s", p_serv->p_sdunit, sd_bus_message_get_error(m)->message);
+    else if ((rc = health_read_states(m, &p_active, &p_sub)) < 0)
+        LOG_ERR("Failed to parse the state of '%s': %s", p_serv->p_sdunit, strerror(-rc));
+    else if (p_active || p_sub)
+        health_update(p_serv, p_active, p_sub);
+    health_read_done();
+    return 0;
+}
+
+// Watches for changes first and then reads the current state, so no transition in between is missed
+static int health_watch_service(sd_bus *p_bus, unit_service_t *p_serv)
+{
+    char name[255] = {0};
+    char *p_encoded = NULL;
+    const char *p_path = NULL;
+    int rc = 0;
+
+    p_serv->p_watch = sd_bus_slot_unref(p_serv->p_watch);
+    p_serv->p_state_call = sd_bus_slot_unref(p_serv->p_state_call);
+    (void)snprintf(name, sizeof(name), "%s.service", p_serv->p_sdunit);
+    // Prewarmed units are known already, others are addressed by their escaped name, which loads them like LoadUnit
+    p_path = unit_cache_path(name);
+    if (!p_path)
+    {
+        rc = sd_bus_path_encode(SD_PATH_UNIT, name, &p_encoded);
+        p_path = p_encoded;
+    }
+    if (rc >= 0)
+        rc = sd_bus_match_signal_async(p_bus, &p_serv->p_watch, SD_DESTINATION, p_path, SD_INTERFACE_PROPERTIES,
+                                       "PropertiesChanged", health_properties_changed, NULL, p_serv);
+    if (rc >= 0)
+        rc = sd_bus_call_method_async(p_bus, &p_serv->p_state_call, SD_DESTINATION, p_path, SD_INTERFACE_PROPERTIES,
+                                      "GetAll", health_state_read, p_serv, "s", SD_INTERFACE_UNIT);
+    if (rc < 0)
+        LOG_ERR("Failed to watch '%s': %s", name, strerror(-rc));
+    free(p_encoded);
+    return rc;
+}
+
+void unit_health_watch(unit_t *p_unit, unit_health_cb p_listener, unit_health_ready_cb p_ready)
+{
+    static bool s_init = false;
+    sd_bus *p_bus = bus_system();
+
+    if (!s_init)
+    {
+        // The cache is dropped first, the watches set up again below must not find paths of the old connection
+        unit_cache_init();
+        if (bus_on_reconnect(health_reconnected) < 0)
+            LOG_WRN("%s", "Service health is not watched again after reconnects");
+    }
+    s_init = true;
+    s_ready = NULL;
+    s_reads = 0;
+    if (p_bus)
+    {
+        s_unit = p_unit;
+        s_listener = p_listener;
+        for (size_t i = 0; i < p_unit->services.size; ++i)
+        {
+            unit_service_t *p_serv = &p_unit->services.elem[i];
+            if (p_serv->sdscope != UNIT_SCOPE_SYSTEM)
+                continue;
+            (void)snprintf(p_serv->active_state, sizeof(p_serv->active_state), "%s", "unknown");
+            p_serv->sub_state[0] = '\0';
+            if (health_watch_service(p_bus, p_serv) >= 0)
+                s_reads++;
+        }
+    }
+    // Nothing to wait for, the states known now are all there will be
+    if (s_reads > 0)
+        s_ready = p_ready;
+    else if (p_ready)
+        p_ready(p_unit);
+}
+
+void unit_health_unwatch(unit_t *p_unit)
+{
+    health_unwatch_slots(p_unit);
+    if (s_unit == p_unit)
+    {
+        s_unit = NULL;
+        s_listener = NULL;
+        s_ready = NULL;
+        s_reads = 0;
+    }
+}
+
+bool unit_health_service_up(const unit_service_t *p_serv)
+{
+    return (strcmp(p_serv->active_state, "active") == 0) || (strcmp(p_serv->active_state, "activating") == 0) ||
+           (strcmp(p_serv->active_state, "reloading") == 0);
+}
+
+bool unit_health_all_active(const unit_t *p_unit)
+{
+    for (size_t i = 0; i < p_unit->services.size; ++i)
+    {
+        const unit_service_t *p_serv = &p_unit->services.elem[i];
+        if ((p_serv->sdscope == UNIT_SCOPE_SYSTEM) && !unit_health_service_up(p_serv))
+            return false;
+    }
+    return true;
+}
+
+size_t unit_health_summary(const unit_t *p_unit, char *p_buf, const size_t size)
+{
+    size_t watched = 0;
+    size_t active = 0;
+    const char *p_failed = NULL;
+
+    for (size_t i = 0; i < p_unit->services.size; ++i)
+    {
+        const unit_service_t *p_serv = &p_unit->services.elem[i];
+        if (p_serv->sdscope != UNIT_SCOPE_SYSTEM)
+            continue;
+        watched++;
+        if (strcmp(p_serv->active_state, "active") == 0)
+            active++;
+        else if (!p_failed && (strcmp(p_serv->active_state, "failed") == 0))
+            p_failed = p_serv->p_sdunit;
+    }
+    if (p_failed)
+        return snprintf(p_buf, size, "%zu/%zu services active, '%s' failed", active, watched, p_failed);
+    return snprintf(p_buf, size, "%zu/%zu services active", active, watched);
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "unit.h"
+
+typedef void (*unit_health_cb)(unit_t * /*p_unit*/, unit_service_t * /*p_serv*/, const bool /*failed*/);
+typedef void (*unit_health_ready_cb)(unit_t * /*p_unit*/);
+
+// Never waits for systemd: the states are read asynchronously, p_ready (may be NULL) is called once all of them
+// are known, right away if there is nothing to read
+void unit_health_watch(unit_t *p_unit, unit_health_cb p_listener, unit_health_ready_cb p_ready);
+void unit_health_unwatch(unit_t *p_unit);
+// True if the service is active or on its way there
+bool unit_health_service_up(const unit_service_t *p_serv);
+// True if every system service is active or on its way there
+bool unit_health_all_active(const unit_t *p_unit);
+size_t unit_health_summary(const unit_t *p_unit, char *p_buf, const size_t size);
@@ -0,0 +1,232 @@
+#include "unit_stop.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bus.h"
+#include "log.h"
+#include "util.h"
+#include "watchdog.h"
+
+#define UNIT_STOP_MAX (32)
+// JobRemoved signals kept until the StopUnit reply naming their job arrives
+#define UNIT_STOP_EARLY_MAX (8)
+#define UNIT_STOP_PATH_MAX (128)
+#define SD_DESTINATION "org.freedesktop.systemd1"
+#define SD_PATH "/org/freedesktop/systemd1"
+#define SD_INTERFACE_MANAGER "org.freedesktop.systemd1.Manager"
+
+typedef struct unit_stop unit_stop_t;
+
+typedef struct
+{
+    const char *p_unit;
+    char job[UNIT_STOP_PATH_MAX]; // stop job from the StopUnit reply, empty until it arrived
+    bool issued;
+    bool done;
+    unit_stop_t *p_stop;
+    sd_bus_slot *p_slot;
+    sd_bus_slot *p_kill_slot;
+} unit_stop_job_t;
+
+typedef struct
+{
+    char job[UNIT_STOP_PATH_MAX];
+    char result[16];
+} unit_stop_early_t;
+
+struct unit_stop
+{
+    unit_stop_job_t jobs[UNIT_STOP_MAX];
+    size_t cnt;
+    size_t pending; // stop jobs issued and not done
+    size_t kills;   // KillUnit calls without a reply
+    unit_stop_early_t early[UNIT_STOP_EARLY_MAX];
+    size_t early_next;
+};
+
+static uint64_t time_now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000U + ts.tv_nsec / 1000U;
+}
+
+static void stop_job_done(unit_stop_job_t *p_job, const char *const p_result)
+{
+    if (p_job->done)
+        return;
+    p_job->done = true;
+    p_job->p_stop->pending--;
+    LOG_INF("Stopped '%s' (%s)", p_job->p_unit, p_result);
+}
+
+static int stop_reply(sd_bus_message *m, void *userdata, sd_bus_error *ret_error)
+{
+    unit_stop_job_t *p_job = userdata;
+    unit_stop_t *p_stop = p_job->p_stop;
+    const char *p_path = NULL;
+    (void)ret_error;
+
+    // On success completion is signalled by JobRemoved, only failures end the job here
+    if (sd_bus_message_is_method_error(m, NULL))
+    {
+        LOG_ERR("StopUnit of '%s' failed: %s", p_job->p_unit, sd_bus_message_get_error(m)->message);
+        stop_job_done(p_job, "error");
+        return 0;
+    }
+    if (sd_bus_message_read(m, "o", &p_path) < 0)
+        return 0;
+    (void)snprintf(p_job->job, sizeof(p_job->job), "%s", p_path);
+    // The job may have finished before its reply was processed
+    for (size_t i = 0; i < UNIT_STOP_EARLY_MAX; ++i)
+    {
+        if (strcmp(p_stop->early[i].job, p_job->job) == 0)
+            stop_job_done(p_job, p_stop->early[i].result);
+    }
+    return 0;
+}
+
+static int stop_job_removed(sd_bus_message *m, void *userdata, sd_bus_error *ret_error)
+{
+    unit_stop_t *p_stop = userdata;
+    uint32_t id = 0;
+    const char *p_path = NULL;
+    const char *p_unit = NULL;
+    const char *p_result = NULL;
+    bool awaited = false;
+    (void)ret_error;
+
+    if (sd_bus_message_read(m, "uoss", &id, &p_path, &p_unit, &p_result) < 0)
+        return 0;
+    // Matched by job, a cancelled start job of the same unit must not count as its stop
+    for (size_t i = 0; i < p_stop->cnt; ++i)
+    {
+        unit_stop_job_t *p_job = &p_stop->jobs[i];
+        if (!p_job->issued || p_job->done)
+            continue;
+        if (strcmp(p_job->job, p_path) == 0)
+            stop_job_done(p_job, p_result);
+        else if ((p_job->job[0] == '\0') && (strcmp(p_job->p_unit, p_unit) == 0))
+            awaited = true;
+    }
+    if (awaited)
+    {
+        unit_stop_early_t *p_early = &p_stop->early[p_stop->early_next++ % UNIT_STOP_EARLY_MAX];
+        (void)snprintf(p_early->job, sizeof(p_early->job), "%s", p_path);
+        (void)snprintf(p_early->result, sizeof(p_early->result), "%s", p_result);
+    }
+    return 0;
+}
+
+static int stop_kill_reply(sd_bus_message *m, void *userdata, sd_bus_error *ret_error)
+{
+    unit_stop_job_t *p_job = userdata;
+    (void)ret_error;
+
+    if (sd_bus_message_is_method_error(m, NULL))
+        LOG_ERR("KillUnit of '%s' failed: %s", p_job->p_unit, sd_bus_message_get_error(m)->message);
+    p_job->p_stop->kills--;
+    return 0;
+}
+
+static void stop_issue(sd_bus *p_bus, unit_stop_job_t *p_job)
+{
+    const int rc = sd_bus_call_method_async(p_bus, &p_job->p_slot, SD_DESTINATION, SD_PATH, SD_INTERFACE_MANAGER,
+                                            "StopUnit", stop_reply, p_job, "ss", p_job->p_unit, "replace");
+
+    p_job->issued = true;
+    p_job->p_stop->pending++;
+    if (rc < 0)
+    {
+        LOG_ERR("Failed to issue StopUnit of '%s': %s", p_job->p_unit, strerror(-rc));
+        stop_job_done(p_job, "error");
+    }
+}
+
+static void stop_kill(sd_bus *p_bus, unit_stop_job_t *p_job)
+{
+    int rc = 0;
+
+    LOG_WRN("'%s' did not stop in time, killing it", p_job->p_unit);
+    rc = sd_bus_call_method_async(p_bus, &p_job->p_kill_slot, SD_DESTINATION, SD_PATH, SD_INTERFACE_MANAGER,
+                                  "KillUnit", stop_kill_reply, p_job, "ssi", p_job->p_unit, "all", SIGKILL);
+    if (rc < 0)
+        LOG_ERR("Failed to issue KillUnit of '%s': %s", p_job->p_unit, strerror(-rc));
+    else
+        p_job->p_stop->kills++;
+}
+
+// Dispatches the bus until the stop jobs, and the kills if asked for, are done or the time is up. The deadline also
+// holds while messages keep arriving, e.g. state changes of other units.
+static void stop_wait(sd_bus *p_bus, unit_stop_t *p_stop, const uint64_t until, const bool kills)
+{
+    while ((p_stop->pending > 0) || (kills && (p_stop->kills > 0)))
+    {
+        const uint64_t now = time_now_us();
+        if (now >= until)
+            break;
+        // The event loop does not run meanwhile, keep the watchdog fed from here
+        watchdog_kick();
+        const int rc = sd_bus_process(p_bus, NULL);
+        if (rc < 0)
+            break;
+        if (rc == 0)
+            sd_bus_wait(p_bus, MIN(until - now, watchdog_due_us()));
+    }
+}
+
+// Queues a stop job for every unit at once, in the given order. systemd orders the jobs by the dependencies between
+// the units, so only units that depend on each other stop one after the other. Three quarters of the time budget
+// go to that. Units not stopped by then are killed, and the rest of the budget is spent waiting for those calls, so
+// the caller returns within the budget.
+int unit_stop_all(const char *const *pp_units, const size_t count, const unsigned timeout_ms)
+{
+    unit_stop_t stop = {0};
+    sd_bus_slot *p_match = NULL;
+    sd_bus *p_bus = bus_system();
+    const uint64_t start = time_now_us();
+    const uint64_t kill_at = start + (uint64_t)timeout_ms * 750U;
+    const uint64_t deadline = start + (uint64_t)timeout_ms * 1000U;
+    int rc = 0;
+
+    if (!p_bus)
+        return -ENOTCONN;
+    if (count == 0)
+        return 0;
+
+    rc = sd_bus_match_signal(p_bus, &p_match, SD_DESTINATION, SD_PATH, SD_INTERFACE_MANAGER, "JobRemoved",
+                             stop_job_removed, &stop);
+    if (rc < 0)
+    {
+        LOG_ERR("Failed to watch for finished jobs: %s", strerror(-rc));
+        return rc;
+    }
+
+    for (size_t i = 0; (i < count) && (stop.cnt < UNIT_STOP_MAX); ++i)
+        stop.jobs[stop.cnt++] = (unit_stop_job_t){.p_unit = pp_units[i], .p_stop = &stop};
+    for (size_t i = 0; i < stop.cnt; ++i)
+        stop_issue(p_bus, &stop.jobs[i]);
+    stop_wait(p_bus, &stop, kill_at, false);
+
+    for (size_t i = 0; i < stop.cnt; ++i)
+    {
+        if (!stop.jobs[i].done)
+            stop_kill(p_bus, &stop.jobs[i]);
+    }
+    stop_wait(p_bus, &stop, deadline, true);
+    rc = (stop.pending == 0) ? 0 : -ETIMEDOUT;
+    // Dropping the slots cancels callbacks still in flight, they must not reach this stack frame anymore
+    for (size_t i = 0; i < stop.cnt; ++i)
+    {
+        sd_bus_slot_unref(stop.jobs[i].p_slot);
+        sd_bus_slot_unref(stop.jobs[i].p_kill_slot);
+    }
+    sd_bus_slot_unref(p_match);
+    return rc;
+}
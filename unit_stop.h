@@ -0,0 +1,5 @@
+#pragma once
+
+#include <stddef.h>
+
+int unit_stop_all(const char *const *pp_units, const size_t count, const unsigned timeout_ms);
@@ -0,0 +1,227 @@
+#include "userbus.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <systemd/sd-bus.h>
+#include <systemd/sd-login.h>
+#include <time.h>
+
+#include "log.h"
+#include "util.h"
+#include "watchdog.h"
+
+#define USERBUS_MAX (16)
+// Upper bound for all users together, calls only queue jobs and return quickly
+#define USERBUS_TIMEOUT_US (5000000ULL)
+
+typedef struct
+{
+    uid_t uid;
+    sd_bus *p_bus;
+    unsigned pending;
+} userbus_t;
+
+typedef struct
+{
+    userbus_t *p_user;
+    const char *p_method;
+    const char *p_unit;
+    unsigned *p_pending;
+} userbus_call_t;
+
+// Connections to the user managers are kept open between activations
+static userbus_t s_buses[USERBUS_MAX] = {0};
+static size_t s_bus_cnt = 0;
+
+static uint64_t time_now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000U + ts.tv_nsec / 1000U;
+}
+
+static void userbus_drop(const size_t idx)
+{
+    sd_bus_flush_close_unref(s_buses[idx].p_bus);
+    s_buses[idx] = s_buses[--s_bus_cnt];
+    s_buses[s_bus_cnt].p_bus = NULL;
+}
+
+static sd_bus *userbus_connect(const uid_t uid)
+{
+    char address[64] = {0};
+    sd_bus *p_bus = NULL;
+    int rc = 0;
+
+    // The private socket of the user manager accepts root, unlike the user's session bus
+    (void)snprintf(address, sizeof(address), "unix:path=/run/user/%u/systemd/private", (unsigned)uid);
+    rc = sd_bus_new(&p_bus);
+    if (rc >= 0)
+        rc = sd_bus_set_address(p_bus, address);
+    if (rc >= 0)
+        rc = sd_bus_start(p_bus);
+    if (rc < 0)
+    {
+        LOG_ERR("Failed to connect to user manager of uid %u: %s", (unsigned)uid, strerror(-rc));
+        p_bus = sd_bus_unref(p_bus);
+    }
+    return p_bus;
+}
+
+static userbus_t *userbus_get(const uid_t uid)
+{
+    for (size_t i = 0; i < s_bus_cnt; ++i)
+    {
+        if (s_buses[i].uid != uid)
+            continue;
+        if (sd_bus_is_open(s_buses[i].p_bus) <= 0)
+        {
+            // The user manager went away, reconnect in place
+            sd_bus_flush_close_unref(s_buses[i].p_bus);
+            s_buses[i].p_bus = userbus_connect(uid);
+        }
+        return s_buses[i].p_bus ? &s_buses[i] : NULL;
+    }
+    if (s_bus_cnt >= USERBUS_MAX)
+    {
+        LOG_WRN("Too many user sessions, not reaching uid %u", (unsigned)uid);
+        return NULL;
+    }
+    s_buses[s_bus_cnt] = (userbus_t){.uid = uid, .p_bus = userbus_connect(uid), .pending = 0};
+    return s_buses[s_bus_cnt].p_bus ? &s_buses[s_bus_cnt++] : NULL;
+}
+
+static int userbus_reply(sd_bus_message *m, void *userdata, sd_bus_error *ret_error)
+{
+    userbus_call_t *p_call = userdata;
+    const char *path = NULL;
+    (void)ret_error;
+
+    if (sd_bus_message_is_method_error(m, NULL))
+    {
+        LOG_ERR("%s of %s for uid %u failed: %s", p_call->p_method, p_call->p_unit, (unsigned)p_call->p_user->uid,
+                sd_bus_message_get_error(m)->message);
+    }
+    else if (sd_bus_message_read(m, "o", &path) >= 0)
+    {
+        LOG_INF("Queued user service job for uid %u as %s.", (unsigned)p_call->p_user->uid, path);
+    }
+    p_call->p_user->pending--;
+    (*p_call->p_pending)--;
+    return 0;
+}
+
+static void userbus_wait(unsigned *p_pending, userbus_t **pp_users, const size_t user_cnt)
+{
+    struct pollfd fds[USERBUS_MAX];
+    const uint64_t deadline = time_now_us() + USERBUS_TIMEOUT_US;
+
+    while (*p_pending > 0)
+    {
+        size_t nfds = 0;
+        for (size_t i = 0; i < user_cnt; ++i)
+        {
+            // Dispatch everything already received before sleeping
+            while (sd_bus_process(pp_users[i]->p_bus, NULL) > 0)
+                ;
+        }
+        if (*p_pending == 0)
+            break;
+        const uint64_t now = time_now_us();
+        if (now >= deadline)
+        {
+            LOG_ERR("%u user manager calls timed out", *p_pending);
+            break;
+        }
+        for (size_t i = 0; i < user_cnt; ++i)
+        {
+            if (pp_users[i]->pending == 0)
+                continue;
+            fds[nfds].fd = sd_bus_get_fd(pp_users[i]->p_bus);
+            fds[nfds].events = sd_bus_get_events(pp_users[i]->p_bus);
+            fds[nfds].revents = 0;
+            nfds++;
+        }
+        // The event loop does not run meanwhile, keep the watchdog fed from here
+        watchdog_kick();
+        if ((poll(fds, nfds, (MIN(deadline - now, watchdog_due_us()) + 999) / 1000) < 0) && (errno != EINTR))
+            break;
+    }
+}
+
+int userbus_call_all(const char *const p_method, const char *const *pp_units, const size_t count)
+{
+    uid_t *p_uids = NULL;
+    userbus_t *p_users[USERBUS_MAX] = {0};
+    userbus_call_t *p_calls = NULL;
+    size_t user_cnt = 0;
+    size_t call_cnt = 0;
+    unsigned pending = 0;
+    int uid_cnt = 0;
+    int rc = 0;
+
+    if (count == 0)
+        return 0;
+    uid_cnt = sd_get_uids(&p_uids);
+    if (uid_cnt < 0)
+    {
+        LOG_ERR("Failed to enumerate logged in users: %s", strerror(-uid_cnt));
+        return uid_cnt;
+    }
+    p_calls = calloc((uid_cnt > 0) ? uid_cnt * count : 1, sizeof(*p_calls));
+    if (!p_calls)
+    {
+        free(p_uids);
+        return -ENOMEM;
+    }
+
+    // Queue the calls on every user's connection first, then wait for all replies at once,
+    // so the total time is that of the slowest user rather than the sum of all users.
+    for (int u = 0; (u < uid_cnt) && (user_cnt < USERBUS_MAX); ++u)
+    {
+        userbus_t *p_user = userbus_get(p_uids[u]);
+        if (!p_user)
+            continue;
+        p_users[user_cnt++] = p_user;
+        for (size_t i = 0; i < count; ++i)
+        {
+            userbus_call_t *p_call = &p_calls[call_cnt++];
+            *p_call = (userbus_call_t){
+                .p_user = p_user, .p_method = p_method, .p_unit = pp_units[i], .p_pending = &pending};
+            rc = sd_bus_call_method_async(p_user->p_bus, NULL, "org.freedesktop.systemd1", "/org/freedesktop/systemd1",
+                                          "org.freedesktop.systemd1.Manager", p_method, userbus_reply, p_call, "ss",
+                                          pp_units[i], "replace");
+            if (rc < 0)
+            {
+                LOG_ERR("Failed to issue %s of %s for uid %u: %s", p_method, pp_units[i], (unsigned)p_user->uid,
+                        strerror(-rc));
+                continue;
+            }
+            p_user->pending++;
+            pending++;
+        }
+    }
+    userbus_wait(&pending, p_users, user_cnt);
+
+    // Connections that broke or timed out are reopened on next use
+    for (size_t i = 0; i < s_bus_cnt;)
+    {
+        if ((s_buses[i].pending > 0) || !s_buses[i].p_bus || (sd_bus_is_open(s_buses[i].p_bus) <= 0))
+            userbus_drop(i);
+        else
+            ++i;
+    }
+    free(p_calls);
+    free(p_uids);
+    return (pending == 0) ? 0 : -ETIMEDOUT;
+}
+
+void userbus_deinit(void)
+{
+    while (s_bus_cnt > 0)
+        userbus_drop(0);
+}
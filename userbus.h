@@ -0,0 +1,6 @@
+#pragma once
+
+#include <stddef.h>
+
+int userbus_call_all(const char *const p_method, const char *const *pp_units, const size_t count);
+void userbus_deinit(void);
@@ -1,3 +1,9 @@
 #pragma once
 
 #define NELEMS(arr) (sizeof(arr) / sizeof(arr[0]))
+#ifndef MIN
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+#endif
+#ifndef MAX
+#define MAX(a, b) (((a) > (b)) ? (a) : (b))
+#endif
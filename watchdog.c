@@ -0,0 +1,93 @@
+#include "watchdog.h"
+
+#include <stdatomic.h>
+#include <systemd/sd-daemon.h>
+#include <time.h>
+
+#include "log.h"
+
+// Advanced by the detection thread on every iteration, so the watchdog also covers a stuck read path
+static atomic_ulong s_heartbeat = 0;
+static unsigned long s_last_heartbeat = 0;
+static uint64_t s_interval_us = 0;
+static uint64_t s_last_ping_us = 0;
+
+static uint64_t time_now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000U + ts.tv_nsec / 1000U;
+}
+
+static void watchdog_ping(const uint64_t now_us)
+{
+    // Only vouch for the daemon if the detection thread made progress since the last ping
+    const unsigned long heartbeat = atomic_load_explicit(&s_heartbeat, memory_order_relaxed);
+
+    s_last_ping_us = now_us;
+    if (heartbeat != s_last_heartbeat)
+    {
+        s_last_heartbeat = heartbeat;
+        sd_notify(0, "WATCHDOG=1");
+    }
+    else
+    {
+        LOG_WRN("%s", "Detection thread made no progress, withholding watchdog ping");
+    }
+}
+
+static int watchdog_timer(sd_event_source *p_source, uint64_t usec, void *p_userdata)
+{
+    (void)p_userdata;
+    watchdog_ping(time_now_us());
+    sd_event_source_set_time(p_source, usec + s_interval_us);
+    return sd_event_source_set_enabled(p_source, SD_EVENT_ON);
+}
+
+int watchdog_setup(sd_event *p_event)
+{
+    const uint64_t timeout_us = watchdog_timeout_us();
+    int rc = 0;
+
+    if (timeout_us == 0)
+        return 0;
+    // Ping twice per timeout as recommended by sd_watchdog_enabled(3)
+    s_interval_us = timeout_us / 2;
+    s_last_ping_us = time_now_us();
+    rc = sd_event_add_time_relative(p_event, NULL, CLOCK_MONOTONIC, s_interval_us, 0, watchdog_timer, NULL);
+    if (rc < 0)
+    {
+        s_interval_us = 0;
+        return rc;
+    }
+    LOG_INF("Watchdog enabled, pinging every %llu us", (unsigned long long)s_interval_us);
+    return 0;
+}
+
+void watchdog_beat(void)
+{
+    atomic_fetch_add_explicit(&s_heartbeat, 1, memory_order_relaxed);
+}
+
+void watchdog_kick(void)
+{
+    const uint64_t now_us = time_now_us();
+
+    if ((s_interval_us > 0) && (now_us - s_last_ping_us >= s_interval_us))
+        watchdog_ping(now_us);
+}
+
+uint64_t watchdog_due_us(void)
+{
+    const uint64_t now_us = time_now_us();
+
+    if (s_interval_us == 0)
+        return UINT64_MAX;
+    return (now_us - s_last_ping_us >= s_interval_us) ? 0 : (s_last_ping_us + s_interval_us - now_us);
+}
+
+uint64_t watchdog_timeout_us(void)
+{
+    uint64_t timeout_us = 0;
+    return (sd_watchdog_enabled(0, &timeout_us) > 0) ? timeout_us : 0;
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <stdint.h>
+#include <systemd/sd-event.h>
+
+// Arms a timer sending WATCHDOG=1 if the service manager asked for pings
+int watchdog_setup(sd_event *p_event);
+// Called by the detection thread on every iteration, pings are only sent while it makes progress
+void watchdog_beat(void);
+// Pings from waits of the main thread that keep the event loop from running, if a ping is due
+void watchdog_kick(void);
+// Time until the next ping is due, long waits sleep no longer than this. UINT64_MAX without a watchdog.
+uint64_t watchdog_due_us(void);
+// Timeout requested by the service manager, 0 if there is none
+uint64_t watchdog_timeout_us(void);